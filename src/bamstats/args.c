@@ -37,6 +37,8 @@ static struct argp_option options[] = {
         "Directory for outputting histogram information. (default: bamstats-histograms)", 0},
     {"recalc_qual", 0x900, 0, 0,
         "Force recomputing mean quality, else use 'qs' tag in BAM if present.", 0},
+    {"read_format", 0xA00, "FORMAT", 0,
+        "Format of the per-read output to stdout: tsv, or columns for a chunked columnar binary file with the same columns, in which strings repeated between reads are stored once. (default: tsv)", 0},
     
     {0, 0, 0, 0,
         "Read filtering options:", 0},
@@ -150,6 +152,12 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
         case 0x900:
             arguments->force_recalc_qual = true;
             break;
+        case 0xA00:
+            if (strcmp(arg, "tsv") && strcmp(arg, "columns")) {
+                argp_error(state, "Unknown read_format '%s'.", arg);
+            }
+            arguments->read_columns = strcmp(arg, "columns") == 0;
+            break;
         case 0x1000:
             slurp_args(&arguments->coverage_beds, &arguments->n_coverage_beds, arg, state);
             break;
@@ -216,6 +224,7 @@ arguments_t parse_arguments(int argc, char** argv) {
     args.tag_value = -1;
     args.threads = 1;
     args.force_recalc_qual = false;
+    args.read_columns = false;
     args.coverage = false;
     args.coverages = "bamstats-coverages";  // will be overwrite by user
     args.coverage_beds = NULL;
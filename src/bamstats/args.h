@@ -24,6 +24,7 @@ typedef struct arguments {
     int threads;
     bool unmapped;
     bool force_recalc_qual;
+    bool read_columns;
     // coverage calculations
     bool coverage;
     char* coverages;
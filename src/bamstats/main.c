@@ -122,7 +122,14 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    write_header(args.sample);
+    tsv_writer tsv = NULL;
+    column_writer columns = NULL;
+    if (args.read_columns) {
+        columns = bamstats_columns(stdout, args.sample);
+    } else {
+        write_header(args.sample);
+        tsv = open_tsv_writer(stdout, NULL);
+    }
 
     htsFile *fp = hts_open(args.bam, "rb");
     sam_hdr_t *hdr = sam_hdr_read(fp);
@@ -187,7 +194,7 @@ int main(int argc, char *argv[]) {
             length_stats, qual_stats, acc_stats, cov_stats,
             length_stats_unmapped, qual_stats_unmapped,
             polya_stats, args.poly_a_cover, args.poly_a_qual, args.poly_a_rev,
-            run_ids, basecallers, args.force_recalc_qual, coverage);
+            run_ids, basecallers, args.force_recalc_qual, coverage, tsv, columns);
 
         // write flagstat counts if requested
         if (flag_counts != NULL) {
@@ -225,7 +232,7 @@ int main(int argc, char *argv[]) {
                 length_stats, qual_stats, acc_stats, cov_stats,
                 length_stats_unmapped, qual_stats_unmapped,
                 polya_stats, args.poly_a_cover, args.poly_a_qual, args.poly_a_rev,
-                run_ids, basecallers, args.force_recalc_qual, coverage);
+                run_ids, basecallers, args.force_recalc_qual, coverage, tsv, columns);
             if (flag_counts != NULL) {
                 // TODO: regions might not be whole chromosomes...
                 write_stats(flag_counts->counts[0], rit.chr, args.sample, flagstats);
@@ -237,6 +244,9 @@ int main(int argc, char *argv[]) {
         hts_idx_destroy(idx);
     }
 
+    close_tsv_writer(tsv);
+    close_column_writer(columns);
+
     write_hist_stats(length_stats, args.histograms, "length.hist");
     write_hist_stats(qual_stats, args.histograms, "quality.hist");
     write_hist_stats(acc_stats, args.histograms, "accuracy.hist");
@@ -285,6 +295,7 @@ int main(int argc, char *argv[]) {
     }
 
     destroy_args(&args);
+    destroy_rg_cache();
 
     clock_t end = clock();
     fprintf(stderr, "Total CPU time: %fs\n", (double)(end - begin) / CLOCKS_PER_SEC);
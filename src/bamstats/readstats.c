@@ -235,6 +235,25 @@ void free_bam_tags(bam_tags_t *tags) {
 }
 
 
+column_writer bamstats_columns(FILE* fp, const char* sample) {
+    // unavailable positions are -1 and proportions NaN, as for unmapped reads
+    column_def columns[] = {
+        {"name", COLUMN_STR}, {"runid", COLUMN_DICT}, {"sample_name", COLUMN_DICT}, {"ref", COLUMN_DICT},
+        {"coverage", COLUMN_F32}, {"ref_coverage", COLUMN_F32},
+        {"qstart", COLUMN_I64}, {"qend", COLUMN_I64}, {"rstart", COLUMN_I64}, {"rend", COLUMN_I64},
+        {"aligned_ref_len", COLUMN_U64}, {"direction", COLUMN_DICT}, {"length", COLUMN_U64},
+        {"read_length", COLUMN_U32}, {"mean_quality", COLUMN_F32}, {"start_time", COLUMN_STR},
+        {"match", COLUMN_U64}, {"ins", COLUMN_U64}, {"del", COLUMN_U64}, {"sub", COLUMN_U64},
+        {"iden", COLUMN_F32}, {"acc", COLUMN_F32}, {"duplex", COLUMN_I64}};
+    size_t n_columns = sizeof(columns) / sizeof(column_def);
+    if (sample == NULL) {
+        memmove(&columns[2], &columns[3], (n_columns - 3) * sizeof(column_def));
+        n_columns--;
+    }
+    return open_column_writer(fp, columns, n_columns);
+}
+
+
 // Do all-the-things
 void process_bams(
         htsFile *fp, hts_idx_t *idx, sam_hdr_t *hdr, const char *sample,
@@ -244,7 +263,8 @@ void process_bams(
         read_stats* length_stats, read_stats* qual_stats, read_stats* acc_stats, read_stats* cov_stats,
         read_stats* length_stats_unmapped, read_stats* qual_stats_unmapped,
         read_stats* polya_stats, float polya_cover, float polya_qual, bool polya_rev,
-        kh_counter_t* runids, kh_counter_t* basecallers, bool force_recalc_qual, cov_writer coverage) {
+        kh_counter_t* runids, kh_counter_t* basecallers, bool force_recalc_qual, cov_writer coverage,
+        tsv_writer tsv, column_writer columns) {
     if (chr != NULL) {
         if (strcmp(chr, "*") == 0) {
             fprintf(stderr, "Processing: Unplaced reads\n");
@@ -262,7 +282,7 @@ void process_bams(
 
     int res;
     bam1_t *b = bam_init1();
-    readgroup* rg_info = NULL;
+    const readgroup* rg_info = NULL;
     char *runid = NULL;
     char *basecaller = NULL;
     char *start_time = NULL;
@@ -284,7 +304,7 @@ void process_bams(
         basecaller = "";
         start_time = "";
         if (tags.RG != NULL) {
-            rg_info = create_rg_info(tags.RG);
+            rg_info = get_rg_info(tags.RG);
             if (rg_info->runid != NULL) {
                 runid = rg_info->runid;
             }
@@ -309,34 +329,39 @@ void process_bams(
                 char* qname = bam_get_qname(b);
                 uint32_t read_length = b->core.l_qseq;
                 float mean_quality = mean_qual_from_bam(bam_get_qual(b), read_length);
-                if (sample == NULL) {
-                    fprintf(stdout,
-                        "%s\t%s\t*\tnan\tnan\t" \
-                        "nan\tnan\tnan\tnan\t" \
-                        "0\t*\t0\t" \
-                        "%u\t%.2f\t%s\t" \
-                        "0\t0\t0\t0\tnan\tnan\t%d\n",
-                        qname, runid, //chr, coverage, ref_cover,
-                        //qstart, qend, rstart, rend,
-                        //aligned_ref_len, direction, length,
-                        read_length, mean_quality, start_time,
-                        //match, ins, delt, sub, iden, acc
-                        tags.dx
-                    );
+                if (columns != NULL) {
+                    column_str(columns, qname);
+                    column_str(columns, runid);
+                    if (sample != NULL) column_str(columns, sample);
+                    column_str(columns, "*");
+                    column_f32(columns, NAN);
+                    column_f32(columns, NAN);
+                    for (size_t i = 0; i < 4; ++i) column_i64(columns, -1);
+                    column_u64(columns, 0);
+                    column_str(columns, "*");
+                    column_u64(columns, 0);
+                    column_u32(columns, read_length);
+                    column_f32(columns, mean_quality);
+                    column_str(columns, start_time);
+                    for (size_t i = 0; i < 4; ++i) column_u64(columns, 0);
+                    column_f32(columns, NAN);
+                    column_f32(columns, NAN);
+                    column_i64(columns, tags.dx);
+                    column_end_row(columns);
                 } else {
-                    fprintf(stdout,
-                        "%s\t%s\t%s\t*\tnan\tnan\t" \
-                        "nan\tnan\tnan\tnan\t" \
-                        "0\t*\t0\t" \
-                        "%u\t%.2f\t%s\t" \
-                        "0\t0\t0\t0\tnan\tnan\t%d\n",
-                        qname, runid, sample, //chr, coverage, ref_cover,
-                        //qstart, qend, rstart, rend,
-                        //aligned_ref_len, direction, length,
-                        read_length, mean_quality, start_time,
-                        //match, ins, delt, sub, iden, acc
-                        tags.dx
-                    );
+                    tsv_str(tsv, qname);
+                    tsv_str(tsv, runid);
+                    if (sample != NULL) tsv_str(tsv, sample);
+                    // chr, coverage, ref_cover, qstart, qend, rstart, rend,
+                    // aligned_ref_len, direction, length
+                    tsv_str(tsv, "*\tnan\tnan\tnan\tnan\tnan\tnan\t0\t*\t0");
+                    tsv_u64(tsv, read_length);
+                    tsv_float(tsv, mean_quality, 2);
+                    tsv_str(tsv, start_time);
+                    // match, ins, delt, sub, iden, acc
+                    tsv_str(tsv, "0\t0\t0\t0\tnan\tnan");
+                    tsv_i64(tsv, tags.dx);
+                    tsv_end_row(tsv);
                 }
                 // add to flagstat counts if required
                 if (flag_counts != NULL) {
@@ -390,7 +415,7 @@ void process_bams(
         // get mean quality score, from tag or recompute
         float mean_quality = tags.qs;
         if (mean_quality == -1 || force_recalc_qual) {
-            mean_quality = mean_qual_from_bam_naive(bam_get_qual(b), read_length);
+            mean_quality = mean_qual_from_bam(bam_get_qual(b), read_length);
         }
 
         float coverage = 100 * ((float)(qend - qstart)) / read_length;
@@ -426,35 +451,60 @@ void process_bams(
             }
         }
 
-        if (sample == NULL) {
-            fprintf(stdout,
-                "%s\t%s\t%s\t" \
-                "%.4f\t%.4f\t" \
-                "%lu\t%lu\t%lu\t%lu\t" \
-                "%lu\t%c\t%lu\t%u\t%.2f\t%s\t" \
-                "%lu\t%lu\t%lu\t%lu\t%.2f\t%.2f\t%d\n",
-                qname, runid, (chr != NULL) ? chr : sam_hdr_tid2name(hdr, b->core.tid),
-                coverage, ref_cover,
-                qstart, qend, rstart, rend,
-                aligned_ref_len, direction, length, read_length, mean_quality, start_time,
-                match, ins, delt, sub, iden, acc, tags.dx);
+        if (columns != NULL) {
+            column_str(columns, qname);
+            column_str(columns, runid);
+            if (sample != NULL) column_str(columns, sample);
+            column_str(columns, (chr != NULL) ? chr : sam_hdr_tid2name(hdr, b->core.tid));
+            column_f32(columns, coverage);
+            column_f32(columns, ref_cover);
+            column_i64(columns, qstart);
+            column_i64(columns, qend);
+            column_i64(columns, rstart);
+            column_i64(columns, rend);
+            column_u64(columns, aligned_ref_len);
+            column_str(columns, bam_is_rev(b) ? "-" : "+");
+            column_u64(columns, length);
+            column_u32(columns, read_length);
+            column_f32(columns, mean_quality);
+            column_str(columns, start_time);
+            column_u64(columns, match);
+            column_u64(columns, ins);
+            column_u64(columns, delt);
+            column_u64(columns, sub);
+            column_f32(columns, iden);
+            column_f32(columns, acc);
+            column_i64(columns, tags.dx);
+            column_end_row(columns);
         } else {
-            fprintf(stdout,
-                "%s\t%s\t%s\t%s\t" \
-                "%.4f\t%.4f\t" \
-                "%lu\t%lu\t%lu\t%lu\t" \
-                "%lu\t%c\t%lu\t%u\t%.2f\t%s\t" \
-                "%lu\t%lu\t%lu\t%lu\t%.2f\t%.2f\t%d\n",
-                qname, runid, sample, (chr != NULL) ? chr : sam_hdr_tid2name(hdr, b->core.tid),
-                coverage, ref_cover,
-                qstart, qend, rstart, rend,
-                aligned_ref_len, direction, length, read_length, mean_quality, start_time,
-                match, ins, delt, sub, iden, acc, tags.dx);
+            tsv_str(tsv, qname);
+            tsv_str(tsv, runid);
+            if (sample != NULL) tsv_str(tsv, sample);
+            tsv_str(tsv, (chr != NULL) ? chr : sam_hdr_tid2name(hdr, b->core.tid));
+            tsv_float(tsv, coverage, 4);
+            tsv_float(tsv, ref_cover, 4);
+            tsv_u64(tsv, qstart);
+            tsv_u64(tsv, qend);
+            tsv_u64(tsv, rstart);
+            tsv_u64(tsv, rend);
+            tsv_u64(tsv, aligned_ref_len);
+            tsv_char(tsv, direction);
+            tsv_u64(tsv, length);
+            tsv_u64(tsv, read_length);
+            tsv_float(tsv, mean_quality, 2);
+            tsv_str(tsv, start_time);
+            tsv_u64(tsv, match);
+            tsv_u64(tsv, ins);
+            tsv_u64(tsv, delt);
+            tsv_u64(tsv, sub);
+            tsv_float(tsv, iden, 2);
+            tsv_float(tsv, acc, 2);
+            tsv_i64(tsv, tags.dx);
+            tsv_end_row(tsv);
         }
 		free(stats);
 
 FINISH_READ:
-        destroy_rg_info(rg_info);
         rg_info = NULL;
         runid = NULL;
         basecaller = NULL;
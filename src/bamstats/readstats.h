@@ -6,7 +6,9 @@
 
 #include "args.h"
 #include "../bamcoverage/coverage.h"
+#include "../columns.h"
 #include "../stats.h"
+#include "../tsv.h"
 #include "../kh_counter.h"
 
 
@@ -62,7 +64,9 @@ void destroy_flag_stats(flag_stats* stats);
  *  @param basecallers kh_counter_t* for accumulating basecaller information.
  *  @param force_recalc_quality whether to recalculate mean quality from phred scores.
  *  @param coverage a coverage writer object to use for calculating coverage.
- *  @returns void. Prints output to stdout.
+ *  @param tsv per-read output as TSV, or NULL.
+ *  @param columns per-read output as columns, see bamstats_columns(), or NULL.
+ *  @returns void.
  *
  */
 void process_bams(
@@ -73,6 +77,16 @@ void process_bams(
     read_stats* length_stats, read_stats* qual_stats, read_stats* acc_stats, read_stats* cov_stats,
     read_stats* length_stats_unmapped, read_stats* qual_stats_unmapped,
     read_stats* polya_stats, float polya_cover, float polya_qual, bool polya_rev,
-    kh_counter_t* runids, kh_counter_t* basecallers, bool force_recalc_quality, cov_writer coverage);
+    kh_counter_t* runids, kh_counter_t* basecallers, bool force_recalc_quality, cov_writer coverage,
+    tsv_writer tsv, column_writer columns);
+
+/** Start per-read output as columns, with the columns of the TSV output.
+ *
+ *  @param fp output file.
+ *  @param sample sample name, adds a sample_name column if not NULL.
+ *  @returns a column writer.
+ *
+ */
+column_writer bamstats_columns(FILE* fp, const char* sample);
 
 #endif
@@ -0,0 +1,318 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "htslib/hts_endian.h"
+#include "htslib/khash.h"
+#include "htslib/kstring.h"
+
+#include "common.h"
+#include "columns.h"
+
+static const char columns_magic[8] = {'R', 'D', 'C', 'O', 'L', 'S', '\0', 1};
+
+KHASH_MAP_INIT_STR(COLUMN_DICT, uint32_t)
+
+// Values of a column for the rows of a chunk, in their encoded form
+typedef struct {
+    kstring_t values;   // fixed-width values, string end offsets or dictionary indices
+    kstring_t strings;  // COLUMN_STR bytes, or COLUMN_DICT entries added by the chunk
+    uint32_t n_new;     // COLUMN_DICT entries added by the chunk
+} column_data;
+
+typedef struct {
+    uint32_t n_rows;
+    column_data* columns;
+} column_chunk;
+
+struct _column_writer {
+    FILE* fp;
+    size_t n_columns;
+    column_type* types;
+    khash_t(COLUMN_DICT)** dicts;  // for COLUMN_DICT columns, else NULL
+    size_t column;  // of the next value of the current row
+    kstring_t key;  // scratch space for dictionary lookup
+    column_chunk* filling;
+    // chunks are handed to the background thread through `pending`, and
+    // returned for reuse through `spare`
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    column_chunk* pending;
+    column_chunk* spare;
+    bool writing;  // whether the background thread holds a chunk
+    bool done;
+};
+
+
+static void _put_u32(kstring_t* out, uint32_t x) {
+    uint8_t buf[4];
+    u32_to_le(x, buf);
+    kputsn((char*)buf, 4, out);
+}
+
+static void _put_u64(kstring_t* out, uint64_t x) {
+    uint8_t buf[8];
+    u64_to_le(x, buf);
+    kputsn((char*)buf, 8, out);
+}
+
+static void _put_str(kstring_t* out, const char* str, size_t len) {
+    _put_u32(out, (uint32_t)len);
+    kputsn(str, len, out);
+}
+
+
+static column_chunk* _create_chunk(size_t n_columns) {
+    column_chunk* chunk = xalloc(1, sizeof(column_chunk), "column chunk");
+    chunk->columns = xalloc(n_columns, sizeof(column_data), "column chunk");
+    return chunk;
+}
+
+static void _reset_chunk(column_chunk* chunk, size_t n_columns) {
+    chunk->n_rows = 0;
+    for (size_t i = 0; i < n_columns; ++i) {
+        chunk->columns[i].values.l = 0;
+        chunk->columns[i].strings.l = 0;
+        chunk->columns[i].n_new = 0;
+    }
+}
+
+static void _destroy_chunk(column_chunk* chunk, size_t n_columns) {
+    if (chunk == NULL) return;
+    for (size_t i = 0; i < n_columns; ++i) {
+        free(chunk->columns[i].values.s);
+        free(chunk->columns[i].strings.s);
+    }
+    free(chunk->columns);
+    free(chunk);
+}
+
+
+static void _write(column_writer writer, const void* data, size_t len) {
+    if (len > 0 && fwrite(data, 1, len, writer->fp) != len) {
+        fprintf(stderr, "Error writing per-read columns.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void _write_chunk(column_writer writer, column_chunk* chunk) {
+    uint8_t buf[8];
+    u32_to_le(chunk->n_rows, buf);
+    _write(writer, buf, 4);
+    for (size_t i = 0; i < writer->n_columns; ++i) {
+        column_data* data = &chunk->columns[i];
+        uint64_t size = data->values.l + data->strings.l;
+        if (writer->types[i] == COLUMN_DICT) size += 4;
+        u64_to_le(size, buf);
+        _write(writer, buf, 8);
+        switch (writer->types[i]) {
+            case COLUMN_STR:
+                _write(writer, data->values.s, data->values.l);
+                _write(writer, data->strings.s, data->strings.l);
+                break;
+            case COLUMN_DICT:
+                u32_to_le(data->n_new, buf);
+                _write(writer, buf, 4);
+                _write(writer, data->strings.s, data->strings.l);
+                _write(writer, data->values.s, data->values.l);
+                break;
+            default:
+                _write(writer, data->values.s, data->values.l);
+        }
+    }
+}
+
+
+static void* _writer_thread(void* arg) {
+    column_writer writer = arg;
+    pthread_mutex_lock(&writer->lock);
+    while (true) {
+        while (writer->pending == NULL && !writer->done) {
+            pthread_cond_wait(&writer->cond, &writer->lock);
+        }
+        if (writer->pending == NULL) break;
+        column_chunk* chunk = writer->pending;
+        writer->pending = NULL;
+        writer->writing = true;
+        pthread_mutex_unlock(&writer->lock);
+
+        _write_chunk(writer, chunk);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->writing = false;
+        if (writer->spare == NULL) writer->spare = chunk;
+        else _destroy_chunk(chunk, writer->n_columns);
+        pthread_cond_broadcast(&writer->cond);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// Hand the filling chunk to the background thread, waiting whilst the
+// previous chunk is pending
+static void _submit_chunk(column_writer writer) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->pending != NULL) {
+        pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+    writer->pending = writer->filling;
+    column_chunk* chunk = writer->spare;
+    writer->spare = NULL;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+
+    if (chunk == NULL) chunk = _create_chunk(writer->n_columns);
+    _reset_chunk(chunk, writer->n_columns);
+    writer->filling = chunk;
+}
+
+// Wait until all submitted chunks are written
+static void _wait_written(column_writer writer) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->pending != NULL || writer->writing) {
+        pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+}
+
+
+column_writer open_column_writer(FILE* fp, const column_def* columns, size_t n_columns) {
+    column_writer writer = xalloc(1, sizeof(_column_writer), "column writer");
+    writer->fp = fp;
+    writer->n_columns = n_columns;
+    writer->types = xalloc(n_columns, sizeof(column_type), "column writer");
+    writer->dicts = xalloc(n_columns, sizeof(khash_t(COLUMN_DICT)*), "column writer");
+
+    kstring_t header = {0, 0, NULL};
+    kputsn(columns_magic, sizeof(columns_magic), &header);
+    _put_u32(&header, (uint32_t)n_columns);
+    for (size_t i = 0; i < n_columns; ++i) {
+        writer->types[i] = columns[i].type;
+        if (columns[i].type == COLUMN_DICT) writer->dicts[i] = kh_init(COLUMN_DICT);
+        kputc((uint8_t)columns[i].type, &header);
+        _put_str(&header, columns[i].name, strlen(columns[i].name));
+    }
+    _write(writer, header.s, header.l);
+    free(header.s);
+
+    writer->filling = _create_chunk(n_columns);
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    if (pthread_create(&writer->thread, NULL, _writer_thread, writer) != 0) {
+        fprintf(stderr, "Error creating per-read column writer thread.\n");
+        exit(EXIT_FAILURE);
+    }
+    return writer;
+}
+
+
+static column_data* _next_value(column_writer writer, column_type type) {
+    if (writer->column >= writer->n_columns || writer->types[writer->column] != type) {
+        fprintf(stderr, "Error: per-read column %zu given a value of the wrong type.\n", writer->column);
+        exit(EXIT_FAILURE);
+    }
+    return &writer->filling->columns[writer->column++];
+}
+
+void column_strn(column_writer writer, const char* value, size_t len) {
+    size_t column = writer->column;
+    bool dict = column < writer->n_columns && writer->types[column] == COLUMN_DICT;
+    column_data* data = _next_value(writer, dict ? COLUMN_DICT : COLUMN_STR);
+    if (!dict) {
+        kputsn(value, len, &data->strings);
+        _put_u32(&data->values, (uint32_t)data->strings.l);
+        return;
+    }
+    // the value need not be terminated
+    writer->key.l = 0;
+    kputsn(value, len, &writer->key);
+    khash_t(COLUMN_DICT)* dict_index = writer->dicts[column];
+    khiter_t k = kh_get(COLUMN_DICT, dict_index, writer->key.s);
+    if (k == kh_end(dict_index)) {
+        int ret;
+        uint32_t index = kh_size(dict_index);
+        k = kh_put(COLUMN_DICT, dict_index, strdup(writer->key.s), &ret);
+        kh_val(dict_index, k) = index;
+        _put_str(&data->strings, value, len);
+        data->n_new++;
+    }
+    _put_u32(&data->values, kh_val(dict_index, k));
+}
+
+void column_str(column_writer writer, const char* value) {
+    column_strn(writer, value, strlen(value));
+}
+
+void column_u32(column_writer writer, uint32_t value) {
+    _put_u32(&_next_value(writer, COLUMN_U32)->values, value);
+}
+
+void column_i64(column_writer writer, int64_t value) {
+    _put_u64(&_next_value(writer, COLUMN_I64)->values, (uint64_t)value);
+}
+
+void column_u64(column_writer writer, uint64_t value) {
+    _put_u64(&_next_value(writer, COLUMN_U64)->values, value);
+}
+
+void column_f32(column_writer writer, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+    _put_u32(&_next_value(writer, COLUMN_F32)->values, bits);
+}
+
+
+void column_end_row(column_writer writer) {
+    if (writer->column != writer->n_columns) {
+        fprintf(stderr, "Error: per-read row given %zu of %zu columns.\n", writer->column, writer->n_columns);
+        exit(EXIT_FAILURE);
+    }
+    writer->column = 0;
+    if (++writer->filling->n_rows == COLUMN_CHUNK_ROWS) {
+        _submit_chunk(writer);
+    }
+}
+
+
+void flush_column_writer(column_writer writer) {
+    if (writer->filling->n_rows > 0) _submit_chunk(writer);
+    _wait_written(writer);
+    fflush(writer->fp);
+}
+
+
+void close_column_writer(column_writer writer) {
+    if (writer == NULL) return;
+    if (writer->filling->n_rows > 0) _submit_chunk(writer);
+    pthread_mutex_lock(&writer->lock);
+    writer->done = true;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    // the empty chunk marks the end of the file
+    uint8_t end[4];
+    u32_to_le(0, end);
+    _write(writer, end, 4);
+    fflush(writer->fp);
+
+    for (size_t i = 0; i < writer->n_columns; ++i) {
+        khash_t(COLUMN_DICT)* dict = writer->dicts[i];
+        if (dict == NULL) continue;
+        for (khiter_t k = kh_begin(dict); k != kh_end(dict); ++k) {
+            if (kh_exist(dict, k)) free((char*)kh_key(dict, k));
+        }
+        kh_destroy(COLUMN_DICT, dict);
+    }
+    _destroy_chunk(writer->filling, writer->n_columns);
+    _destroy_chunk(writer->spare, writer->n_columns);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->cond);
+    free(writer->dicts);
+    free(writer->key.s);
+    free(writer->types);
+    free(writer);
+}
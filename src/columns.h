@@ -0,0 +1,79 @@
+#ifndef FASTCAT_COLUMNS_H
+#define FASTCAT_COLUMNS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Chunked columnar binary output for per-read summaries, an alternative to
+// TSV that is smaller and faster both to write and to load.
+//
+// All values are little-endian. A file is:
+//
+//   magic        8 bytes, "RDCOLS\0" followed by the format version (1)
+//   n_columns    u32
+//   per column   u8 type, then its name as a string
+//   chunks       repeated until one with n_rows of zero, which ends the file
+//
+// where a string is a u32 length followed by its bytes (not terminated), and
+// a chunk (row group) is:
+//
+//   n_rows       u32
+//   per column   u64 size in bytes of the column's data, then the data
+//
+// Column data by type:
+//
+//   COLUMN_STR   n_rows u32 end offsets into the bytes that follow, then the
+//                bytes of the chunk's strings
+//   COLUMN_DICT  u32 number of entries added to the dictionary by the chunk,
+//                those entries as strings, then n_rows u32 indices into the
+//                column's dictionary (all entries of it and of previous chunks)
+//   COLUMN_U32   n_rows u32
+//   COLUMN_I64   n_rows i64, with -1 where a value is not available
+//   COLUMN_U64   n_rows u64
+//   COLUMN_F32   n_rows IEEE 754 single precision floats
+typedef enum {
+    COLUMN_STR = 1, COLUMN_DICT, COLUMN_U32, COLUMN_I64, COLUMN_U64, COLUMN_F32
+} column_type;
+
+typedef struct {
+    const char* name;
+    column_type type;
+} column_def;
+
+// rows per chunk
+#define COLUMN_CHUNK_ROWS 65536
+
+// Writes rows to a file, each full chunk is written by a background thread
+// whilst the next is filled.
+typedef struct _column_writer _column_writer;
+typedef _column_writer* column_writer;
+
+/** Start writing columns to a file.
+ *
+ *  @param fp output file, which remains owned by the caller.
+ *  @param columns column names and types.
+ *  @param n_columns number of columns.
+ *  @returns a column writer.
+ *
+ */
+column_writer open_column_writer(FILE* fp, const column_def* columns, size_t n_columns);
+
+// Add the next value of the current row, values are given in column order
+// and must be of the column's type: strings for both COLUMN_STR and COLUMN_DICT.
+void column_str(column_writer writer, const char* value);
+void column_strn(column_writer writer, const char* value, size_t len);
+void column_u32(column_writer writer, uint32_t value);
+void column_i64(column_writer writer, int64_t value);
+void column_u64(column_writer writer, uint64_t value);
+void column_f32(column_writer writer, float value);
+
+// Complete the current row, which must have a value for every column
+void column_end_row(column_writer writer);
+
+// Write the rows added so far, as a short chunk if required, and flush the file
+void flush_column_writer(column_writer writer);
+
+// Write any remaining rows and the end of the file, the file is not closed
+void close_column_writer(column_writer writer);
+
+#endif
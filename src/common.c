@@ -1,8 +1,9 @@
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <libgen.h>
 #include <math.h>
-#include <regex.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -13,6 +14,7 @@
 #include <unistd.h>
 
 #include "common.h"
+#include "htslib/khash.h"
 
 
 // used with qsort to sort an array of uint32_t
@@ -371,32 +373,67 @@ inline void kahan_sum(double* sum, double term, double* c) {
 }
 
 
-inline float mean_qual(char* qual, size_t len) {
-    if (len == 0 ) return nanf("");
-    double qsum = 0;
-    double c = 0;
-    for (size_t i=0; i<len; ++i) {
-        int q = (int)(qual[i]) - 33;
-        kahan_sum(&qsum, qprobs[q], &c);
+// Quality scores are histogrammed into one counter per entry of qprobs, the
+// error probability sum is then a single dot product with the table. Scores
+// outside of the table are clamped to its ends.
+#define QUAL_BINS (sizeof(qprobs) / sizeof(qprobs[0]))
+#define QUAL_TABLES 4
+
+static inline size_t _clamp_qual(uint8_t q, uint8_t offset) {
+    if (q < offset) return 0;
+    q -= offset;
+    return q < QUAL_BINS ? q : QUAL_BINS - 1;
+}
+
+
+// Count scores into interleaved tables, so consecutive equal scores do not
+// serialise on the same counter.
+static void _qual_hist(
+        const uint8_t* qual, size_t len, uint8_t offset, uint32_t counts[QUAL_TABLES][QUAL_BINS]) {
+    size_t i = 0;
+    for (; i + QUAL_TABLES <= len; i += QUAL_TABLES) {
+        counts[0][_clamp_qual(qual[i], offset)]++;
+        counts[1][_clamp_qual(qual[i + 1], offset)]++;
+        counts[2][_clamp_qual(qual[i + 2], offset)]++;
+        counts[3][_clamp_qual(qual[i + 3], offset)]++;
+    }
+    for (; i < len; ++i) {
+        counts[0][_clamp_qual(qual[i], offset)]++;
     }
-    qsum /= len;
-    return -10 * log10(qsum);
 }
 
 
-inline float mean_qual_from_bam(uint8_t* qual, size_t len) {
-    if (len == 0 || qual[0] == 0xff ) return nanf("");
+// Mean of error probabilities of scores stored with the given offset.
+static float _mean_qual_hist(const uint8_t* qual, size_t len, uint8_t offset) {
+    uint32_t counts[QUAL_TABLES][QUAL_BINS];
     double qsum = 0;
-    double c = 0;
-    for (size_t i=0; i<len; ++i) {
-        int q = (int)(qual[i]);
-        kahan_sum(&qsum, qprobs[q], &c);
+    // counters are 32bit, so very long reads are counted in chunks
+    const size_t chunk = UINT32_MAX;
+    for (size_t start = 0; start < len; start += chunk) {
+        memset(counts, 0, sizeof(counts));
+        _qual_hist(qual + start, len - start < chunk ? len - start : chunk, offset, counts);
+        for (size_t q = 0; q < QUAL_BINS; ++q) {
+            uint64_t n = (uint64_t)counts[0][q] + counts[1][q] + counts[2][q] + counts[3][q];
+            qsum += n * qprobs[q];
+        }
     }
     qsum /= len;
     return -10 * log10(qsum);
 }
 
 
+float mean_qual(char* qual, size_t len) {
+    if (len == 0 ) return nanf("");
+    return _mean_qual_hist((uint8_t*)qual, len, 33);
+}
+
+
+float mean_qual_from_bam(uint8_t* qual, size_t len) {
+    if (len == 0 || qual[0] == 0xff ) return nanf("");
+    return _mean_qual_hist(qual, len, 0);
+}
+
+
 inline float mean_qual_naive(char* qual, size_t len) {
     if (len == 0 ) return nanf("");
     double qsum = 0;
@@ -423,9 +460,6 @@ inline float mean_qual_from_bam_naive(uint8_t* qual, size_t len) {
 
 // Strip hexadecimal suffixes that samtools merge can add to RG IDs
 void strip_hex_suffix(char *str) {
-    regex_t regex;
-    regmatch_t matches[1];
-   
     // samtools formats this as "%s-%0lX" which is a long formatted
     // as hex with leading zeros. BUT there's no field width specified!
     // https://github.com/samtools/samtools/issues/2086
@@ -433,17 +467,16 @@ void strip_hex_suffix(char *str) {
     // we could be probabilistic and require say 2 hex digits leaving
     // the 16 edge cases of 0 ("") to F. No one should have and RG ID
     // ending in "-", right?
-    if (regcomp(&regex, "-[0-9A-Fa-f]{0,8}$", REG_EXTENDED) != 0) {
-        fprintf(stderr, "Could not compile regex\n");
-        exit(1);
+    //
+    // This is the regex "-[0-9A-Fa-f]{0,8}$": only the last `-` can be
+    // followed by nothing but hex digits, so check the characters after it.
+    char* dash = strrchr(str, '-');
+    if (dash == NULL) return;
+    size_t n = 0;
+    for (char* c = dash + 1; *c != '\0'; ++c, ++n) {
+        if (n == 8 || !isxdigit((unsigned char)*c)) return;
     }
-
-    // Check if the string matches the pattern, and strip the match from the src
-    if (regexec(&regex, str, 1, matches, 0) == 0) {
-        str[matches[0].rm_so] = '\0';
-    }
-
-    regfree(&regex);
+    dash[0] = '\0';
 }
 
 
@@ -527,3 +560,49 @@ readgroup* create_rg_info(char* rg) {
     }
     return rg_info;
 }
+
+
+// Cache of parsed read groups keyed by ID. The parse depends only on the ID
+// string, so entries remain valid for the lifetime of the process.
+KHASH_MAP_INIT_STR(rg_cache, readgroup*)
+static khash_t(rg_cache)* rg_cache = NULL;
+static pthread_rwlock_t rg_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+const readgroup* get_rg_info(const char* rg) {
+    readgroup* rg_info = NULL;
+    pthread_rwlock_rdlock(&rg_cache_lock);
+    if (rg_cache != NULL) {
+        khiter_t k = kh_get(rg_cache, rg_cache, rg);
+        if (k != kh_end(rg_cache)) rg_info = kh_val(rg_cache, k);
+    }
+    pthread_rwlock_unlock(&rg_cache_lock);
+    if (rg_info != NULL) return rg_info;
+
+    pthread_rwlock_wrlock(&rg_cache_lock);
+    if (rg_cache == NULL) rg_cache = kh_init(rg_cache);
+    int ret;
+    // another thread may have added the entry since we looked
+    khiter_t k = kh_get(rg_cache, rg_cache, rg);
+    if (k == kh_end(rg_cache)) {
+        rg_info = create_rg_info((char*)rg);
+        k = kh_put(rg_cache, rg_cache, strdup(rg), &ret);
+        kh_val(rg_cache, k) = rg_info;
+    }
+    rg_info = kh_val(rg_cache, k);
+    pthread_rwlock_unlock(&rg_cache_lock);
+    return rg_info;
+}
+
+void destroy_rg_cache(void) {
+    pthread_rwlock_wrlock(&rg_cache_lock);
+    if (rg_cache != NULL) {
+        for (khiter_t k = kh_begin(rg_cache); k != kh_end(rg_cache); ++k) {
+            if (!kh_exist(rg_cache, k)) continue;
+            free((char*)kh_key(rg_cache, k));
+            destroy_rg_info(kh_val(rg_cache, k));
+        }
+        kh_destroy(rg_cache, rg_cache);
+        rg_cache = NULL;
+    }
+    pthread_rwlock_unlock(&rg_cache_lock);
+}
@@ -139,6 +139,16 @@ int replace_char(char *str, char orig, char rep);
 // https://en.wikipedia.org/wiki/Kahan_summation_algorithm
 void kahan_sum(double* sum, double term, double* c);
 
+/** Mean quality of a read, computed from the mean of error probabilities.
+ *
+ * @param qual quality string (phred+33 for FASTQ, raw for BAM).
+ * @param len length of the quality string.
+ * @returns mean quality score, NaN if there are no (or missing) qualities.
+ *
+ * The _naive variants are straightforward per-base reference
+ * implementations; the others histogram scores first and clamp scores
+ * outside of the range 0-99.
+ */
 float mean_qual(char* qual, size_t len);
 float mean_qual_naive(char* qual, size_t len);
 float mean_qual_from_bam(uint8_t* qual, size_t len);
@@ -155,4 +165,10 @@ typedef struct readgroup {
 readgroup* create_rg_info(char* rg);
 void destroy_rg_info(readgroup* rg);
 
+// As create_rg_info, but parsed read groups are cached by ID. The returned
+// object is shared and must not be modified or destroyed. Thread-safe.
+const readgroup* get_rg_info(const char* rg);
+// Free all cached read groups, invalidating objects from get_rg_info
+void destroy_rg_cache(void);
+
 #endif
@@ -0,0 +1,83 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dust.h"
+#include "sdust/kalloc.h"
+
+
+dust_engine create_dust_engine(void) {
+    dust_engine engine = calloc(1, sizeof(_dust_engine));
+    if (engine == NULL) {
+        fprintf(stderr, "Failed to allocate memory for dust engine.\n");
+        exit(EXIT_FAILURE);
+    }
+    engine->km = km_init();
+    engine->buf = sdust_buf_init(engine->km);
+    return engine;
+}
+
+
+void destroy_dust_engine(dust_engine engine) {
+    if (engine == NULL) return;
+    sdust_buf_destroy(engine->buf);
+    km_destroy(engine->km);
+    free(engine);
+}
+
+
+static pthread_key_t dust_key;
+static pthread_once_t dust_key_once = PTHREAD_ONCE_INIT;
+
+static void _destroy_dust_engine(void* engine) {
+    destroy_dust_engine((dust_engine)engine);
+}
+
+static void _make_dust_key(void) {
+    if (pthread_key_create(&dust_key, _destroy_dust_engine) != 0) {
+        fprintf(stderr, "Failed to create thread key for dust engine.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+dust_engine thread_dust_engine(void) {
+    pthread_once(&dust_key_once, _make_dust_key);
+    dust_engine engine = pthread_getspecific(dust_key);
+    if (engine == NULL) {
+        engine = create_dust_engine();
+        pthread_setspecific(dust_key, engine);
+    }
+    return engine;
+}
+
+
+void destroy_thread_dust_engine(void) {
+    pthread_once(&dust_key_once, _make_dust_key);
+    destroy_dust_engine(pthread_getspecific(dust_key));
+    pthread_setspecific(dust_key, NULL);
+}
+
+
+size_t dust_masked_bases(dust_engine engine, const uint8_t* seq, size_t len, int t, int w, int lo, int hi) {
+    return (size_t)sdust_count(seq, (int)len, t, w, lo, hi, engine->buf);
+}
+
+
+size_t dust_max_masked(size_t len, double max_fraction) {
+    // nudge the product so as to agree exactly with the floating point
+    // comparison of the fraction
+    double limit = max_fraction * len;
+    size_t max_masked = limit < 0 ? 0 : limit > len ? len : (size_t)limit;
+    while (max_masked < len && (double)(max_masked + 1) / len <= max_fraction) max_masked++;
+    while (max_masked > 0 && (double)max_masked / len > max_fraction) max_masked--;
+    return max_masked;
+}
+
+
+bool dust_exceeds(dust_engine engine, const uint8_t* seq, size_t len, int t, int w, double max_fraction) {
+    if (len == 0) return false;
+    int max_masked = (int)dust_max_masked(len, max_fraction);
+    size_t masked = dust_masked_bases(engine, seq, len, t, w, max_masked, max_masked);
+    return (double)masked / len > max_fraction;
+}
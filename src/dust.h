@@ -0,0 +1,60 @@
+#ifndef _DUST_H
+#define _DUST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdust/sdust.h"
+
+
+// Reusable SDUST state: a kalloc arena and the sdust buffer allocated from it
+typedef struct _dust_engine {
+    void* km;
+    sdust_buf_t* buf;
+} _dust_engine;
+typedef _dust_engine* dust_engine;
+
+// create and destroy an engine
+dust_engine create_dust_engine(void);
+void destroy_dust_engine(dust_engine engine);
+
+// Get the engine of the calling thread, creating it on first use. The engine
+// is destroyed when the thread exits, or by destroy_thread_dust_engine.
+dust_engine thread_dust_engine(void);
+void destroy_thread_dust_engine(void);
+
+/** Count the bases of a sequence masked by SDUST.
+ *
+ * @param engine engine to use.
+ * @param seq sequence.
+ * @param len length of sequence.
+ * @param t SDUST score threshold.
+ * @param w SDUST window size.
+ * @param lo stop once the count is known to be at most lo, -1 to disable.
+ * @param hi stop once the count is known to be more than hi, INT_MAX to disable.
+ * @returns the number of masked bases, or after stopping early a bound
+ *     on the same side of lo or hi as the true count.
+ *
+ */
+size_t dust_masked_bases(dust_engine engine, const uint8_t* seq, size_t len, int t, int w, int lo, int hi);
+
+// The largest number of masked bases of a sequence of length len whose
+// masked fraction is at most max_fraction.
+size_t dust_max_masked(size_t len, double max_fraction);
+
+/** Check whether the fraction of a sequence masked by SDUST exceeds a limit.
+ *
+ * @param engine engine to use.
+ * @param seq sequence.
+ * @param len length of sequence.
+ * @param t SDUST score threshold.
+ * @param w SDUST window size.
+ * @param max_fraction maximum permitted masked fraction.
+ * @returns true if the masked fraction is more than max_fraction.
+ *
+ * Scanning stops as soon as the outcome is certain.
+ */
+bool dust_exceeds(dust_engine engine, const uint8_t* seq, size_t len, int t, int w, double max_fraction);
+
+#endif
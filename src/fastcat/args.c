@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <argp.h>
 
 #include "args.h"
@@ -8,18 +9,39 @@ const char *argp_program_bug_address = "support@nanoporetech.com";
 static char doc[] = 
 "fastcat -- concatenate and summarise .fastq(.gz) files.\
 \vInput files may be given on stdin by specifing the input as '-'. \
+FASTQ input may be uncompressed, or compressed with gzip (including BGZF), \
+bzip2 or xz. \
 Also accepts directories as input and looks for .fastq(.gz) files in \
 the top-level directory. Recurses into sub-directories when the \
--x option is given. The command \
-will exit non-zero if any file encountered cannot be read.";
+-x option is given. Unaligned BAM (.bam) files are also read, with \
+the tags of each record taking the place of the header comment. With \
+--watch, files added to input directories are processed as they are \
+completed, for example during a sequencing run. With --stream, FASTQ \
+records are read from stdin, for example as they are output by a \
+basecaller. The command will exit non-zero if any file encountered \
+cannot be read.";
 static char args_doc[] = "reads1.fastq(.gz) reads2.fastq(.gz) dir-with-fastq ...";
 static struct argp_option options[] = {
     {0, 0, 0, 0,
         "General options:", 0},
     {"recurse", 'x', 0, 0,
-        "Search directories recursively for '.fastq', '.fq', '.fastq.gz', and '.fq.gz' files.", 0},
+        "Search directories recursively for '.fastq' and '.fq' files (optionally with a '.gz', '.bz2' or '.xz' extension), and '.bam' files.", 0},
     {"threads", 't', "THREADS", 0,
-        "Number of threads for output compression (only with --bam_out.", 0},
+        "Number of threads for processing input files, and for output compression with --bam_out or --bgzf.", 0},
+    {"stream", 0x1400, 0, 0,
+        "Read FASTQ records from stdin, given as the input '-', rather than a list of input files. Plain and compressed input are detected as for files.", 0},
+    {"ordered", 0x900, 0, 0,
+        "Write reads and summaries in input file order when using multiple threads (default: reads from files processed concurrently are interleaved, and per-file summary rows are written as files complete).", 0},
+    {"watch", 0xE00, 0, 0,
+        "After processing the inputs, watch the input directories for new files, processing each once it is complete and appending to the outputs. Stops on SIGINT or SIGTERM, or after --watch_timeout.", 0},
+    {"watch_interval", 0xF00, "SECONDS", 0,
+        "With --watch, interval at which directories are polled where inotify is unavailable, and over which a file's size must be unchanged for it to be taken as complete. (default: 10)", 0},
+    {"watch_timeout", 0x1000, "SECONDS", 0,
+        "With --watch, stop once no new files have been found for this long. 0 to watch until interrupted. (default: 0)", 0},
+    {"manifest", 0x1100, "MANIFEST", 0,
+        "Record processed files, and checkpoint the outputs, in this file so that an interrupted run can be resumed with --resume (implies --ordered).", 0},
+    {"resume", 0x1200, 0, 0,
+        "Resume from --manifest, skipping files already processed and appending to the outputs. Output to stdout must be appended to a regular file (>>). Starts afresh if the manifest does not exist.", 0},
     {"force_error", 'e', 0, 0,
         "Exit with non-zero status if any files, or records, contained errors.", 0},
 
@@ -33,6 +55,16 @@ static struct argp_option options[] = {
         "Rewrite fastq header comments as SAM tags (useful for passing through minimap2).", 0},
     {"bam_out", 'B', 0, 0,
         "Output data as unaligned BAM.", 0},
+    {"stats_only", 0x1500, 0, 0,
+        "Write only the summaries and histograms, not the reads. Read headers are parsed only when required by the summaries.", 0},
+    {"bgzf", 0xA00, 0, 0,
+        "Compress FASTQ output (including to stdout) as BGZF, using --threads for compression.", 0},
+    {"gzi", 0xB00, "GZI", OPTION_ARG_OPTIONAL,
+        "Write a .gzi index for BGZF FASTQ output (implies --bgzf). With --demultiplex an index is written next to each output file, otherwise the index filename must be given as --gzi=GZI.", 0},
+    {"bci", 0x1700, "BCI", OPTION_ARG_OPTIONAL,
+        "Write a .bci chunk index, as made by bamindex build, for BAM output (implies --bam_out). With --demultiplex an index is written next to each output file, otherwise the index filename must be given as --bci=BCI.", 0},
+    {"bci_chunk_size", 0x1800, "SIZE", 0,
+        "Number of records in a chunk of the --bci index. (default: 1)", 0},
     {"verbose", 'v', 0, 0,
         "Verbose output.", 0},
 
@@ -40,6 +72,10 @@ static struct argp_option options[] = {
         "Output file selection:", 0},
     {"read", 'r', "READ SUMMARY",  0,
         "Per-read summary output", 0},
+    {"read_format", 0x1600, "FORMAT", 0,
+        "Format of the --read summary: tsv; bgzf for TSV compressed as BGZF, using --threads for compression; or columns for a chunked columnar binary file with the same columns, in which strings repeated between reads are stored once. Only tsv can be used with --manifest. (default: tsv)", 0},
+    {"cache", 0x1300, "DIRECTORY", 0,
+        "Directory in which to keep the summaries of input files, by path, size, modification time and filtering options. When reads are not needed (--stats_only, or stdout is /dev/null, and without --read) the summaries of unchanged files are taken from the cache rather than reading the files. Cannot be used with --demultiplex.", 0},
     {"file", 'f', "FILE SUMMARY",  0,
         "Per-file summary output", 0},
     {"runids", 'i', "ID SUMMARY",  0,
@@ -48,6 +84,10 @@ static struct argp_option options[] = {
         "Basecaller mode summary output", 0},
     {"demultiplex", 'd', "OUT DIR",  0,
         "Separate barcoded samples using fastq header information. Option value is top-level output directory.", 0},
+    {"demultiplex_key", 0xC00, "KEY", 0,
+        "Header field by which to separate reads with --demultiplex: barcode, barcode_alias, runid, read_group or flow_cell_id. Reads without the field are written to 'unclassified'. (default: barcode)", 0},
+    {"max_open_files", 0xD00, "NUM", 0,
+        "Maximum number of --demultiplex output files to hold open, the least recently used are closed and reopened for appending as required. 0 for no limit. (default: 128)", 0},
     {"histograms", 0x400, "DIRECTORY", 0,
         "Directory for outputting histogram information. When --demultiplex is enabled histograms are written to per-sample demultiplexed output directories. (default: fastcat-histograms)", 0},
 
@@ -145,10 +185,134 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
             break;
         case 't':
             arguments->threads = atoi(arg);
+            if (arguments->threads < 1) {
+                argp_error(state, "threads must be a positive integer.");
+            }
+            break;
+        case 0x900:
+            arguments->ordered = 1;
+            break;
+        case 0xE00:
+            arguments->watch = 1;
+            break;
+        case 0xF00:
+            arguments->watch_interval = atof(arg);
+            if (arguments->watch_interval <= 0) {
+                argp_error(state, "watch_interval must be positive.");
+            }
+            break;
+        case 0x1000:
+            arguments->watch_timeout = atof(arg);
+            if (arguments->watch_timeout < 0) {
+                argp_error(state, "watch_timeout must be non-negative.");
+            }
+            break;
+        case 0x1100:
+            arguments->manifest = arg;
+            arguments->ordered = 1;
+            break;
+        case 0x1200:
+            arguments->resume = 1;
+            break;
+        case 0x1300:
+            arguments->cache = arg;
+            break;
+        case 0x1400:
+            arguments->stream = 1;
+            break;
+        case 0x1500:
+            arguments->stats_only = 1;
+            break;
+        case 0x1600:
+            if (strcmp(arg, "tsv") && strcmp(arg, "bgzf") && strcmp(arg, "columns")) {
+                argp_error(state, "Unknown read_format '%s'.", arg);
+            }
+            arguments->read_bgzf = strcmp(arg, "bgzf") == 0;
+            arguments->read_columns = strcmp(arg, "columns") == 0;
+            break;
+        case 0xA00:
+            arguments->write_bgzf = 1;
+            break;
+        case 0xB00:
+            arguments->write_bgzf = 1;
+            arguments->write_gzi = 1;
+            arguments->gzi_file = arg;
+            break;
+        case 0x1700:
+            arguments->write_bam = 1;
+            arguments->write_bci = 1;
+            arguments->bci_file = arg;
+            break;
+        case 0x1800:
+            if (atoi(arg) < 1) {
+                argp_error(state, "bci_chunk_size must be a positive integer.");
+            }
+            arguments->bci_chunk_size = atoi(arg);
+            break;
+        case 0xC00:
+            if (strcmp(arg, "barcode") && strcmp(arg, "barcode_alias") && strcmp(arg, "runid")
+                    && strcmp(arg, "read_group") && strcmp(arg, "flow_cell_id")) {
+                argp_error(state, "Unknown demultiplex_key '%s'.", arg);
+            }
+            arguments->demultiplex_key = arg;
+            break;
+        case 0xD00:
+            if (atoi(arg) < 0) {
+                argp_error(state, "max_open_files must be a non-negative integer.");
+            }
+            arguments->max_open_files = atoi(arg);
             break;
         case 'e':
             arguments->force_error = 1;
             break; 
+        case ARGP_KEY_END:
+            if (arguments->write_bgzf && arguments->write_bam) {
+                argp_error(state, "--bgzf and --gzi cannot be used with --bam_out.");
+            }
+            if (arguments->watch && arguments->files != NULL && strcmp(arguments->files[0], "-") == 0) {
+                argp_error(state, "--watch requires input directories, not a list of files on stdin.");
+            }
+            if (arguments->stats_only && (arguments->write_bam || arguments->write_bgzf || arguments->reheader)) {
+                argp_error(state, "--bam_out, --bci, --bgzf, --gzi and --reheader cannot be used with --stats_only.");
+            }
+            if (arguments->stream) {
+                if (arguments->files == NULL
+                        || strcmp(arguments->files[0], "-") != 0 || arguments->files[1] != NULL) {
+                    argp_error(state, "--stream requires '-' as the only input.");
+                }
+                if (arguments->manifest != NULL) {
+                    argp_error(state, "--manifest cannot be used with --stream.");
+                }
+            }
+            if (arguments->resume && arguments->manifest == NULL) {
+                argp_error(state, "--resume requires --manifest.");
+            }
+            if (arguments->cache != NULL && arguments->demultiplex_dir != NULL) {
+                argp_error(state, "--cache cannot be used with --demultiplex.");
+            }
+            if (arguments->manifest != NULL && (arguments->write_gzi || arguments->write_bci)) {
+                argp_error(state, "--gzi and --bci cannot be used with --manifest.");
+            }
+            if (arguments->manifest != NULL && (arguments->read_columns || arguments->read_bgzf)) {
+                argp_error(state, "--read_format must be tsv with --manifest.");
+            }
+            if (arguments->write_gzi) {
+                if (arguments->demultiplex_dir == NULL && arguments->gzi_file == NULL) {
+                    argp_error(state, "--gzi requires a filename when writing to stdout.");
+                }
+                if (arguments->demultiplex_dir != NULL && arguments->gzi_file != NULL) {
+                    argp_error(state, "--gzi does not take a filename with --demultiplex.");
+                }
+            }
+            if (arguments->write_bci) {
+                if (arguments->demultiplex_dir == NULL && arguments->bci_file == NULL) {
+                    argp_error(state, "--bci requires a filename when writing to stdout.");
+                }
+                if (arguments->demultiplex_dir != NULL && arguments->bci_file != NULL) {
+                    argp_error(state, "--bci does not take a filename with --demultiplex.");
+                }
+            }
+            break;
         case ARGP_KEY_NO_ARGS:
             argp_usage (state);
             break;
@@ -168,6 +332,8 @@ static struct argp argp = {options, parse_opt, args_doc, doc, 0, 0, 0};
 arguments_t parse_arguments(int argc, char** argv) {
     arguments_t args;
     args.perread = NULL;
+    args.read_bgzf = 0;
+    args.read_columns = 0;
     args.perfile = NULL;
     args.runids = NULL;
     args.basecallers = NULL;
@@ -177,6 +343,8 @@ arguments_t parse_arguments(int argc, char** argv) {
     args.min_qscore = 0;
     args.recurse = 1; // always allow descent into TLD
     args.demultiplex_dir = NULL;
+    args.demultiplex_key = "barcode";
+    args.max_open_files = 128;
     args.histograms = "fastcat-histograms";
     args.dust = 0;
     args.max_dust = 0.95;
@@ -184,9 +352,26 @@ arguments_t parse_arguments(int argc, char** argv) {
     args.dust_t = 20;
     args.reheader = 0;
     args.write_bam = 0;
+    args.write_bgzf = 0;
+    args.write_gzi = 0;
+    args.gzi_file = NULL;
+    args.write_bci = 0;
+    args.bci_file = NULL;
+    args.bci_chunk_size = 1;
     args.threads = 1;
+    args.files = NULL;
+    args.ordered = 0;
+    args.watch = 0;
+    args.watch_interval = 10;
+    args.watch_timeout = 0;
+    args.manifest = NULL;
+    args.resume = 0;
+    args.cache = NULL;
+    args.stream = 0;
+    args.stats_only = 0;
     args.reads_per_file = 0;
     args.force_error = 0;
+    args.verbose = 0;
     argp_parse(&argp, argc, argv, 0, 0, &args);
     return args;
 }
@@ -5,6 +5,8 @@
 
 typedef struct arguments {
     char *perread;
+    bool read_bgzf;
+    bool read_columns;
     char *perfile;
     char *runids;
     char *basecallers;
@@ -19,11 +21,28 @@ typedef struct arguments {
     int recurse;
     size_t reheader;
     size_t write_bam;
+    bool write_bgzf;
+    bool write_gzi;
+    char* gzi_file;
+    bool write_bci;
+    char* bci_file;
+    size_t bci_chunk_size;
     char* demultiplex_dir;
+    char* demultiplex_key;
+    size_t max_open_files;
     char* histograms;
     char **files;
     size_t reads_per_file;
     int threads;
+    bool ordered;
+    bool watch;
+    double watch_interval;
+    double watch_timeout;
+    char* manifest;
+    bool resume;
+    char* cache;
+    bool stream;
+    bool stats_only;
     bool verbose;
     bool force_error;
 } arguments_t;
@@ -0,0 +1,219 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common.h"
+#include "../version.h"
+#include "cache.h"
+#include "serial.h"
+
+// version 1 of the entry format
+static const char cache_magic[8] = {'F', 'C', 'C', 'A', 'C', 'H', 'E', 1};
+
+struct _summary_cache {
+    char* dir;
+    bool lookup;
+    // common to all keys: the filtering options and anything else on which
+    // the summaries depend
+    kstring_t settings;
+};
+
+
+void destroy_file_summary(file_summary* summary) {
+    for (size_t i = 0; i < summary->n_runids; ++i) {
+        free(summary->runids[i].name);
+    }
+    free(summary->runids);
+    for (size_t i = 0; i < summary->n_basecallers; ++i) {
+        free(summary->basecallers[i].name);
+    }
+    free(summary->basecallers);
+    if (summary->l_stats != NULL) destroy_length_stats(summary->l_stats);
+    if (summary->q_stats != NULL) destroy_qual_stats(summary->q_stats);
+}
+
+
+summary_cache open_summary_cache(arguments_t* args, bool lookup) {
+    if (mkdir_p(args->cache) != 0) {
+        fprintf(stderr, "Error: Could not create cache directory '%s': %s\n", args->cache, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    summary_cache cache = xalloc(1, sizeof(_summary_cache), "cache");
+    cache->dir = strdup(args->cache);
+    cache->lookup = lookup;
+    ksprintf(&cache->settings,
+        "version=%s\tlength_bits=%d\tqual_width=%f\t"
+        "min_length=%zu\tmax_length=%zu\tmin_qscore=%f\t"
+        "dust=%d\tmax_dust=%f\tdust_w=%zu\tdust_t=%zu",
+        argp_program_version, LENGTH_HIST_BITS, QUAL_HIST_WIDTH,
+        args->min_length, args->max_length, args->min_qscore,
+        args->dust, args->max_dust, args->dust_w, args->dust_t);
+    return cache;
+}
+
+
+bool summary_key(summary_cache cache, const char* fname, kstring_t* key) {
+    struct stat st;
+    if (strcmp(fname, "-") == 0 || stat(fname, &st) != 0) return false;
+    // files are the same however they are named
+    char* path = realpath(fname, NULL);
+    key->l = 0;
+    ksprintf(key, "path=%s\tsize=%" PRId64 "\tmtime=%" PRId64 "\t%s",
+        path == NULL ? fname : path, (int64_t)st.st_size, (int64_t)st.st_mtime, cache->settings.s);
+    free(path);
+    return true;
+}
+
+
+// FNV-1a
+static uint64_t _hash(const char* key) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char* c = (const unsigned char*)key; *c != '\0'; ++c) {
+        h ^= *c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static char* _entry_path(summary_cache cache, const char* key) {
+    char* path = xalloc(strlen(cache->dir) + 22, sizeof(char), "cache path");
+    sprintf(path, "%s/%016" PRIx64 ".fcs", cache->dir, _hash(key));
+    return path;
+}
+
+
+static void _put_counts(kstring_t* out, const field_count* counts, size_t n) {
+    put_u64(out, n);
+    for (size_t i = 0; i < n; ++i) {
+        put_str(out, counts[i].name);
+        put_u32(out, (uint32_t)counts[i].count);
+    }
+}
+
+static field_count* _get_counts(serial_reader* in, size_t* n) {
+    uint64_t count = get_u64(in);
+    // each takes at least 8 bytes
+    if ((uint64_t)(in->end - in->p) / 8 < count) {
+        in->error = true;
+        *n = 0;
+        return NULL;
+    }
+    field_count* counts = xalloc(max(count, (uint64_t)1), sizeof(field_count), "counts");
+    for (*n = 0; *n < count && !in->error; ++*n) {
+        counts[*n].name = get_str(in);
+        counts[*n].count = (int)get_u32(in);
+        if (counts[*n].name == NULL) in->error = true;
+    }
+    return counts;
+}
+
+
+bool load_summary(summary_cache cache, const char* key, file_summary* summary) {
+    if (!cache->lookup) return false;
+    char* path = _entry_path(cache, key);
+    FILE* fp = fopen(path, "rb");
+    free(path);
+    if (fp == NULL) return false;
+    kstring_t data = {0, 0, NULL};
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        kputsn(buf, n, &data);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+
+    // anything unexpected is treated as a miss, the entry is then replaced
+    ok = ok && data.l > sizeof(cache_magic) && memcmp(data.s, cache_magic, sizeof(cache_magic)) == 0;
+    if (!ok) {
+        free(data.s);
+        return false;
+    }
+    serial_reader in = {(uint8_t*)data.s + sizeof(cache_magic), (uint8_t*)data.s + data.l, false};
+    char* entry_key = get_str(&in);
+    ok = entry_key != NULL && strcmp(entry_key, key) == 0;
+    free(entry_key);
+    if (ok) {
+        memset(summary, 0, sizeof(file_summary));
+        summary->status = (int)get_u32(&in);
+        summary->n = get_u64(&in);
+        summary->slen = get_u64(&in);
+        summary->minl = get_u64(&in);
+        summary->maxl = get_u64(&in);
+        uint64_t meanq = get_u64(&in);
+        memcpy(&summary->meanq, &meanq, sizeof(double));
+        if (get_u32(&in) != NUM_FAILURE_CODES) in.error = true;
+        for (size_t i = 0; i < NUM_FAILURE_CODES; ++i) {
+            summary->failures[i] = get_u64(&in);
+        }
+        summary->runids = _get_counts(&in, &summary->n_runids);
+        summary->basecallers = _get_counts(&in, &summary->n_basecallers);
+        summary->l_stats = create_length_stats();
+        summary->q_stats = create_qual_stats(QUAL_HIST_WIDTH);
+        get_stats(&in, summary->l_stats);
+        get_stats(&in, summary->q_stats);
+        ok = !in.error && in.p == in.end;
+        if (!ok) destroy_file_summary(summary);
+    }
+    free(data.s);
+    return ok;
+}
+
+
+void store_summary(summary_cache cache, const char* key, const file_summary* summary) {
+    kstring_t out = {0, 0, NULL};
+    kputsn(cache_magic, sizeof(cache_magic), &out);
+    put_str(&out, key);
+    put_u32(&out, (uint32_t)summary->status);
+    put_u64(&out, summary->n);
+    put_u64(&out, summary->slen);
+    put_u64(&out, summary->minl);
+    put_u64(&out, summary->maxl);
+    uint64_t meanq;
+    memcpy(&meanq, &summary->meanq, sizeof(double));
+    put_u64(&out, meanq);
+    put_u32(&out, NUM_FAILURE_CODES);
+    for (size_t i = 0; i < NUM_FAILURE_CODES; ++i) {
+        put_u64(&out, summary->failures[i]);
+    }
+    _put_counts(&out, summary->runids, summary->n_runids);
+    _put_counts(&out, summary->basecallers, summary->n_basecallers);
+    put_stats(&out, summary->l_stats);
+    put_stats(&out, summary->q_stats);
+
+    // written under a unique name and renamed into place, so that entries
+    // are whole when shared between concurrent runs
+    char* path = _entry_path(cache, key);
+    char* tmppath = xalloc(strlen(path) + 8, sizeof(char), "cache path");
+    sprintf(tmppath, "%s.XXXXXX", path);
+    int fd = mkstemp(tmppath);
+    bool ok = fd >= 0;
+    if (ok) {
+        ok = write(fd, out.s, out.l) == (ssize_t)out.l;
+        ok = close(fd) == 0 && ok;
+        ok = ok && rename(tmppath, path) == 0;
+        if (!ok) unlink(tmppath);
+    }
+    if (!ok) {
+        // the cache only saves work, so the run continues without it
+        fprintf(stderr, "WARNING: Could not write cache entry '%s': %s\n", path, strerror(errno));
+    }
+    free(tmppath);
+    free(path);
+    free(out.s);
+}
+
+
+void close_summary_cache(summary_cache cache) {
+    if (cache == NULL) return;
+    free(cache->settings.s);
+    free(cache->dir);
+    free(cache);
+}
@@ -0,0 +1,79 @@
+#ifndef FASTCAT_CACHE_H
+#define FASTCAT_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "htslib/kstring.h"
+
+#include "../stats.h"
+#include "args.h"
+#include "parsing.h"
+
+
+// A count of reads with a value of a header field
+typedef struct {
+    char* name;
+    int count;
+} field_count;
+
+// Everything fastcat reports for an input file, other than its reads
+typedef struct {
+    int status;
+    size_t n, slen, minl, maxl;
+    double meanq;  // sum of the mean qualities of reads
+    uint64_t failures[NUM_FAILURE_CODES];
+    // in the order they are written to --runids and --basecallers
+    field_count* runids;
+    size_t n_runids;
+    field_count* basecallers;
+    size_t n_basecallers;
+    // histograms of the reads written, NULL if not collected
+    read_stats* l_stats;
+    read_stats* q_stats;
+} file_summary;
+
+void destroy_file_summary(file_summary* summary);
+
+
+// A directory of file summaries, addressed by a hash of the input file's
+// path, size and modification time, and of the filtering options.
+typedef struct _summary_cache _summary_cache;
+typedef _summary_cache* summary_cache;
+
+/** Open the cache given by args->cache, creating the directory if required.
+ *
+ * @param args program arguments.
+ * @param lookup whether summaries are read from the cache, otherwise
+ *     they are only stored.
+ * @returns a cache.
+ *
+ */
+summary_cache open_summary_cache(arguments_t* args, bool lookup);
+
+/** Form the key of an input file's summary.
+ *
+ * @param cache the cache.
+ * @param fname input file.
+ * @param key output key.
+ * @returns false if the file cannot be stat'ed.
+ *
+ */
+bool summary_key(summary_cache cache, const char* fname, kstring_t* key);
+
+/** Read a summary from the cache, if the cache is used for lookup.
+ *
+ * @param cache the cache.
+ * @param key key of the input file.
+ * @param summary output summary, with histograms.
+ * @returns true if the summary was found.
+ *
+ */
+bool load_summary(summary_cache cache, const char* key, file_summary* summary);
+
+// Store a summary, which must have histograms, replacing any stored under the key
+void store_summary(summary_cache cache, const char* key, const file_summary* summary);
+
+void close_summary_cache(summary_cache cache);
+
+#endif
@@ -0,0 +1,288 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common.h"
+#include "../ubam.h"
+#include "files.h"
+
+
+const char filetypes[8][11] = {
+    ".fastq", ".fq", ".fastq.gz", ".fq.gz", ".fastq.bz2", ".fq.bz2", ".fastq.xz", ".fq.xz"};
+size_t nfiletypes = 8;
+
+
+void add_file(file_list* files, const char* path, off_t size) {
+    if (files->n == files->m) {
+        size_t m = files->m == 0 ? 16 : 2 * files->m;
+        files->paths = xrecalloc(files->paths, files->m, m, sizeof(char*), "file list");
+        files->sizes = xrecalloc(files->sizes, files->m, m, sizeof(off_t), "file list");
+        files->m = m;
+    }
+    files->sizes[files->n] = size;
+    files->paths[files->n++] = strdup(path);
+}
+
+void destroy_file_list(file_list* files) {
+    for (size_t i = 0; i < files->n; ++i) {
+        free(files->paths[i]);
+    }
+    free(files->paths);
+    free(files->sizes);
+}
+
+
+static bool _ends_with(const char* name, size_t len, const char* suffix) {
+    size_t slen = strlen(suffix);
+    return len >= slen && memcmp(name + len - slen, suffix, slen) == 0;
+}
+
+bool is_input_filename(const char* name) {
+    if (is_bam_filename(name)) return true;
+    size_t len = strlen(name);
+    for (size_t i = 0; i < nfiletypes; ++i) {
+        if (_ends_with(name, len, filetypes[i])) return true;
+    }
+    return false;
+}
+
+
+// A directory being read. Its input files and subdirectories are kept
+// in directory order so that the tree can be listed as a serial walk would.
+typedef struct _dir_node {
+    char* path;
+    int recurse;  // depth of subdirectories still to read
+    file_list files;
+    struct _dir_node** subdirs;
+    size_t nsubdirs;
+    size_t msubdirs;
+    int status;
+} dir_node;
+
+// Directories waiting to be read, shared by the threads walking a tree
+typedef struct {
+    dir_node** pending;
+    size_t npending;
+    size_t mpending;
+    size_t active;  // directories being read
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+} dir_walk;
+
+
+static dir_node* _create_node(const char* path, int recurse) {
+    dir_node* node = xalloc(1, sizeof(dir_node), "directory");
+    node->path = strdup(path);
+    size_t len = strlen(path);
+    if (len > 1 && path[len - 1] == '/') node->path[len - 1] = '\0';
+    node->recurse = recurse;
+    return node;
+}
+
+static void _destroy_node(dir_node* node) {
+    for (size_t i = 0; i < node->nsubdirs; ++i) {
+        _destroy_node(node->subdirs[i]);
+    }
+    free(node->subdirs);
+    destroy_file_list(&node->files);
+    free(node->path);
+    free(node);
+}
+
+static char* _join_path(const char* dir, const char* name) {
+    size_t dlen = strlen(dir);
+    size_t nlen = strlen(name);
+    char* path = xalloc(dlen + nlen + 2, sizeof(char), "path");
+    memcpy(path, dir, dlen);
+    path[dlen] = '/';
+    memcpy(path + dlen + 1, name, nlen + 1);
+    return path;
+}
+
+
+// Read a directory in one pass, collecting input files with their sizes
+// and the subdirectories to read next. Entry types come from readdir()
+// where the filesystem provides them, so only candidate files are stat'ed.
+static void _read_dir(dir_node* node) {
+    DIR* dir = opendir(node->path);
+    if (dir == NULL) {
+        node->status = errno;
+        fprintf(stderr, "ERROR  : could not process directory %s: %s\n", node->path, strerror(node->status));
+        return;
+    }
+    int fd = dirfd(dir);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        struct stat finfo;
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            is_dir = fstatat(fd, name, &finfo, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(finfo.st_mode);
+        }
+        if (is_dir) {
+            if (node->recurse != 0) {
+                char* path = _join_path(node->path, name);
+                if (node->nsubdirs == node->msubdirs) {
+                    size_t m = node->msubdirs == 0 ? 4 : 2 * node->msubdirs;
+                    node->subdirs = xrecalloc(
+                        node->subdirs, node->msubdirs, m, sizeof(dir_node*), "directory list");
+                    node->msubdirs = m;
+                }
+                node->subdirs[node->nsubdirs++] = _create_node(path, node->recurse - 1);
+                free(path);
+            }
+            continue;
+        }
+        if (!is_input_filename(name)) continue;
+
+        // follow links to files, as stat() does for files named on the command line
+        if (fstatat(fd, name, &finfo, 0) != 0) {
+            int err = errno;
+            fprintf(stderr, "ERROR  : could not process file %s/%s: %s\n", node->path, name, strerror(err));
+            node->status = max(node->status, err);
+            continue;
+        }
+        if (S_ISDIR(finfo.st_mode)) continue;  // a link to a directory
+        char* path = _join_path(node->path, name);
+        add_file(&node->files, path, finfo.st_size);
+        free(path);
+    }
+    closedir(dir);
+}
+
+
+// Take directories from the walk until none are pending or being read
+static void* _walk_worker(void* arg) {
+    dir_walk* walk = arg;
+    pthread_mutex_lock(&walk->lock);
+    while (true) {
+        while (walk->npending == 0 && walk->active > 0) {
+            pthread_cond_wait(&walk->cv, &walk->lock);
+        }
+        if (walk->npending == 0) break;
+        dir_node* node = walk->pending[--walk->npending];
+        walk->active++;
+        pthread_mutex_unlock(&walk->lock);
+
+        _read_dir(node);
+
+        pthread_mutex_lock(&walk->lock);
+        if (walk->npending + node->nsubdirs > walk->mpending) {
+            size_t m = max(2 * walk->mpending, walk->npending + node->nsubdirs);
+            walk->pending = xrecalloc(
+                walk->pending, walk->mpending, m, sizeof(dir_node*), "directory queue");
+            walk->mpending = m;
+        }
+        // pushed in reverse so that siblings are read roughly in order
+        for (size_t i = node->nsubdirs; i > 0; --i) {
+            walk->pending[walk->npending++] = node->subdirs[i - 1];
+        }
+        walk->active--;
+        pthread_cond_broadcast(&walk->cv);
+    }
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+
+// List the files of a read tree, depth first
+static int _collect(dir_node* node, file_list* files) {
+    int status = node->status;
+    for (size_t i = 0; i < node->files.n; ++i) {
+        add_file(files, node->files.paths[i], node->files.sizes[i]);
+    }
+    for (size_t i = 0; i < node->nsubdirs; ++i) {
+        int rtn = _collect(node->subdirs[i], files);
+        status = max(status, rtn);
+    }
+    return status;
+}
+
+
+static int find_dir(const char* name, file_list* files, arguments_t* args, int recurse) {
+    dir_walk walk = {0};
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.cv, NULL);
+    dir_node* root = _create_node(name, recurse);
+    walk.pending = xalloc(1, sizeof(dir_node*), "directory queue");
+    walk.pending[0] = root;
+    walk.npending = walk.mpending = 1;
+
+    // the calling thread walks too, a single directory has nothing to share out
+    size_t nhelpers = recurse == 0 ? 0 : (size_t)max(args->threads, 1) - 1;
+    pthread_t* helpers = xalloc(max(nhelpers, (size_t)1), sizeof(pthread_t), "directory walkers");
+    size_t started = 0;
+    while (started < nhelpers && pthread_create(&helpers[started], NULL, _walk_worker, &walk) == 0) {
+        ++started;
+    }
+    _walk_worker(&walk);
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(helpers[i], NULL);
+    }
+    free(helpers);
+
+    int status = _collect(root, files);
+    _destroy_node(root);
+    free(walk.pending);
+    pthread_cond_destroy(&walk.cv);
+    pthread_mutex_destroy(&walk.lock);
+    return status;
+}
+
+
+int find_files(char* fname, file_list* files, arguments_t* args, int recurse) {
+    int status = 0;
+    struct stat finfo;
+    int res = stat(fname, &finfo);
+    if (res == -1) {
+        fprintf(stderr, "ERROR  : could not process file %s: %s\n", fname, strerror(errno));
+        return errno;
+    }
+
+    // handle directory input
+    if ((finfo.st_mode & S_IFMT) == S_IFDIR) {
+        if (recurse != 0) {
+            int rtn = find_dir(fname, files, args, recurse - 1);
+            status = max(status, rtn);
+        }
+        return status;
+    }
+
+    add_file(files, fname, finfo.st_size);
+    return status;
+}
+
+
+typedef struct {
+    off_t size;
+    size_t index;
+} sized_file;
+
+static int _compare_size(const void* a, const void* b) {
+    const sized_file* x = a;
+    const sized_file* y = b;
+    if (x->size != y->size) return x->size < y->size ? 1 : -1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+size_t* largest_first(file_list* files) {
+    sized_file* sized = xalloc(files->n, sizeof(sized_file), "file order");
+    for (size_t i = 0; i < files->n; ++i) {
+        sized[i] = (sized_file){files->sizes[i], i};
+    }
+    qsort(sized, files->n, sizeof(sized_file), _compare_size);
+    size_t* order = xalloc(files->n, sizeof(size_t), "file order");
+    for (size_t i = 0; i < files->n; ++i) {
+        order[i] = sized[i].index;
+    }
+    free(sized);
+    return order;
+}
@@ -0,0 +1,43 @@
+#ifndef FASTCAT_FILES_H
+#define FASTCAT_FILES_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "args.h"
+
+
+// input files discovered from the command line, directories, or stdin
+typedef struct {
+    size_t n;
+    size_t m;
+    char** paths;
+    off_t* sizes;  // on disk, for scheduling
+} file_list;
+
+void add_file(file_list* files, const char* path, off_t size);
+void destroy_file_list(file_list* files);
+
+// Whether a file name ends with the suffix of a supported input format
+bool is_input_filename(const char* name);
+
+/** Add an input file, or the input files within a directory.
+ *
+ * Directories are read in a single pass each, with subdirectories read
+ * in parallel over args->threads. Files are listed in the order of a
+ * serial, depth-first walk: the files of a directory are followed by
+ * those of its subdirectories, each in directory order.
+ *
+ * @param fname file or directory name.
+ * @param files output list.
+ * @param args program arguments.
+ * @param recurse depth of directories to read, negative for unlimited.
+ * @returns zero, or an errno value if a file or directory could not be read.
+ *
+ */
+int find_files(char* fname, file_list* files, arguments_t* args, int recurse);
+
+// Order of indices into files, largest file first. Ties stay in list order.
+size_t* largest_first(file_list* files);
+
+#endif
@@ -1,7 +1,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <zlib.h>
 #include <stdio.h>
@@ -10,135 +11,310 @@
 #include <inttypes.h>
 
 #include "htslib/kseq.h"
-KSEQ_INIT(gzFile, gzread)
+#include "htslib/thread_pool.h"
+#include "../instream.h"
+KSEQ_INIT(instream, instream_read)
 #define KSEQ_DECLARED
 
 #include "../common.h"
 #include "../fastqcomments.h"
+#include "../fastqmap.h"
 #include "../kh_counter.h"
-#include "../sdust/sdust.h"
+#include "../ubam.h"
+#include "../dust.h"
 #include "args.h"
+#include "cache.h"
+#include "files.h"
+#include "manifest.h"
+#include "watch.h"
 #include "parsing.h"
 #include "writer.h"
 
+// number of reads passed between pipeline stages at a time
+#define READ_BATCH_SIZE 1024
+// batches in flight per input file, per pool thread
+#define BATCHES_PER_THREAD 2
 
-const char filetypes[4][10] = {".fastq", ".fq", ".fastq.gz", ".fq.gz"};
-size_t nfiletypes = 4;
 
-// defined below -- recursion
-int process_file(char* fname, writer writer, arguments_t *args, int recurse);
+// shared state for workers processing input files concurrently
+typedef struct {
+    file_list* files;
+    writer writer;
+    arguments_t* args;
+    manifest manifest;  // NULL without --manifest
+    summary_cache cache;  // NULL without --cache
+    size_t* order;  // order in which files are handed out, NULL for list order
+    size_t next;  // next file to hand out
+    size_t turn;  // with --ordered, the file allowed to write
+    int status;
+    pthread_mutex_t lock;
+    pthread_cond_t turn_cv;
+} file_queue;
 
-int process_dir(const char *name, writer writer, arguments_t *args, int recurse) {
-    int status = 0;
-    DIR *dir;
-    struct dirent *entry;
-    char* search;
-
-    // read all files in directory
-    if (!(dir = opendir(name))) {
-        fprintf(stderr, "ERROR  : could not process directory %s: %s\n", name, strerror(errno));
-        return errno;
-    }
-    while ((entry = readdir(dir)) != NULL) {
-        char *path = calloc(strlen(name) + strlen(entry->d_name) + 2, sizeof(char));
-        sprintf(path, "%s/%s", name, entry->d_name);
-        if ((entry->d_type == DT_DIR) && (recurse != 0)) {
-            // skip
-        } else {
-            for (size_t i=0; i<nfiletypes; ++i) {
-                search = strstr(entry->d_name, filetypes[i]);
-                if (search != NULL) {
-                    if (args->verbose) {
-                        fprintf(stderr, "Processing %s\n", path);
-                    }
-                    int rtn = process_file(path, writer, args, recurse - 1);
-                    status = max(status, rtn);
-                    break;
-                }
-            }
+
+// Obtain the writer for file `findex`. With --ordered, waits until all
+// preceding files have been written.
+void acquire_writer(file_queue* queue, size_t findex, writer writer) {
+    if (queue != NULL && queue->args->ordered) {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->turn != findex) {
+            pthread_cond_wait(&queue->turn_cv, &queue->lock);
         }
-        free(path);
+        pthread_mutex_unlock(&queue->lock);
     }
-    closedir(dir);
+    pthread_mutex_lock(&writer->lock);
+}
+
+// Release the writer, when `done` the next file may take its turn.
+void release_writer(file_queue* queue, size_t findex, writer writer, bool done) {
+    pthread_mutex_unlock(&writer->lock);
+    if (done && queue != NULL && queue->args->ordered) {
+        pthread_mutex_lock(&queue->lock);
+        queue->turn = findex + 1;
+        pthread_cond_broadcast(&queue->turn_cv);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
 
-    // start again and look at child directories
-    if (!(dir = opendir(name))) {
-        fprintf(stderr, "ERROR  : could not process directory %s: %s\n", name, strerror(errno));
-        return errno;
+// Processing of a single input file is split into three stages: the reader
+// decompresses and parses records into batches, workers from the shared
+// thread pool filter the batches, parse read metadata and format output,
+// and a writer stage takes the results in input order, accumulates the
+// per-file summary and writes the reads. Without a thread pool all stages
+// run in turn on the calling thread.
+typedef struct {
+    char* fname;
+    size_t findex;
+    writer writer;
+    arguments_t* args;
+    file_queue* queue;
+    hts_tpool_process* process;  // NULL when running without a pool
+    fastq_map map;  // uncompressed input, viewed by batches until the end
+    // batches available for reuse
+    read_batch* spare;
+    size_t nspare;
+    size_t mspare;
+    pthread_mutex_t spare_lock;
+    // per-file summary, maintained by the writer stage
+    size_t n, slen, minl, maxl;
+    double meanq, c;
+    uint64_t failures[NUM_FAILURE_CODES];
+    bool parse_meta;  // whether read header fields are needed
+    kh_counter_t* run_ids;
+    kh_counter_t* basecallers;
+    // histograms of the file alone, for the summary cache
+    read_stats* l_stats;
+    read_stats* q_stats;
+} file_pipeline;
+
+typedef struct {
+    file_pipeline* pipe;
+    read_batch batch;
+} batch_job;
+
+
+read_batch take_batch(file_pipeline* pipe) {
+    read_batch batch = NULL;
+    pthread_mutex_lock(&pipe->spare_lock);
+    if (pipe->nspare > 0) batch = pipe->spare[--pipe->nspare];
+    pthread_mutex_unlock(&pipe->spare_lock);
+    if (batch == NULL) batch = create_read_batch(READ_BATCH_SIZE);
+    return batch;
+}
+
+void return_batch(file_pipeline* pipe, read_batch batch) {
+    clear_read_batch(batch);
+    pthread_mutex_lock(&pipe->spare_lock);
+    if (pipe->nspare == pipe->mspare) {
+        size_t m = pipe->mspare == 0 ? 8 : 2 * pipe->mspare;
+        pipe->spare = xrecalloc(pipe->spare, pipe->mspare, m, sizeof(read_batch), "spare batches");
+        pipe->mspare = m;
     }
-    while ((entry = readdir(dir)) != NULL) {
-        char *path = calloc(strlen(name) + strlen(entry->d_name) + 2, sizeof(char));
-        sprintf(path, "%s/%s", name, entry->d_name);
-        if ((entry->d_type == DT_DIR) && (recurse != 0)) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                free(path);
+    pipe->spare[pipe->nspare++] = batch;
+    pthread_mutex_unlock(&pipe->spare_lock);
+}
+
+
+// Filter stage: drop reads failing length, quality and complexity thresholds,
+// moving those that pass to the front of the batch with their metadata.
+void filter_batch(file_pipeline* pipe, read_batch batch) {
+    arguments_t* args = pipe->args;
+    // formatting here saves work for the writer stage, when there is one
+    bool format = !pipe->writer->write_bam && !pipe->writer->stats_only && pipe->process != NULL;
+    size_t kept = 0;
+    for (size_t i = 0; i < batch->n; ++i) {
+        kseq_t* seq = &batch->reads[i];
+        // BAM records are only decoded once they pass the cheaper filters
+        bam1_t* record = batch->bam_input ? batch->bams[i] : NULL;
+        size_t len = record != NULL ? (size_t)record->core.l_qseq : seq->seq.l;
+        if (len > args->max_length) {
+            batch->failures[R_TOO_LONG]++;
+            continue;
+        }
+        if (len < args->min_length) {
+            batch->failures[R_TOO_SHORT]++;
+            continue;
+        }
+        float mean_q = record != NULL
+            ? mean_qual_from_bam(bam_get_qual(record), len)
+            : mean_qual(seq->qual.s, seq->qual.l);
+        if (mean_q < args->min_qscore) {
+            batch->failures[R_LOW_QUALITY]++;
+            continue;
+        }
+        if (record != NULL) {
+            bam_to_fastq(record, &seq->name, &seq->seq, &seq->qual);
+        }
+        if (args->dust) {
+            if (dust_exceeds(
+                    thread_dust_engine(), (uint8_t*)seq->seq.s, seq->seq.l,
+                    args->dust_t, args->dust_w, args->max_dust)) {
+                batch->failures[R_DUST_MASKED]++;
                 continue;
             }
-            int rtn = process_dir(path, writer, args, recurse - 1);
-            status = max(status, rtn);
-        } else {
-            // skip
         }
-        free(path);
+        if (kept != i) read_batch_swap(batch, kept, i);
+        seq = &batch->reads[kept];
+        batch->mean_q[kept] = mean_q;
+        if (!pipe->parse_meta) {
+            kept++;
+            continue;
+        }
+        if (record != NULL) {
+            // tags are read directly from the record, and are the comment of FASTQ output
+            bool write_bam = pipe->writer->write_bam;
+            if (batch->metas[kept] == NULL) {
+                kstring_t empty = {0, 0, NULL};
+                batch->metas[kept] = create_read_meta(&empty);
+            }
+            char* aux = (char*)bam_get_aux(record);
+            size_t l_aux = bam_get_l_aux(record);
+            parse_read_meta_bam(batch->metas[kept], aux, l_aux, write_bam);
+            seq->comment.l = 0;
+            if (!write_bam) format_aux(aux, l_aux, &seq->comment);
+        }
+        else if (batch->metas[kept] == NULL) {
+            batch->metas[kept] = parse_read_meta(seq->comment, pipe->writer->write_bam);
+        }
+        else {
+            parse_read_meta_into(batch->metas[kept], seq->comment, pipe->writer->write_bam);
+        }
+        if (format) {
+            format_read(pipe->writer, seq, batch->metas[kept], &batch->text);
+            batch->text_end[kept] = batch->text.l;
+        }
+        kept++;
     }
-    closedir(dir);
+    batch->n = kept;
+}
 
-    return status;
+void* batch_worker(void* arg) {
+    batch_job* job = arg;
+    read_batch batch = job->batch;
+    if (batch != NULL) filter_batch(job->pipe, batch);
+    free(job);
+    return batch;
 }
 
 
-double dust_fraction(uint8_t *seq, size_t len, int t, int w) {
-    if (len == 0) return 0.0;
-    uint64_t *r;
-    int n;
-    r = sdust(0, (uint8_t*) seq, -1, t, w, &n);
-    int masked_bases = 0;
-    for (int i = 0; i < n; ++i) {
-        int start = (int)(r[i] >> 32);
-        int end = (int)r[i];
-        masked_bases += (end - start);
+// Writer stage: results must be given in input order
+void consume_batch(file_pipeline* pipe, read_batch batch) {
+    for (size_t i = 0; i < batch->n; ++i) {
+        size_t len = batch->reads[i].seq.l;
+        ++pipe->n; pipe->slen += len;
+        pipe->minl = min(pipe->minl, len);
+        pipe->maxl = max(pipe->maxl, len);
+        kahan_sum(&pipe->meanq, batch->mean_q[i], &pipe->c);
+        if (pipe->parse_meta) {
+            kh_counter_increment(pipe->run_ids, batch->metas[i]->runid);
+            kh_counter_increment(pipe->basecallers, batch->metas[i]->basecaller);
+        }
+        if (pipe->l_stats != NULL) {
+            add_length_count(pipe->l_stats, len);
+            add_qual_count(pipe->q_stats, batch->mean_q[i]);
+        }
+    }
+    for (size_t i = 0; i < NUM_FAILURE_CODES; ++i) {
+        pipe->failures[i] += batch->failures[i];
     }
-    return (double) masked_bases / len;
+    acquire_writer(pipe->queue, pipe->findex, pipe->writer);
+    write_batch(pipe->writer, batch, pipe->fname);
+    release_writer(pipe->queue, pipe->findex, pipe->writer, false);
+    return_batch(pipe, batch);
 }
 
+void* pipeline_writer(void* arg) {
+    file_pipeline* pipe = arg;
+    hts_tpool_result* r;
+    while ((r = hts_tpool_next_result_wait(pipe->process)) != NULL) {
+        read_batch batch = hts_tpool_result_data(r);
+        hts_tpool_delete_result(r, 0);
+        if (batch == NULL) break;  // end of input
+        consume_batch(pipe, batch);
+    }
+    return NULL;
+}
 
-int process_file(char* fname, writer writer, arguments_t* args, int recurse) {
-    int status = 0;
-    struct stat finfo;
-    int res = stat(fname, &finfo);
-    if (res == -1) {
-        fprintf(stderr, "ERROR  : could not process file %s: %s\n", fname, strerror(errno));
-        return errno;
-    }
-
-    // handle directory input
-    if ((finfo.st_mode & S_IFMT) == S_IFDIR) {
-        if (recurse != 0) {
-            char* sfname = strip_path(fname);
-            int rtn = process_dir(sfname, writer, args, recurse - 1);
-            status = max(status, rtn);
-            free(sfname);
-        }
-        return status;
+// Pass a batch from the reader to the next stage, NULL signals end of input.
+// Blocks if the pool is already holding the maximum number of batches for
+// this file.
+void submit_batch(file_pipeline* pipe, read_batch batch) {
+    if (pipe->process == NULL) {
+        if (batch == NULL) return;
+        filter_batch(pipe, batch);
+        consume_batch(pipe, batch);
+        return;
+    }
+    batch_job* job = xalloc(1, sizeof(batch_job), "batch job");
+    job->pipe = pipe;
+    job->batch = batch;
+    if (hts_tpool_dispatch(pipe->writer->hts_pool.pool, pipe->process, batch_worker, job) != 0) {
+        fprintf(stderr, "Error dispatching reads to thread pool\n");
+        exit(EXIT_FAILURE);
     }
+}
+
 
-    gzFile fp;
-    kseq_t *seq;
+// Reader stage for FASTQ input, filtering failures are counted by the later
+// stages. Returns the final kseq_read() status.
+int read_fastq(file_pipeline* pipe, uint64_t* failures, bool* truncated) {
+    *truncated = false;  // track if last read record was truncated
+    // uncompressed files are parsed in place, until a record that kseq
+    // must handle is found
+    off_t offset = 0;
+    pipe->map = strcmp(pipe->fname, "-") == 0 ? NULL : fastq_map_open(pipe->fname);
+    if (pipe->map != NULL) {
+        read_batch batch = NULL;
+        fastq_view view;
+        int status;
+        while ((status = fastq_map_next(pipe->map, &view)) >= 0) {
+            failures[R_RECORD_OK]++;
+            if (batch == NULL) batch = take_batch(pipe);
+            read_batch_push_view(batch, &view);
+            if (batch->n >= READ_BATCH_SIZE) {
+                submit_batch(pipe, batch);
+                batch = NULL;
+            }
+        }
+        if (batch != NULL) submit_batch(pipe, batch);
+        if (status == -1) return -1;
+        offset = pipe->map->pos;
+    }
 
-    fp = gzopen(fname, "r");
-    seq = kseq_init(fp);
-    size_t n = 0, slen = 0;
-    size_t minl = UINTMAX_MAX, maxl = 0;
-    double meanq = 0.0, c = 0.0;
-    status = 0;
-    kh_counter_t *run_ids = kh_counter_init();
-    kh_counter_t *basecallers = kh_counter_init();
-    uint64_t failures[NUM_FAILURE_CODES] = {0};
-    bool truncated = false;  // track if last read record was truncated
+    // BGZF input is inflated on the pool
+    instream fp = instream_open_at(pipe->fname, offset, &pipe->writer->hts_pool);
+    if (fp == NULL) {
+        failures[F_STREAM_ERROR]++;
+        return -3;
+    }
+    kseq_t* seq = kseq_init(fp);
+    read_batch batch = NULL;
+    int status;
     while ((status = kseq_read(seq)) != -1) {  // EOF - normal exit
         if (status == -2) {  // truncated quality string
             failures[F_QUAL_TRUNCATED]++;
-            truncated = true;
+            *truncated = true;
             continue;
         } else if (status == -3) {  // error reading stream
             failures[F_STREAM_ERROR]++;
@@ -149,46 +325,140 @@ int process_file(char* fname, writer writer, arguments_t* args, int recurse) {
         }
         if (seq->qual.l == 0) {
             failures[F_QUAL_MISSING]++;
-            truncated = true; // not present is truncated \:D/
+            *truncated = true; // not present is truncated \:D/
             status = -2;
             continue;
         } else {
-            truncated = false;
+            *truncated = false;
             failures[R_RECORD_OK]++;
         }
 
-        // accumulate stats only for reads within length and quality thresholds
-        if (seq->seq.l > args->max_length) {
-            failures[R_TOO_LONG]++;
-            continue;
+        if (batch == NULL) batch = take_batch(pipe);
+        // seq is given fresh buffers by this
+        read_batch_push(batch, seq);
+        if (batch->n >= READ_BATCH_SIZE) {
+            submit_batch(pipe, batch);
+            batch = NULL;
         }
-        if (seq->seq.l < args->min_length) {
-            failures[R_TOO_SHORT]++;
-            continue;
+    }
+    if (batch != NULL) submit_batch(pipe, batch);
+    kseq_destroy(seq);
+    instream_close(fp);
+    return status;
+}
+
+
+// Reader stage for (unaligned) BAM input, decompressed using the thread
+// pool. Records are decoded by the filter stage. Returns a status as from
+// kseq_read().
+int read_bam(file_pipeline* pipe, uint64_t* failures) {
+    htsFile* fp = hts_open(pipe->fname, "r");
+    sam_hdr_t* hdr = NULL;
+    if (fp != NULL) {
+        if (pipe->writer->hts_pool.pool != NULL) {
+            hts_set_opt(fp, HTS_OPT_THREAD_POOL, &pipe->writer->hts_pool);
         }
-        float mean_q = mean_qual_naive(seq->qual.s, seq->qual.l);
-        if (mean_q < args->min_qscore) {
-            failures[R_LOW_QUALITY]++;
+        hdr = sam_hdr_read(fp);
+    }
+    if (hdr == NULL) {
+        fprintf(stderr, "ERROR  : could not read BAM file %s\n", pipe->fname);
+        failures[F_UNKNOWN_ERROR]++;
+        if (fp != NULL) hts_close(fp);
+        return -4;
+    }
+
+    bam1_t* record = bam_init1();
+    read_batch batch = NULL;
+    int status;
+    while ((status = sam_read1(fp, hdr, record)) >= 0) {
+        if (!is_primary_record(record)) continue;
+        if (record->core.l_qseq == 0 || bam_get_qual(record)[0] == 0xff) {
+            failures[F_QUAL_MISSING]++;
             continue;
         }
-        if (args->dust) {
-            double masked_fraction = dust_fraction((uint8_t*)seq->seq.s, seq->seq.l, args->dust_t, args->dust_w);
-            if (masked_fraction > args->max_dust) {
-                failures[R_DUST_MASKED]++;
-                continue;
-            }
+        failures[R_RECORD_OK]++;
+
+        if (batch == NULL) batch = take_batch(pipe);
+        // record is given the batch's spare record by this
+        read_batch_push_bam(batch, &record);
+        if (batch->n >= READ_BATCH_SIZE) {
+            submit_batch(pipe, batch);
+            batch = NULL;
+        }
+    }
+    if (batch != NULL) submit_batch(pipe, batch);
+    if (status < -1) failures[F_STREAM_ERROR]++;
+    bam_destroy1(record);
+    sam_hdr_destroy(hdr);
+    hts_close(fp);
+    return status < -1 ? -3 : -1;
+}
+
+
+// Convert a counter to a list, in table order as written to the summaries
+static field_count* _field_counts(kh_counter_t* counter, size_t* n) {
+    field_count* counts = xalloc(max(kh_size(counter), 1u), sizeof(field_count), "counts");
+    *n = 0;
+    for (khiter_t k = 0; k < kh_end(counter); ++k) {
+        if (kh_exist(counter, k)) {
+            counts[(*n)++] = (field_count){strdup(kh_key(counter, k)), kh_val(counter, k)};
+        }
+    }
+    return counts;
+}
+
+
+// Read, filter and write out the reads of a file, summarising it
+void read_file(
+        char* fname, size_t findex, writer writer, arguments_t* args, file_queue* queue,
+        file_summary* summary, bool histograms) {
+    memset(summary, 0, sizeof(file_summary));
+    int status = 0;
+    file_pipeline pipe = {
+        .fname = fname, .findex = findex, .writer = writer, .args = args, .queue = queue,
+        .minl = UINTMAX_MAX,
+        .run_ids = kh_counter_init(), .basecallers = kh_counter_init()};
+    // only reads that are written, or summarised by field, need their headers parsed
+    pipe.parse_meta = !writer->stats_only || histograms || writer->output != NULL
+        || writer->perread != NULL || writer->perread_bgzf != NULL
+        || writer->runids != NULL || writer->basecallers != NULL;
+    if (histograms) {
+        pipe.l_stats = create_length_stats();
+        pipe.q_stats = create_qual_stats(QUAL_HIST_WIDTH);
+    }
+    pthread_mutex_init(&pipe.spare_lock, NULL);
+    pthread_t writer_stage;
+    if (writer->hts_pool.pool != NULL) {
+        int qsize = BATCHES_PER_THREAD * hts_tpool_size(writer->hts_pool.pool);
+        pipe.process = hts_tpool_process_init(writer->hts_pool.pool, qsize, 0);
+        if (pipe.process == NULL) {
+            fprintf(stderr, "Error creating thread pool queue\n");
+            exit(EXIT_FAILURE);
         }
+        if (pthread_create(&writer_stage, NULL, pipeline_writer, &pipe) != 0) {
+            fprintf(stderr, "Error creating writer thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-        ++n ; slen += seq->seq.l;
-        minl = min(minl, seq->seq.l);
-        maxl = max(maxl, seq->seq.l);
-        kahan_sum(&meanq, mean_q, &c);
-        read_meta meta = parse_read_meta(seq->comment);
-        write_read(writer, seq, meta, mean_q, fname);
-        kh_counter_increment(run_ids, meta->runid);
-        kh_counter_increment(basecallers, meta->basecaller);
-        destroy_read_meta(meta);
+    uint64_t* failures = summary->failures;
+    bool truncated = false;
+    if (is_bam_filename(fname)) {
+        status = read_bam(&pipe, failures);
+    }
+    else {
+        status = read_fastq(&pipe, failures, &truncated);
+    }
+    submit_batch(&pipe, NULL);
+    if (pipe.process != NULL) {
+        pthread_join(writer_stage, NULL);
+        hts_tpool_process_destroy(pipe.process);
     }
+    fastq_map_close(pipe.map);
+    for (size_t i = 0; i < NUM_FAILURE_CODES; ++i) {
+        failures[i] += pipe.failures[i];
+    }
+
     if (truncated) {
         // if the last read was truncated, we count that as file error
         failures[F_STREAM_ERROR]++;
@@ -198,7 +468,52 @@ int process_file(char* fname, writer writer, arguments_t* args, int recurse) {
         failures[F_FILE_OK]++;
     }
 
-    status = status == -1 ? EXIT_SUCCESS : EXIT_FAILURE;
+    summary->status = status == -1 ? EXIT_SUCCESS : EXIT_FAILURE;
+    summary->n = pipe.n;
+    summary->slen = pipe.slen;
+    summary->minl = pipe.minl;
+    summary->maxl = pipe.maxl;
+    summary->meanq = pipe.meanq;
+    summary->runids = _field_counts(pipe.run_ids, &summary->n_runids);
+    summary->basecallers = _field_counts(pipe.basecallers, &summary->n_basecallers);
+    summary->l_stats = pipe.l_stats;
+    summary->q_stats = pipe.q_stats;
+
+    // cleanup
+    for (size_t i = 0; i < pipe.nspare; ++i) {
+        destroy_read_batch(pipe.spare[i]);
+    }
+    free(pipe.spare);
+    pthread_mutex_destroy(&pipe.spare_lock);
+    kh_counter_destroy(pipe.basecallers);
+    kh_counter_destroy(pipe.run_ids);
+}
+
+
+// Process a file, or with --cache take its summary from the cache when its
+// reads are not required
+int process_file(
+        char* fname, size_t findex, writer writer, arguments_t* args,
+        manifest manifest, summary_cache cache, file_queue* queue) {
+    if (args->verbose) {
+        fprintf(stderr, "Processing %s\n", fname);
+    }
+
+    file_summary summary;
+    kstring_t key = {0, 0, NULL};
+    bool cached = cache != NULL && summary_key(cache, fname, &key) && load_summary(cache, key.s, &summary);
+    if (!cached) {
+        read_file(fname, findex, writer, args, queue, &summary, cache != NULL);
+        // not stored if the file changed while it was read
+        kstring_t after = {0, 0, NULL};
+        if (key.l > 0 && summary.status == EXIT_SUCCESS
+                && summary_key(cache, fname, &after) && strcmp(key.s, after.s) == 0) {
+            store_summary(cache, key.s, &summary);
+        }
+        free(after.s);
+    }
+    free(key.s);
+    uint64_t* failures = summary.failures;
 
     if (failures[F_STREAM_ERROR] > 0) {
         fprintf(stderr,
@@ -217,6 +532,8 @@ int process_file(char* fname, writer writer, arguments_t* args, int recurse) {
     }
 
     // summary entries
+    size_t n = summary.n;
+    acquire_writer(queue, findex, writer);
     if(writer->perfile != NULL) {
         fprintf(writer->perfile, "%s\t", fname);
         if (writer->sample != NULL) fprintf(writer->perfile, "%s\t", args->sample);
@@ -225,7 +542,7 @@ int process_file(char* fname, writer writer, arguments_t* args, int recurse) {
             fprintf(writer->perfile, "0\t0\t0\t0\t0.00");
         } else {
             fprintf(writer->perfile, "%zu\t%zu\t%zu\t%zu\t%.2f",
-                n, slen, minl, maxl, meanq/n
+                n, summary.slen, summary.minl, summary.maxl, summary.meanq/n
             );
         }
         for (size_t i = 0; i < NUM_FAILURE_CODES; ++i) {
@@ -234,70 +551,209 @@ int process_file(char* fname, writer writer, arguments_t* args, int recurse) {
         fprintf(writer->perfile, "\n");
     }
     if(writer->runids != NULL) {
-        for (khiter_t k = 0; k < kh_end(run_ids); ++k) {
-            if (kh_exist(run_ids, k)) {
-                fprintf(writer->runids, "%s\t", fname);
-                if (writer->sample != NULL) fprintf(writer->runids, "%s\t", args->sample);
-                fprintf(writer->runids, "%s\t%d\n", kh_key(run_ids, k), kh_val(run_ids, k));
-            }
+        for (size_t i = 0; i < summary.n_runids; ++i) {
+            fprintf(writer->runids, "%s\t", fname);
+            if (writer->sample != NULL) fprintf(writer->runids, "%s\t", args->sample);
+            fprintf(writer->runids, "%s\t%d\n", summary.runids[i].name, summary.runids[i].count);
         }
     }
     if(writer->basecallers != NULL) {
-        for (khiter_t k = 0; k < kh_end(basecallers); ++k) {
-            if (kh_exist(basecallers, k)) {
-                fprintf(writer->basecallers, "%s\t", fname);
-                if (writer->sample != NULL) fprintf(writer->basecallers, "%s\t", args->sample);
-                fprintf(writer->basecallers, "%s\t%d\n", kh_key(basecallers, k), kh_val(basecallers, k));
-            }
+        for (size_t i = 0; i < summary.n_basecallers; ++i) {
+            fprintf(writer->basecallers, "%s\t", fname);
+            if (writer->sample != NULL) fprintf(writer->basecallers, "%s\t", args->sample);
+            fprintf(writer->basecallers, "%s\t%d\n",
+                summary.basecallers[i].name, summary.basecallers[i].count);
         }
     }
     for (size_t i = 0; i < NUM_FAILURE_CODES; ++i) {
         writer->failures[i] += failures[i];
     }
+    if (cached) {
+        // the reads that would have been written
+        merge_stats(writer->routes[0]->l_stats, summary.l_stats);
+        merge_stats(writer->routes[0]->q_stats, summary.q_stats);
+    }
+    if (manifest != NULL) manifest_add_file(manifest, writer, fname);
+    release_writer(queue, findex, writer, true);
 
-    // cleanup
-    kh_counter_destroy(basecallers);
-    kh_counter_destroy(run_ids);
-    kseq_destroy(seq);
-    gzclose(fp);
+    int status = summary.status;
+    destroy_file_summary(&summary);
+    return status;
+}
+
+
+void* file_worker(void* arg) {
+    file_queue* queue = arg;
+    while (true) {
+        pthread_mutex_lock(&queue->lock);
+        size_t next = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (next >= queue->files->n) break;
+        size_t i = queue->order == NULL ? next : queue->order[next];
+
+        int rtn = process_file(
+            queue->files->paths[i], i, queue->writer, queue->args, queue->manifest, queue->cache,
+            queue);
+        pthread_mutex_lock(&queue->lock);
+        queue->status = max(queue->status, rtn);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return NULL;
+}
+
+
+// Process all files, with each worker taking the next unprocessed file in
+// turn. Half of args->threads are used for reading files, the remaining
+// work of each file is shared out over the thread pool. Unless output is
+// --ordered, the largest files are taken first so that a large file
+// found late does not leave a single worker running at the end.
+int process_files(
+        file_list* files, writer writer, arguments_t* args, manifest manifest, summary_cache cache) {
+    int status = 0;
+    size_t nworkers = min((size_t)(args->threads + 1) / 2, files->n);
+    if (nworkers <= 1) {
+        for (size_t i = 0; i < files->n; ++i) {
+            int rtn = process_file(files->paths[i], i, writer, args, manifest, cache, NULL);
+            status = max(status, rtn);
+        }
+        return status;
+    }
+
+    file_queue queue = {
+        .files = files, .writer = writer, .args = args, .manifest = manifest, .cache = cache,
+        .order = args->ordered ? NULL : largest_first(files),
+        .next = 0, .turn = 0, .status = 0};
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.turn_cv, NULL);
+    pthread_t* workers = xalloc(nworkers, sizeof(pthread_t), "file workers");
+    for (size_t i = 0; i < nworkers; ++i) {
+        if (pthread_create(&workers[i], NULL, file_worker, &queue) != 0) {
+            fprintf(stderr, "Error creating worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (size_t i = 0; i < nworkers; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    free(queue.order);
+    pthread_cond_destroy(&queue.turn_cv);
+    pthread_mutex_destroy(&queue.lock);
+    return queue.status;
+}
+
+
+// Whether reads written to stdout are discarded, by redirection to /dev/null
+bool stdout_discarded(void) {
+    struct stat out, null;
+    return fstat(STDOUT_FILENO, &out) == 0 && stat("/dev/null", &null) == 0
+        && out.st_dev == null.st_dev && out.st_ino == null.st_ino;
+}
+
+
+// Process files as they are completed in the input directories, until the
+// watch is interrupted or times out. Outputs are refreshed after each round.
+int watch_inputs(
+        file_list* done, writer writer, arguments_t* args, manifest manifest, summary_cache cache) {
+    watcher watcher = create_watcher(args, done);
+    if (watcher == NULL) {
+        fprintf(stderr, "WARNING: --watch given without an input directory to watch.\n");
+        return 0;
+    }
+    fprintf(stderr, "INFO   : Watching for new files.\n");
+    int status = 0;
+    refresh_writer(writer);
+    file_list files = {0, 0, NULL, NULL};
+    while (watch_files(watcher, &files) > 0) {
+        if (args->verbose) fprintf(stderr, "INFO   : Processing %zu new files.\n", files.n);
+        int rtn = process_files(&files, writer, args, manifest, cache);
+        status = max(status, rtn);
+        refresh_writer(writer);
+        destroy_file_list(&files);
+        files = (file_list){0, 0, NULL, NULL};
+    }
+    destroy_file_list(&files);
+    destroy_watcher(watcher);
     return status;
 }
 
 
 int main(int argc, char **argv) {
     arguments_t args = parse_arguments(argc, argv);
+#ifdef NOTHREADS
+    if (args.threads != 1) {
+        fprintf(
+            stderr,
+            "--threads set to %d, but threading not supported by this build.\n", args.threads);
+        args.threads = 1;
+    }
+#endif
+
+    manifest manifest = NULL;
+    if (args.manifest != NULL) manifest = open_manifest(&args);
+    bool resuming = manifest != NULL && manifest_resuming(manifest);
 
     writer writer = initialize_writer(
         args.demultiplex_dir, args.histograms, args.perread, args.perfile,
         args.runids, args.basecallers, args.sample,
         args.reheader, args.write_bam, args.reads_per_file,
-        args.threads);
+        args.threads, args.write_bgzf, args.write_gzi, args.gzi_file,
+        args.write_bci, args.bci_file, args.bci_chunk_size,
+        args.demultiplex_key, args.max_open_files, resuming, args.stats_only, args.read_columns, args.read_bgzf);
     if (writer == NULL) exit(1);
+    if (resuming) restore_writer(manifest, writer);
+    // cached summaries stand in for files whose reads are not needed
+    summary_cache cache = NULL;
+    if (args.cache != NULL) {
+        cache = open_summary_cache(&args, args.perread == NULL && (args.stats_only || stdout_discarded()));
+    }
 
     size_t nfile = 0;
     int status = 0;
     for( ; args.files[nfile] ; nfile++);
 
-    if (nfile==1 && strcmp(args.files[0], "-") == 0) {
+    file_list files = {0, 0, NULL, NULL};
+    if (args.stream) {
+        // stdin is read as a single input file
+        add_file(&files, "-", 0);
+    } else if (nfile==1 && strcmp(args.files[0], "-") == 0) {
         char *ln = NULL;
         size_t n = 0;
         ssize_t nchr = 0;
         int recurse = 0;
         while ((nchr = getline (&ln, &n, stdin)) != -1) {
             ln[strcspn(ln, "\r\n")] = 0;
-            int rtn = process_file(ln, writer, &args, recurse);
+            int rtn = find_files(ln, &files, &args, recurse);
             status = max(status, rtn);
         }
         free(ln);
     } else {
         for (size_t i=0; i<nfile; ++i) {
-            int rtn = process_file(args.files[i], writer, &args, args.recurse);
+            int rtn = find_files(args.files[i], &files, &args, args.recurse);
             status = max(status, rtn);
         }
     }
+    // files completed before a checkpoint are not processed again
+    file_list pending = {0, 0, NULL, NULL};
+    for (size_t i = 0; i < files.n; ++i) {
+        if (!resuming || !manifest_has_file(manifest, files.paths[i])) {
+            add_file(&pending, files.paths[i], files.sizes[i]);
+        }
+    }
+    if (resuming) {
+        fprintf(stderr, "INFO   : Resuming, skipping %zu processed files.\n", files.n - pending.n);
+    }
+    int rtn = process_files(&pending, writer, &args, manifest, cache);
+    status = max(status, rtn);
+    destroy_file_list(&pending);
+    if (args.watch) {
+        rtn = watch_inputs(&files, writer, &args, manifest, cache);
+        status = max(status, rtn);
+    }
+    destroy_file_list(&files);
 
     uint64_t total_records =
-        writer->failures[R_RECORD_OK] 
+        writer->failures[R_RECORD_OK]
         + writer->failures[R_TOO_LONG]
         + writer->failures[R_TOO_SHORT]
         + writer->failures[R_LOW_QUALITY]
@@ -314,6 +770,10 @@ int main(int argc, char **argv) {
     for (size_t i = 0; i < NUM_FAILURE_CODES; ++i) {
         fprintf(stderr, "%s\t%" PRIu64 "\n", failure_type[i], writer->failures[i]);
     }
+    if (manifest != NULL) close_manifest(manifest, writer);
+    close_summary_cache(cache);
     destroy_writer(writer);
+    destroy_rg_cache();
+    destroy_thread_dust_engine();
     return status;
 }
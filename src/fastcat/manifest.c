@@ -0,0 +1,374 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "htslib/khash.h"
+#include "htslib/kstring.h"
+
+#include "../common.h"
+#include "../stats.h"
+#include "manifest.h"
+#include "serial.h"
+
+// version 1 of the format, see README
+static const char manifest_magic[8] = {'F', 'C', 'M', 'A', 'N', 'I', 'F', 1};
+// least time between checkpoints, each rewrites the manifest
+#define MANIFEST_INTERVAL 5.0
+// stands in for absent strings and sizes
+#define MANIFEST_NONE UINT64_MAX
+
+KHASH_MAP_INIT_STR(MANIFEST_FILES, size_t)
+
+struct _manifest {
+    char* fname;
+    kstring_t settings;
+    // completed input files, indexed by path
+    size_t n;
+    size_t m;
+    char** paths;
+    uint64_t* sizes;
+    int64_t* mtimes;
+    khash_t(MANIFEST_FILES)* index;
+    // loaded manifest, the writer state is restored from state_offset
+    uint8_t* data;
+    size_t len;
+    size_t state_offset;
+    double last_checkpoint;
+};
+
+
+static double _now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+typedef struct {
+    const char* fname;
+    serial_reader in;
+} reader;
+
+// Exit if the manifest could not be decoded
+static void _check(reader* in) {
+    if (!in->in.error) return;
+    fprintf(stderr, "Error: manifest '%s' is truncated or corrupt.\n", in->fname);
+    exit(EXIT_FAILURE);
+}
+
+
+// The options that determine the outputs, which must not change on resuming
+static void _settings(arguments_t* args, kstring_t* out) {
+    #define STR(x) ((x) == NULL ? "(none)" : (x))
+    ksprintf(out,
+        "demultiplex=%s\tdemultiplex_key=%s\treads_per_file=%zu\tbam_out=%zu\tbgzf=%d\t"
+        "reheader=%zu\tsample=%s\tmin_length=%zu\tmax_length=%zu\tmin_qscore=%f\t"
+        "dust=%d\tmax_dust=%f\tdust_w=%zu\tdust_t=%zu\t"
+        "read=%s\tfile=%s\trunids=%s\tbasecallers=%s\thistograms=%s",
+        STR(args->demultiplex_dir), args->demultiplex_key, args->reads_per_file,
+        args->write_bam, args->write_bgzf, args->reheader, args->sample,
+        args->min_length, args->max_length, args->min_qscore,
+        args->dust, args->max_dust, args->dust_w, args->dust_t,
+        STR(args->perread), STR(args->perfile), STR(args->runids), STR(args->basecallers),
+        STR(args->histograms));
+    #undef STR
+}
+
+
+static void _add_entry(manifest manifest, char* path, uint64_t size, int64_t mtime) {
+    if (manifest->n == manifest->m) {
+        size_t m = manifest->m == 0 ? 64 : 2 * manifest->m;
+        manifest->paths = xrecalloc(manifest->paths, manifest->m, m, sizeof(char*), "manifest");
+        manifest->sizes = xrecalloc(manifest->sizes, manifest->m, m, sizeof(uint64_t), "manifest");
+        manifest->mtimes = xrecalloc(manifest->mtimes, manifest->m, m, sizeof(int64_t), "manifest");
+        manifest->m = m;
+    }
+    int ret;
+    khiter_t k = kh_put(MANIFEST_FILES, manifest->index, path, &ret);
+    if (ret == 0) {
+        // processed again, e.g. given twice on the command line
+        size_t i = kh_val(manifest->index, k);
+        manifest->sizes[i] = size;
+        manifest->mtimes[i] = mtime;
+        free(path);
+        return;
+    }
+    kh_val(manifest->index, k) = manifest->n;
+    manifest->paths[manifest->n] = path;
+    manifest->sizes[manifest->n] = size;
+    manifest->mtimes[manifest->n++] = mtime;
+}
+
+
+static void _load(manifest manifest) {
+    FILE* fp = fopen(manifest->fname, "rb");
+    if (fp == NULL) {
+        if (errno == ENOENT) return;  // nothing to resume
+        fprintf(stderr, "Error: Could not open manifest '%s': %s\n", manifest->fname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    kstring_t data = {0, 0, NULL};
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        kputsn(buf, n, &data);
+    }
+    if (ferror(fp)) {
+        fprintf(stderr, "Error: Could not read manifest '%s'.\n", manifest->fname);
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+
+    if (data.l < sizeof(manifest_magic) || memcmp(data.s, manifest_magic, sizeof(manifest_magic)) != 0) {
+        fprintf(stderr, "Error: '%s' is not a fastcat manifest.\n", manifest->fname);
+        exit(EXIT_FAILURE);
+    }
+    reader in = {
+        manifest->fname,
+        {(uint8_t*)data.s + sizeof(manifest_magic), (uint8_t*)data.s + data.l, false}};
+    char* settings = get_str(&in.in);
+    _check(&in);
+    if (settings == NULL || strcmp(settings, manifest->settings.s) != 0) {
+        fprintf(stderr,
+            "Error: manifest '%s' was written with different options, cannot resume.\n"
+            "  manifest: %s\n  current:  %s\n",
+            manifest->fname, settings == NULL ? "" : settings, manifest->settings.s);
+        exit(EXIT_FAILURE);
+    }
+    free(settings);
+    uint64_t nfiles = get_u64(&in.in);
+    for (uint64_t i = 0; i < nfiles; ++i) {
+        char* path = get_str(&in.in);
+        uint64_t size = get_u64(&in.in);
+        int64_t mtime = (int64_t)get_u64(&in.in);
+        if (path == NULL) in.in.error = true;
+        _check(&in);
+        _add_entry(manifest, path, size, mtime);
+    }
+    manifest->data = (uint8_t*)data.s;
+    manifest->len = data.l;
+    manifest->state_offset = in.in.p - (uint8_t*)data.s;
+}
+
+
+manifest open_manifest(arguments_t* args) {
+    manifest manifest = xalloc(1, sizeof(_manifest), "manifest");
+    manifest->fname = strdup(args->manifest);
+    manifest->index = kh_init(MANIFEST_FILES);
+    _settings(args, &manifest->settings);
+    if (args->resume) _load(manifest);
+    manifest->last_checkpoint = _now();
+    return manifest;
+}
+
+
+bool manifest_resuming(manifest manifest) {
+    return manifest->data != NULL;
+}
+
+
+// Truncate an output to its size at the checkpoint
+static void _truncate(const char* name, int fd, uint64_t size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size < size) {
+        fprintf(stderr,
+            "Error: output '%s' is missing or shorter than when last checkpointed, cannot resume.\n", name);
+        exit(EXIT_FAILURE);
+    }
+    if (ftruncate(fd, size) != 0 || lseek(fd, size, SEEK_SET) < 0) {
+        fprintf(stderr, "Error: could not truncate output '%s': %s\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void _truncate_summary(const char* name, FILE* fp, uint64_t size) {
+    if (size == MANIFEST_NONE || fp == NULL) return;
+    fflush(fp);
+    _truncate(name, fileno(fp), size);
+}
+
+
+void restore_writer(manifest manifest, writer writer) {
+    reader in = {
+        manifest->fname,
+        {manifest->data + manifest->state_offset, manifest->data + manifest->len, false}};
+    if (get_u32(&in.in) != NUM_FAILURE_CODES) in.in.error = true;
+    for (size_t i = 0; i < NUM_FAILURE_CODES; ++i) {
+        writer->failures[i] = get_u64(&in.in);
+    }
+    uint64_t stdout_size = get_u64(&in.in);
+    uint64_t summary_sizes[4];
+    for (size_t i = 0; i < 4; ++i) {
+        summary_sizes[i] = get_u64(&in.in);
+    }
+    _check(&in);
+
+    if (writer->output == NULL) {
+        if (stdout_size == MANIFEST_NONE) {
+            fprintf(stderr,
+                "WARNING: output to stdout was not to a file, it will repeat reads "
+                "written after the last checkpoint.\n");
+        }
+        else {
+            _truncate("stdout", STDOUT_FILENO, stdout_size);
+        }
+    }
+    FILE* summaries[4] = {writer->perread, writer->perfile, writer->runids, writer->basecallers};
+    const char* names[4] = {"--read", "--file", "--runids", "--basecallers"};
+    for (size_t i = 0; i < 4; ++i) {
+        _truncate_summary(names[i], summaries[i], summary_sizes[i]);
+    }
+
+    uint32_t nroutes = get_u32(&in.in);
+    for (uint32_t i = 0; i < nroutes; ++i) {
+        char* name = get_str(&in.in);
+        uint64_t file_index = get_u64(&in.in);
+        uint64_t reads_written = get_u64(&in.in);
+        char* filepath = get_str(&in.in);
+        uint64_t size = get_u64(&in.in);
+        if (name == NULL && writer->output != NULL) in.in.error = true;
+        _check(&in);
+        route route = name == NULL ? writer->routes[0] : add_route(writer, name);
+        free(name);
+        route->file_index = file_index;
+        route->reads_written = reads_written;
+        if (filepath != NULL) {
+            // reopened for appending when next written to
+            FILE* fp = fopen(filepath, "r+");
+            if (fp == NULL) {
+                fprintf(stderr, "Error: output '%s' is missing, cannot resume.\n", filepath);
+                exit(EXIT_FAILURE);
+            }
+            _truncate(filepath, fileno(fp), size);
+            fclose(fp);
+            route->filepath = filepath;
+        }
+        get_stats(&in.in, route->l_stats);
+        get_stats(&in.in, route->q_stats);
+        _check(&in);
+    }
+    if (in.in.p != in.in.end) in.in.error = true;
+    _check(&in);
+    free(manifest->data);
+    manifest->data = NULL;
+}
+
+
+bool manifest_has_file(manifest manifest, const char* fname) {
+    khiter_t k = kh_get(MANIFEST_FILES, manifest->index, fname);
+    if (k == kh_end(manifest->index)) return false;
+    size_t i = kh_val(manifest->index, k);
+    struct stat st;
+    if (stat(fname, &st) != 0
+            || (uint64_t)st.st_size != manifest->sizes[i] || (int64_t)st.st_mtime != manifest->mtimes[i]) {
+        fprintf(stderr,
+            "Error: '%s' has changed since it was processed, cannot resume.\n", fname);
+        exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+
+// Write out the outputs and record their state, the manifest is replaced
+// atomically so that it always describes a consistent set of outputs.
+static void _checkpoint(manifest manifest, writer writer) {
+    sync_writer(writer);
+    kstring_t out = {0, 0, NULL};
+    kputsn(manifest_magic, sizeof(manifest_magic), &out);
+    put_str(&out, manifest->settings.s);
+    put_u64(&out, manifest->n);
+    for (size_t i = 0; i < manifest->n; ++i) {
+        put_str(&out, manifest->paths[i]);
+        put_u64(&out, manifest->sizes[i]);
+        put_u64(&out, (uint64_t)manifest->mtimes[i]);
+    }
+
+    // writer state
+    put_u32(&out, NUM_FAILURE_CODES);
+    for (size_t i = 0; i < NUM_FAILURE_CODES; ++i) {
+        put_u64(&out, writer->failures[i]);
+    }
+    struct stat st;
+    uint64_t stdout_size = MANIFEST_NONE;
+    if (writer->output == NULL && fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+        stdout_size = st.st_size;
+    }
+    put_u64(&out, stdout_size);
+    FILE* summaries[4] = {writer->perread, writer->perfile, writer->runids, writer->basecallers};
+    for (size_t i = 0; i < 4; ++i) {
+        uint64_t size = MANIFEST_NONE;
+        if (summaries[i] != NULL && fstat(fileno(summaries[i]), &st) == 0) size = st.st_size;
+        put_u64(&out, size);
+    }
+    put_u32(&out, writer->n_routes);
+    for (size_t i = 0; i < writer->n_routes; ++i) {
+        route route = writer->routes[i];
+        put_str(&out, route->name);
+        put_u64(&out, route->file_index);
+        put_u64(&out, route->reads_written);
+        put_str(&out, route->filepath);
+        uint64_t size = 0;
+        if (route->filepath != NULL) {
+            if (stat(route->filepath, &st) != 0) {
+                fprintf(stderr, "Error reading size of '%s'.\n", route->filepath);
+                exit(EXIT_FAILURE);
+            }
+            size = st.st_size;
+        }
+        put_u64(&out, size);
+        put_stats(&out, route->l_stats);
+        put_stats(&out, route->q_stats);
+    }
+
+    char* tmppath = xalloc(strlen(manifest->fname) + 5, sizeof(char), "manifest");
+    sprintf(tmppath, "%s.tmp", manifest->fname);
+    FILE* fp = fopen(tmppath, "wb");
+    if (fp == NULL
+            || fwrite(out.s, 1, out.l, fp) != out.l
+            || fclose(fp) != 0
+            || rename(tmppath, manifest->fname) != 0) {
+        fprintf(stderr, "Error: Could not write manifest '%s'.\n", manifest->fname);
+        exit(EXIT_FAILURE);
+    }
+    free(tmppath);
+    free(out.s);
+    manifest->last_checkpoint = _now();
+}
+
+
+void manifest_add_file(manifest manifest, writer writer, const char* fname) {
+    struct stat st;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    if (stat(fname, &st) == 0) {
+        size = st.st_size;
+        mtime = st.st_mtime;
+    }
+    _add_entry(manifest, strdup(fname), size, mtime);
+    if (_now() - manifest->last_checkpoint >= MANIFEST_INTERVAL) {
+        _checkpoint(manifest, writer);
+    }
+}
+
+
+void close_manifest(manifest manifest, writer writer) {
+    _checkpoint(manifest, writer);
+    kh_destroy(MANIFEST_FILES, manifest->index);
+    for (size_t i = 0; i < manifest->n; ++i) {
+        free(manifest->paths[i]);
+    }
+    free(manifest->paths);
+    free(manifest->sizes);
+    free(manifest->mtimes);
+    free(manifest->settings.s);
+    free(manifest->data);
+    free(manifest->fname);
+    free(manifest);
+}
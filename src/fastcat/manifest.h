@@ -0,0 +1,52 @@
+#ifndef FASTCAT_MANIFEST_H
+#define FASTCAT_MANIFEST_H
+
+#include <stdbool.h>
+
+#include "args.h"
+#include "writer.h"
+
+
+// A record of the input files that have been processed, together with the
+// state of the writer after them, from which an interrupted run can resume.
+typedef struct _manifest _manifest;
+typedef _manifest* manifest;
+
+/** Open the manifest given by args->manifest.
+ *
+ * With args->resume an existing manifest is loaded, exiting if it was
+ * written with different options. Otherwise any existing manifest is
+ * replaced at the first checkpoint.
+ *
+ * @param args program arguments.
+ * @returns a manifest.
+ *
+ */
+manifest open_manifest(arguments_t* args);
+
+// Whether a manifest was loaded, outputs are then appended to
+bool manifest_resuming(manifest manifest);
+
+/** Restore the state of a writer from a loaded manifest.
+ *
+ * Outputs are truncated to their size at the checkpoint, discarding the
+ * output of any files that were being processed after it.
+ *
+ * @param manifest loaded manifest.
+ * @param writer writer initialised for appending.
+ *
+ */
+void restore_writer(manifest manifest, writer writer);
+
+// Whether a file was processed before the checkpoint. Exits if the file has
+// since changed.
+bool manifest_has_file(manifest manifest, const char* fname);
+
+// Record a file as processed, with the writer lock held. Its outputs are
+// checkpointed if a checkpoint is due.
+void manifest_add_file(manifest manifest, writer writer, const char* fname);
+
+// Write a final checkpoint and free the manifest
+void close_manifest(manifest manifest, writer writer);
+
+#endif
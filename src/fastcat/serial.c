@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "htslib/hts_endian.h"
+
+#include "../common.h"
+#include "serial.h"
+
+
+void put_u32(kstring_t* out, uint32_t x) {
+    uint8_t buf[4];
+    u32_to_le(x, buf);
+    kputsn((char*)buf, 4, out);
+}
+
+void put_u64(kstring_t* out, uint64_t x) {
+    uint8_t buf[8];
+    u64_to_le(x, buf);
+    kputsn((char*)buf, 8, out);
+}
+
+void put_str(kstring_t* out, const char* str) {
+    if (str == NULL) {
+        put_u32(out, UINT32_MAX);
+        return;
+    }
+    size_t len = strlen(str);
+    put_u32(out, len);
+    kputsn(str, len, out);
+}
+
+void put_stats(kstring_t* out, const read_stats* stats) {
+    uint32_t nonzero = 0;
+    for (size_t i = 0; i < stats->n; ++i) {
+        nonzero += stats->counts[i] != 0;
+    }
+    put_u64(out, stats->n);
+    put_u32(out, nonzero);
+    for (size_t i = 0; i < stats->n; ++i) {
+        if (stats->counts[i] == 0) continue;
+        put_u64(out, i);
+        put_u64(out, stats->counts[i]);
+    }
+}
+
+
+static bool _available(serial_reader* in, size_t len) {
+    if (in->error || (size_t)(in->end - in->p) < len) {
+        in->error = true;
+        return false;
+    }
+    return true;
+}
+
+uint32_t get_u32(serial_reader* in) {
+    if (!_available(in, 4)) return 0;
+    uint32_t x = le_to_u32(in->p);
+    in->p += 4;
+    return x;
+}
+
+uint64_t get_u64(serial_reader* in) {
+    if (!_available(in, 8)) return 0;
+    uint64_t x = le_to_u64(in->p);
+    in->p += 8;
+    return x;
+}
+
+char* get_str(serial_reader* in) {
+    uint32_t len = get_u32(in);
+    if (len == UINT32_MAX || !_available(in, len)) return NULL;
+    char* str = xalloc(len + 1, sizeof(char), "string");
+    memcpy(str, in->p, len);
+    in->p += len;
+    return str;
+}
+
+void get_stats(serial_reader* in, read_stats* stats) {
+    uint64_t n = get_u64(in);
+    uint32_t nonzero = get_u32(in);
+    // bins must be within the range of lengths, and present
+    if (in->error || n > (1ULL << 20) || !_available(in, 16 * (size_t)nonzero)) {
+        in->error = true;
+        return;
+    }
+    read_stats counts = {n, stats->width, xalloc(max(n, (uint64_t)1), sizeof(size_t), "counts")};
+    for (uint32_t i = 0; i < nonzero; ++i) {
+        uint64_t bin = get_u64(in);
+        if (bin >= n) {
+            in->error = true;
+            break;
+        }
+        counts.counts[bin] = get_u64(in);
+    }
+    if (!in->error) merge_stats(stats, &counts);
+    free(counts.counts);
+}
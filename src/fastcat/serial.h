@@ -0,0 +1,37 @@
+#ifndef FASTCAT_SERIAL_H
+#define FASTCAT_SERIAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "htslib/kstring.h"
+
+#include "../stats.h"
+
+
+// Little-endian encoding of the fields of fastcat's binary state files, the
+// --manifest and the --cache entries. Strings are a u32 length followed by
+// their bytes, with a length of UINT32_MAX for NULL.
+
+void put_u32(kstring_t* out, uint32_t x);
+void put_u64(kstring_t* out, uint64_t x);
+void put_str(kstring_t* out, const char* str);
+// non-zero bins only, as (index, count) pairs
+void put_stats(kstring_t* out, const read_stats* stats);
+
+// Decoding of a buffer. Reading past its end, or an invalid field, sets
+// `error` and values read are then zero or NULL.
+typedef struct {
+    const uint8_t* p;
+    const uint8_t* end;
+    bool error;
+} serial_reader;
+
+uint32_t get_u32(serial_reader* in);
+uint64_t get_u64(serial_reader* in);
+// returns an allocated string, or NULL
+char* get_str(serial_reader* in);
+// add the counts read to stats
+void get_stats(serial_reader* in, read_stats* stats);
+
+#endif
@@ -0,0 +1,312 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "htslib/khash.h"
+
+#include "../common.h"
+#include "watch.h"
+
+// longest wait between checks for an interrupt
+#define WATCH_WAKE_MS 1000
+
+// input files seen, by path, with their size when last seen or WATCH_DONE
+// once they have been reported as complete
+KHASH_MAP_INIT_STR(WATCH_SEEN, off_t)
+#define WATCH_DONE -1
+
+// directories watched with inotify, by watch descriptor
+typedef struct {
+    char* path;
+    int recurse;  // depth of subdirectories to watch, as for find_files()
+} watched_dir;
+
+KHASH_MAP_INIT_INT(WATCH_DIRS, watched_dir)
+
+struct _watcher {
+    arguments_t* args;
+    char** roots;  // input directories
+    size_t nroots;
+    khash_t(WATCH_SEEN)* seen;
+    size_t npending;  // files seen that are not yet complete
+    bool rescan;  // directories must be read again to find files
+    double last_found;
+    int fd;  // inotify instance, -1 when polling
+    khash_t(WATCH_DIRS)* dirs;
+};
+
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void _interrupt(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
+static double _now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static char* _join_path(const char* dir, const char* name) {
+    char* path = xalloc(strlen(dir) + strlen(name) + 2, sizeof(char), "path");
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+
+// Record a file, returns true when it has been newly completed
+static bool _see_file(watcher watcher, const char* path, off_t size, bool complete) {
+    int ret;
+    khiter_t k = kh_get(WATCH_SEEN, watcher->seen, path);
+    if (k == kh_end(watcher->seen)) {
+        k = kh_put(WATCH_SEEN, watcher->seen, strdup(path), &ret);
+        kh_val(watcher->seen, k) = size;
+        if (complete) kh_val(watcher->seen, k) = WATCH_DONE;
+        return complete;
+    }
+    off_t last = kh_val(watcher->seen, k);
+    if (last == WATCH_DONE) return false;
+    kh_val(watcher->seen, k) = (complete || last == size) ? WATCH_DONE : size;
+    return kh_val(watcher->seen, k) == WATCH_DONE;
+}
+
+
+// Read the input directories, files found at the same size as in the last
+// read are taken to be complete
+static void _scan(watcher watcher, file_list* files) {
+    file_list found = {0, 0, NULL, NULL};
+    for (size_t i = 0; i < watcher->nroots; ++i) {
+        find_files(watcher->roots[i], &found, watcher->args, watcher->args->recurse);
+    }
+    size_t ndone = 0;
+    for (size_t i = 0; i < found.n; ++i) {
+        khiter_t k = kh_get(WATCH_SEEN, watcher->seen, found.paths[i]);
+        if (k != kh_end(watcher->seen) && kh_val(watcher->seen, k) == WATCH_DONE) {
+            ndone++;
+        }
+        else if (_see_file(watcher, found.paths[i], found.sizes[i], false)) {
+            add_file(files, found.paths[i], found.sizes[i]);
+            ndone++;
+        }
+    }
+    watcher->npending = found.n - ndone;
+    destroy_file_list(&found);
+}
+
+
+#ifdef __linux__
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+
+// Watch a directory and its subdirectories, returns non-zero on failure
+static int _add_watches(watcher watcher, const char* path, int recurse) {
+    int wd = inotify_add_watch(watcher->fd, path, WATCH_EVENTS | IN_ONLYDIR);
+    if (wd < 0) {
+        fprintf(stderr, "WARNING: could not watch directory %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int ret;
+    khiter_t k = kh_put(WATCH_DIRS, watcher->dirs, wd, &ret);
+    if (ret != 0) {
+        kh_val(watcher->dirs, k) = (watched_dir){strdup(path), recurse};
+    }
+    if (recurse == 0) return 0;
+
+    DIR* dir = opendir(path);
+    if (dir == NULL) return 0;  // reported when the directory is read
+    int fd = dirfd(dir);
+    int status = 0;
+    struct dirent* entry;
+    while (status == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        struct stat finfo;
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            is_dir = fstatat(fd, entry->d_name, &finfo, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(finfo.st_mode);
+        }
+        if (is_dir) {
+            char* subdir = _join_path(path, entry->d_name);
+            status = _add_watches(watcher, subdir, recurse - 1);
+            free(subdir);
+        }
+    }
+    closedir(dir);
+    return status;
+}
+
+static void _stop_inotify(watcher watcher) {
+    for (khiter_t k = 0; k < kh_end(watcher->dirs); ++k) {
+        if (kh_exist(watcher->dirs, k)) free(kh_val(watcher->dirs, k).path);
+    }
+    kh_clear(WATCH_DIRS, watcher->dirs);
+    close(watcher->fd);
+    watcher->fd = -1;
+}
+
+static void _fall_back(watcher watcher) {
+    fprintf(stderr, "WARNING: inotify unavailable, polling every %g seconds.\n", watcher->args->watch_interval);
+    _stop_inotify(watcher);
+}
+
+static void _start_inotify(watcher watcher) {
+    watcher->dirs = kh_init(WATCH_DIRS);
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->fd < 0) return;
+    for (size_t i = 0; i < watcher->nroots; ++i) {
+        // find_files() reads the directory itself with one less level of recursion
+        if (_add_watches(watcher, watcher->roots[i], watcher->args->recurse - 1) != 0) {
+            _fall_back(watcher);
+            return;
+        }
+    }
+    // files created before their directory was watched are found by reading it
+    watcher->rescan = true;
+}
+
+// Handle pending events, files closed or moved in are complete
+static void _read_events(watcher watcher, file_list* files) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(watcher->fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + len; ) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                watcher->rescan = true;
+                continue;
+            }
+            khiter_t k = kh_get(WATCH_DIRS, watcher->dirs, event->wd);
+            if (k == kh_end(watcher->dirs) || event->len == 0) continue;
+            watched_dir dir = kh_val(watcher->dirs, k);
+            if (event->mask & IN_ISDIR) {
+                if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && dir.recurse != 0) {
+                    char* path = _join_path(dir.path, event->name);
+                    int rtn = _add_watches(watcher, path, dir.recurse - 1);
+                    free(path);
+                    watcher->rescan = true;
+                    if (rtn != 0) {
+                        _fall_back(watcher);
+                        return;
+                    }
+                }
+                continue;
+            }
+            if (!(event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) || !is_input_filename(event->name)) continue;
+            char* path = _join_path(dir.path, event->name);
+            struct stat finfo;
+            if (stat(path, &finfo) == 0 && !S_ISDIR(finfo.st_mode)
+                    && _see_file(watcher, path, finfo.st_size, true)) {
+                add_file(files, path, finfo.st_size);
+            }
+            free(path);
+        }
+    }
+}
+#endif
+
+
+watcher create_watcher(arguments_t* args, file_list* done) {
+    watcher watcher = xalloc(1, sizeof(_watcher), "watcher");
+    watcher->args = args;
+    watcher->fd = -1;
+    for (size_t i = 0; args->files[i] != NULL; ++i) {
+        struct stat finfo;
+        if (stat(args->files[i], &finfo) == 0 && S_ISDIR(finfo.st_mode)) {
+            watcher->roots = xrecalloc(
+                watcher->roots, watcher->nroots, watcher->nroots + 1, sizeof(char*), "watched directories");
+            // named as files within are named by find_files()
+            char* root = strdup(args->files[i]);
+            size_t len = strlen(root);
+            if (len > 1 && root[len - 1] == '/') root[len - 1] = '\0';
+            watcher->roots[watcher->nroots++] = root;
+        }
+    }
+    if (watcher->nroots == 0) {
+        free(watcher);
+        return NULL;
+    }
+    watcher->seen = kh_init(WATCH_SEEN);
+    for (size_t i = 0; i < done->n; ++i) {
+        _see_file(watcher, done->paths[i], done->sizes[i], true);
+    }
+    watcher->last_found = _now();
+#ifdef __linux__
+    _start_inotify(watcher);
+#endif
+
+    // a second signal terminates the program as usual
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = _interrupt;
+    action.sa_flags = SA_RESTART | SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    return watcher;
+}
+
+
+size_t watch_files(watcher watcher, file_list* files) {
+    double interval = watcher->args->watch_interval;
+    double timeout = watcher->args->watch_timeout;
+    while (files->n == 0 && !interrupted) {
+        // without inotify, or for files not yet closed, completion is judged by size
+        if (watcher->fd < 0 || watcher->rescan || watcher->npending > 0) {
+            watcher->rescan = false;
+            _scan(watcher, files);
+            if (files->n > 0) break;
+        }
+        double deadline = _now() + interval;
+        if (timeout > 0) deadline = min(deadline, watcher->last_found + timeout);
+        while (files->n == 0 && !interrupted) {
+            double wait = deadline - _now();
+            if (wait <= 0) break;
+            int wait_ms = min((int)(1000 * wait) + 1, WATCH_WAKE_MS);
+            if (watcher->fd >= 0) {
+#ifdef __linux__
+                struct pollfd pfd = {watcher->fd, POLLIN, 0};
+                if (poll(&pfd, 1, wait_ms) > 0) _read_events(watcher, files);
+#endif
+            }
+            else {
+                struct timespec ts = {wait_ms / 1000, 1000000L * (wait_ms % 1000)};
+                nanosleep(&ts, NULL);
+            }
+        }
+        if (files->n == 0 && timeout > 0 && _now() - watcher->last_found >= timeout) break;
+    }
+    if (files->n > 0) watcher->last_found = _now();
+    return files->n;
+}
+
+
+void destroy_watcher(watcher watcher) {
+    if (watcher == NULL) return;
+#ifdef __linux__
+    if (watcher->fd >= 0) _stop_inotify(watcher);
+    if (watcher->dirs != NULL) kh_destroy(WATCH_DIRS, watcher->dirs);
+#endif
+    for (khiter_t k = 0; k < kh_end(watcher->seen); ++k) {
+        if (kh_exist(watcher->seen, k)) free((char*)kh_key(watcher->seen, k));
+    }
+    kh_destroy(WATCH_SEEN, watcher->seen);
+    for (size_t i = 0; i < watcher->nroots; ++i) {
+        free(watcher->roots[i]);
+    }
+    free(watcher->roots);
+    free(watcher);
+}
@@ -0,0 +1,43 @@
+#ifndef FASTCAT_WATCH_H
+#define FASTCAT_WATCH_H
+
+#include <stddef.h>
+
+#include "args.h"
+#include "files.h"
+
+
+// Watches the input directories for new input files, with inotify where
+// available and otherwise by polling
+typedef struct _watcher _watcher;
+typedef _watcher* watcher;
+
+/** Start watching the directories given as inputs.
+ *
+ * Directories are watched to the depth given by args->recurse. SIGINT and
+ * SIGTERM stop the watch, rather than the program, until it has finished.
+ *
+ * @param args program arguments.
+ * @param done files already processed, which are not reported again.
+ * @returns a watcher, or NULL if none of the inputs is a directory.
+ *
+ */
+watcher create_watcher(arguments_t* args, file_list* done);
+
+/** Wait for new files to be completed.
+ *
+ * A file is complete once it is closed after writing, or moved into a
+ * watched directory, or when polling once its size is unchanged over
+ * args->watch_interval.
+ *
+ * @param watcher the watcher.
+ * @param files output list of complete files.
+ * @returns the number of files added, or zero once the watch has been
+ *     interrupted or has timed out.
+ *
+ */
+size_t watch_files(watcher watcher, file_list* files);
+
+void destroy_watcher(watcher watcher);
+
+#endif
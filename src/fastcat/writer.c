@@ -1,8 +1,12 @@
+#include <ctype.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <inttypes.h>
 
+#include "htslib/hfile.h"
 #include "htslib/thread_pool.h"
+#include "htslib/hts_endian.h"
 
 #include "writer.h"
 #include "common.h"
@@ -10,9 +14,8 @@
 #include "../fastqcomments.h"
 #include "../version.h"
 
-// default buffer size for writing to gzip, this is large enough that most reads will not require
-// the write buffer to be resized. See _gzsnprintf() below.
-// The size is also used with gzbuffer() when opening gzFile handles.
+// Reads are accumulated in a buffer per output file and written out once this
+// size is reached. The size is also used with gzbuffer() when opening gzFile handles.
 #define GZBUFSIZE 131072  // 128 kB
 
 
@@ -26,24 +29,245 @@ char* strip_path(char* input) {
 }
 
 
-// Safely write a formatted string to a gzFile pointer
-int _gzsnprintf(gzFile file, const char *format, ...) {
-    va_list myargs;
-    va_start(myargs, format);
-    int bufsize = GZBUFSIZE;
-    char* buf = (char*) xalloc(bufsize, sizeof(char), "gzbuffer");
-    int written = vsnprintf(buf, bufsize, format, myargs);
-    va_end(myargs);
-    if (written > bufsize) {
-        bufsize = written;
-        buf = (char *) realloc(buf, bufsize);
-        va_start(myargs, format);
-        written = vsnprintf(buf, bufsize, format, myargs);
-        va_end(myargs);
+// Open BGZF output for a route, compressing with the writer's thread pool
+void _open_bgzf(writer writer, route route, char* filepath, char* mode) {
+    BGZF* fp = bgzf_open(filepath, mode);
+    if (fp == NULL) {
+        fprintf(stderr, "Error opening '%s' for writing.\n", filepath);
+        exit(EXIT_FAILURE);
+    }
+    if (writer->hts_pool.pool != NULL && bgzf_thread_pool(fp, writer->hts_pool.pool, 0) < 0) {
+        fprintf(stderr, "Error attaching thread pool to '%s'.\n", filepath);
+        exit(EXIT_FAILURE);
+    }
+    if (route->gzi_path != NULL) {
+        if (bgzf_index_build_init(fp) < 0) {
+            fprintf(stderr, "Error initialising index for '%s'.\n", filepath);
+            exit(EXIT_FAILURE);
+        }
+    }
+    route->bgzf_file = fp;
+}
+
+
+// Add the index just written for a session of writing to a file to those of
+// previous sessions, offsetting entries to the start of the session.
+void _collect_gzi(route route) {
+    FILE* fp = fopen(route->gzi_path, "rb");
+    uint8_t entry[16];
+    if (fp == NULL || fread(entry, 8, 1, fp) != 1) {
+        fprintf(stderr, "Error reading index '%s'.\n", route->gzi_path);
+        exit(EXIT_FAILURE);
+    }
+    uint64_t n = le_to_u64(entry);
+    for (uint64_t i = 0; i < n; ++i) {
+        if (fread(entry, 16, 1, fp) != 1) {
+            fprintf(stderr, "Error reading index '%s'.\n", route->gzi_path);
+            exit(EXIT_FAILURE);
+        }
+        u64_to_le(le_to_u64(entry) + route->gzi_cbase, entry);
+        u64_to_le(le_to_u64(entry + 8) + route->gzi_ubase, entry + 8);
+        kputsn((char*)entry, 16, &route->gzi);
+    }
+    fclose(fp);
+}
+
+
+void _write_gzi(route route) {
+    FILE* fp = fopen(route->gzi_path, "wb");
+    uint8_t n[8];
+    u64_to_le(route->gzi.l / 16, n);
+    if (fp == NULL
+            || fwrite(n, 8, 1, fp) != 1
+            || fwrite(route->gzi.s, 1, route->gzi.l, fp) != route->gzi.l
+            || fclose(fp) != 0) {
+        fprintf(stderr, "Error writing index '%s'.\n", route->gzi_path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void _close_bgzf(route route, bool complete) {
+    BGZF* fp = route->bgzf_file;
+    if (route->gzi_path != NULL) {
+        if (bgzf_index_dump(fp, route->gzi_path, NULL) < 0) {
+            fprintf(stderr, "Error writing index '%s'.\n", route->gzi_path);
+            exit(EXIT_FAILURE);
+        }
+        if (!complete || route->gzi.l > 0) _collect_gzi(route);
+    }
+    if (bgzf_close(fp) < 0) {
+        fprintf(stderr, "Error closing BGZF output.\n");
+        exit(EXIT_FAILURE);
+    }
+    route->bgzf_file = NULL;
+}
+
+
+// Uncompressed size of a BAM header as written by sam_hdr_write(): the magic,
+// text length, text and number of references, then the name length, name and
+// length of each reference.
+static uint64_t _bam_header_size(sam_hdr_t* hdr) {
+    uint64_t size = 12 + sam_hdr_length(hdr);
+    for (int i = 0; i < sam_hdr_nref(hdr); ++i) {
+        size += 9 + strlen(sam_hdr_tid2name(hdr, i));
+    }
+    return size;
+}
+
+
+// Name the .bci index of a route's BAM output, taking ownership of `bci_path`,
+// and the files alongside it in which the records and blocks of the BAM are
+// noted until it is complete.
+static void _name_bci(route route, char* bci_path) {
+    route->bci_path = bci_path;
+    route->bci_records_path = xalloc(strlen(bci_path) + 5, sizeof(char), "path");
+    sprintf(route->bci_records_path, "%s.tmp", bci_path);
+    route->gzi_path = xalloc(strlen(bci_path) + 9, sizeof(char), "path");
+    sprintf(route->gzi_path, "%s.gzi.tmp", bci_path);
+}
+
+
+// Start noting the records, and blocks, of a session of writing a route's BAM
+// output for its .bci index. Nothing must yet have been written in the session.
+static void _open_bci(route route, bool append) {
+    if (bgzf_index_build_init(hts_get_bgzfp(route->bam_file)) < 0) {
+        fprintf(stderr, "Error initialising index for '%s'.\n", route->bci_path);
+        exit(EXIT_FAILURE);
+    }
+    route->bci_records = fopen(route->bci_records_path, append ? "ab" : "wb");
+    if (route->bci_records == NULL) {
+        fprintf(stderr, "Error opening '%s' for writing.\n", route->bci_records_path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+// Write the .bci index of a complete BAM file, as bamindex build would. The
+// virtual offset of a record is in the last block starting before it, or else
+// is the start of the first block starting at it: a reader moves to the next
+// block once it has read the whole of the previous one, which may be the EOF
+// block that ended a session.
+static void _write_bci(writer writer, route route) {
+    FILE* records = fopen(route->bci_records_path, "rb");
+    FILE* fp = fopen(route->bci_path, "wb");
+    if (records == NULL || fp == NULL) {
+        fprintf(stderr, "Error writing index '%s'.\n", route->bci_path);
+        exit(EXIT_FAILURE);
+    }
+    bc_idx_t* idx = bc_idx_init1(writer->bci_chunk_size);
+    if (bc_idx_write_header(fp, idx) != 0) {
+        fprintf(stderr, "Error writing index '%s'.\n", route->bci_path);
+        exit(EXIT_FAILURE);
+    }
+    const uint8_t* blocks = (const uint8_t*)route->gzi.s;
+    size_t n_blocks = route->gzi.l / 16;
+    size_t next = 0;
+    // the first block, at the start of the file, has no entry
+    uint64_t caddr = 0, uaddr = 0;
+    kstring_t qname = {0, 0, NULL};
+    for (size_t i = 0; i < route->bci_chunks; ++i) {
+        uint64_t offset;
+        uint32_t l_qname;
+        if (fread(&offset, sizeof(offset), 1, records) != 1
+                || fread(&l_qname, sizeof(l_qname), 1, records) != 1
+                || ks_resize(&qname, l_qname) != 0
+                || fread(qname.s, 1, l_qname, records) != l_qname) {
+            fprintf(stderr, "Error reading '%s'.\n", route->bci_records_path);
+            exit(EXIT_FAILURE);
+        }
+        while (next < n_blocks && le_to_u64(blocks + 16 * next + 8) < offset) {
+            caddr = le_to_u64(blocks + 16 * next);
+            uaddr = le_to_u64(blocks + 16 * next + 8);
+            next++;
+        }
+        if (next < n_blocks && le_to_u64(blocks + 16 * next + 8) == offset) {
+            caddr = le_to_u64(blocks + 16 * next);
+            uaddr = offset;
+        }
+        if (bc_idx_write(fp, idx, caddr << 16 | (offset - uaddr), qname.s) < 0) {
+            fprintf(stderr, "Error writing index '%s'.\n", route->bci_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (bc_idx_write_header(fp, idx) != 0 || fclose(fp) != 0) {
+        fprintf(stderr, "Error writing index '%s'.\n", route->bci_path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(records);
+    remove(route->bci_records_path);
+    bc_idx_destroy(idx);
+    free(qname.s);
+}
+
+
+// Close the BAM output of a route, with a .bci index the blocks written in the
+// session are collected
+void _close_bam(route route) {
+    if (route->bci_records != NULL) {
+        if (bgzf_index_dump(hts_get_bgzfp(route->bam_file), route->gzi_path, NULL) < 0) {
+            fprintf(stderr, "Error writing index '%s'.\n", route->gzi_path);
+            exit(EXIT_FAILURE);
+        }
+        _collect_gzi(route);
+        remove(route->gzi_path);
+        if (fclose(route->bci_records) != 0) {
+            fprintf(stderr, "Error writing '%s'.\n", route->bci_records_path);
+            exit(EXIT_FAILURE);
+        }
+        route->bci_records = NULL;
+    }
+    if (hts_close(route->bam_file) < 0) {
+        fprintf(stderr, "Error closing BAM output.\n");
+        exit(EXIT_FAILURE);
     }
-    gzputs(file, buf);
-    free(buf);
-    return written;
+    route->bam_file = NULL;
+}
+
+
+// Add a route to the writer, `name` is NULL for the single output when not demultiplexing
+route add_route(writer writer, const char* name) {
+    route route = xalloc(1, sizeof(_route), "route");
+    if (name != NULL) {
+        route->name = strdup(name);
+        int ret;
+        khiter_t k = kh_put(ROUTE_INDEX, writer->route_index, route->name, &ret);
+        kh_val(writer->route_index, k) = route;
+    }
+    route->l_stats = create_length_stats();
+    route->q_stats = create_qual_stats(QUAL_HIST_WIDTH);
+    if (name != NULL && writer->stats_only) {
+        // no reads are written, so the directory is made here for the histograms
+        char* path = xalloc(strlen(writer->output) + strlen(name) + 2, sizeof(char), "path");
+        sprintf(path, "%s/%s", writer->output, name);
+        if (mkdir_p(path) != 0) {
+            fprintf(stderr, "Failed to create barcode directory '%s'.\n", path);
+            exit(1);
+        }
+        free(path);
+    }
+    if (writer->n_routes == writer->m_routes) {
+        size_t m = writer->m_routes == 0 ? 16 : 2 * writer->m_routes;
+        writer->routes = xrecalloc(writer->routes, writer->m_routes, m, sizeof(route), "routes");
+        writer->m_routes = m;
+    }
+    writer->routes[writer->n_routes++] = route;
+    return route;
+}
+
+
+static void _write_perread_header(writer writer) {
+    tsv_writer tsv = writer->perread_tsv;
+    tsv_str(tsv, "read_id");
+    tsv_str(tsv, "filename");
+    tsv_str(tsv, "runid");
+    if (writer->sample != NULL) tsv_str(tsv, "sample_name");
+    tsv_str(tsv, "read_length");
+    tsv_str(tsv, "mean_quality");
+    tsv_str(tsv, "channel");
+    tsv_str(tsv, "read_number");
+    tsv_str(tsv, "start_time");
+    tsv_end_row(tsv);
 }
 
 
@@ -51,10 +275,12 @@ writer initialize_writer(
         char* output_dir, char* histograms, char* perread, char* perfile,
         char* runids, char* basecallers, char* sample,
         size_t reheader, size_t write_bam, size_t reads_per_file,
-        int threads) {
+        int threads, int write_bgzf, int write_gzi, char* gzi_file,
+        int write_bci, char* bci_file, size_t bci_chunk_size,
+        char* demux_key, size_t max_open, bool append, bool stats_only, bool read_columns, bool read_bgzf) {
     if (output_dir != NULL) {  // demultiplexing
         int rtn = mkdir_hier(output_dir);
-        if (rtn == -1) {
+        if (rtn == -1 && !(append && errno == EEXIST)) {
             fprintf(stderr,
                "Error: Cannot create output directory '%s'. Check location is writeable and directory does not exist.\n",
                output_dir);
@@ -64,7 +290,7 @@ writer initialize_writer(
      else {
          // histograms go in their own directory when not demultiplexing
          int rtn = mkdir_hier(histograms);
-         if (rtn == -1) {
+         if (rtn == -1 && !(append && errno == EEXIST)) {
             fprintf(stderr,
                 "Error: Cannot create output directory '%s'. Check location is writeable and directory does not exist.\n",
                 histograms);
@@ -76,146 +302,196 @@ writer initialize_writer(
      writer->output = strip_path(output_dir);
      writer->histograms = strip_path(histograms);
 
-     writer->nreads = calloc(MAX_BARCODES, sizeof(size_t));
-     writer->l_stats = calloc(MAX_BARCODES, sizeof(read_stats*));
-     writer->q_stats = calloc(MAX_BARCODES, sizeof(read_stats*));
-     // we want a stats accumulator (when not demultiplexing)
-     // This also ensures we write out an empty histogram file when
-     // no reads are processed. (To go with our other empty summary files)
+     if (!strcmp(demux_key, "barcode_alias")) writer->demux_key = DEMUX_BARCODE_ALIAS;
+     else if (!strcmp(demux_key, "runid")) writer->demux_key = DEMUX_RUNID;
+     else if (!strcmp(demux_key, "read_group")) writer->demux_key = DEMUX_READ_GROUP;
+     else if (!strcmp(demux_key, "flow_cell_id")) writer->demux_key = DEMUX_FLOW_CELL_ID;
+     else writer->demux_key = DEMUX_BARCODE;
+     writer->route_index = kh_init(ROUTE_INDEX);
+     writer->max_open = max_open;
+     // when not demultiplexing all reads take a single route. This also ensures
+     // we write out an empty histogram file when no reads are processed. (To go
+     // with our other empty summary files)
      if (writer->output == NULL) {
-         writer->l_stats[0] = create_length_stats();
-         writer->q_stats[0] = create_qual_stats(QUAL_HIST_WIDTH);
+         add_route(writer, NULL);
      }
      writer->reheader = reheader;
      writer->write_bam = write_bam;
+     writer->write_bci = write_bci;
+     writer->bci_chunk_size = bci_chunk_size;
      writer->reads_per_file = reads_per_file;
-     writer->reads_written = calloc(MAX_BARCODES, sizeof(size_t));
-     writer->file_index = calloc(MAX_BARCODES, sizeof(size_t));
+     writer->stats_only = stats_only;
      writer->failures = calloc(NUM_FAILURE_CODES, sizeof(uint64_t));
+     pthread_mutex_init(&writer->lock, NULL);
      if (strcmp(sample, "")) {
          // sample is used just for printing to summary, pre-add a tab
          writer->sample = calloc(strlen(sample) + 2, sizeof(char)); 
          strcpy(writer->sample, sample);
          strcat(writer->sample, "\t");
+         writer->sample_name = strdup(sample);
      }
-     if (perread != NULL) {
-        writer->perread = fopen(perread, "w");
+     if (perread != NULL && !read_bgzf) {
+        writer->perread = fopen(perread, append ? "a" : "w");
         if (writer->perread == NULL) {
             fprintf(stderr, "Error opening per-read file '%s' for writing.\n", perread);
             exit(EXIT_FAILURE);
         }
-        fprintf(writer->perread, "read_id\tfilename\trunid\t");
-        if (writer->sample != NULL) fprintf(writer->perread, "sample_name\t");
-        fprintf(writer->perread, "read_length\tmean_quality\tchannel\tread_number\tstart_time\n");
+        if (read_columns) {
+            column_def columns[] = {
+                {"read_id", COLUMN_STR}, {"filename", COLUMN_DICT}, {"runid", COLUMN_DICT},
+                {"sample_name", COLUMN_DICT}, {"read_length", COLUMN_U32}, {"mean_quality", COLUMN_F32},
+                {"channel", COLUMN_U32}, {"read_number", COLUMN_U32}, {"start_time", COLUMN_STR}};
+            // sample_name is the fourth column, when present
+            if (writer->sample == NULL) {
+                memmove(&columns[3], &columns[4], 5 * sizeof(column_def));
+            }
+            writer->perread_columns = open_column_writer(
+                writer->perread, columns, writer->sample == NULL ? 8 : 9);
+        }
+        else {
+            writer->perread_tsv = open_tsv_writer(writer->perread, NULL);
+            if (!append) _write_perread_header(writer);
+        }
      }
      if (perfile != NULL) {
-         writer->perfile = fopen(perfile, "w");
+         writer->perfile = fopen(perfile, append ? "a" : "w");
          if (writer->perfile == NULL) {
              fprintf(stderr, "Error opening per-file file '%s' for writing.\n", perfile);
              exit(EXIT_FAILURE);
          }
-         fprintf(writer->perfile, "filename\t");
-         if (writer->sample != NULL) fprintf(writer->perfile, "sample_name\t");
-         fprintf(writer->perfile, "n_seqs\tn_bases\tmin_length\tmax_length\tmean_quality");
-         for (size_t i = 0; i < NUM_FAILURE_CODES; ++i) {
-             // conver to lowercase for consistency
-             const char* src = failure_type[i];
-             size_t len = strlen(src);
-             char* buffer = calloc(len + 1, sizeof(char));
-             for (size_t j = 0; j < len; ++j) {
-                 buffer[j] = tolower(src[j]);
+         if (!append) {
+             fprintf(writer->perfile, "filename\t");
+             if (writer->sample != NULL) fprintf(writer->perfile, "sample_name\t");
+             fprintf(writer->perfile, "n_seqs\tn_bases\tmin_length\tmax_length\tmean_quality");
+             for (size_t i = 0; i < NUM_FAILURE_CODES; ++i) {
+                 // conver to lowercase for consistency
+                 const char* src = failure_type[i];
+                 size_t len = strlen(src);
+                 char* buffer = calloc(len + 1, sizeof(char));
+                 for (size_t j = 0; j < len; ++j) {
+                     buffer[j] = tolower(src[j]);
+                 }
+                 fprintf(writer->perfile, "\t%s", buffer);
+                 free(buffer);
              }
-             fprintf(writer->perfile, "\t%s", buffer);
-             free(buffer);
+             fprintf(writer->perfile, "\n");
          }
-         fprintf(writer->perfile, "\n");
      }
      if (runids != NULL) {
-         writer->runids = fopen(runids, "w");
+         writer->runids = fopen(runids, append ? "a" : "w");
          if (writer->runids == NULL) {
              fprintf(stderr, "Error opening runids file '%s' for writing.\n", runids);
              exit(EXIT_FAILURE);
          }
-         fprintf(writer->runids, "filename\t");
-         if (writer->sample != NULL) fprintf(writer->runids, "sample_name\t");
-         fprintf(writer->runids, "run_id\tcount\n");
+         if (!append) {
+             fprintf(writer->runids, "filename\t");
+             if (writer->sample != NULL) fprintf(writer->runids, "sample_name\t");
+             fprintf(writer->runids, "run_id\tcount\n");
+         }
      }
      if (basecallers != NULL) {
-         writer->basecallers = fopen(basecallers, "w");
+         writer->basecallers = fopen(basecallers, append ? "a" : "w");
          if (writer->basecallers == NULL) {
              fprintf(stderr, "Error opening basecallers file '%s' for writing.\n", basecallers);
              exit(EXIT_FAILURE);
          }
-         fprintf(writer->basecallers, "filename\t");
-         if (writer->sample != NULL) fprintf(writer->basecallers, "sample_name\t");
-         fprintf(writer->basecallers, "basecaller\tcount\n");
+         if (!append) {
+             fprintf(writer->basecallers, "filename\t");
+             if (writer->sample != NULL) fprintf(writer->basecallers, "sample_name\t");
+             fprintf(writer->basecallers, "basecaller\tcount\n");
+         }
      }
 
-     // we alloc all the file pointers here, but we might not use them, just to keep the code simple
-     // whats MAX_BARCODES * a few bytes between friends?
+     // the pool is shared between read processing and BAM compression
+     if (write_bam || threads > 1) {
+         writer->hts_pool.pool = hts_tpool_init(threads);
+         writer->hts_pool.qsize = 0;
+         if (writer->hts_pool.pool == NULL) {
+             fprintf(stderr, "Error creating thread pool\n");
+             exit(1);
+         }
+     }
+     if (perread != NULL && read_bgzf) {
+         writer->perread_bgzf = bgzf_open(perread, "w");
+         if (writer->perread_bgzf == NULL) {
+             fprintf(stderr, "Error opening per-read file '%s' for writing.\n", perread);
+             exit(EXIT_FAILURE);
+         }
+         if (writer->hts_pool.pool != NULL && bgzf_thread_pool(writer->perread_bgzf, writer->hts_pool.pool, 0) < 0) {
+             fprintf(stderr, "Error attaching thread pool to '%s'.\n", perread);
+             exit(EXIT_FAILURE);
+         }
+         writer->perread_tsv = open_tsv_writer(NULL, writer->perread_bgzf);
+         _write_perread_header(writer);
+     }
      if (write_bam) {
              fprintf(stderr, "Using %d threads for BAM writing\n", threads);
-             writer->hts_pool.pool = hts_tpool_init(threads);
-             writer->hts_pool.qsize = 0;
-             if (writer->hts_pool.pool == NULL) {
-                 fprintf(stderr, "Error creating thread pool\n");
-                 exit(1);
-             }
              // later...call hts_set_opt on each fp opened
 
+         writer->bam_record = bam_init1();
          writer->bam_hdr = sam_hdr_init();
          sam_hdr_add_line(writer->bam_hdr, "HD", "VN", SAM_FORMAT_VERSION, "SO", "unsorted", NULL);
          sam_hdr_add_line(writer->bam_hdr, "PG", "ID", "fastcat", "PN", "fastcat", "VN", argp_program_version, NULL);
-         writer->bam_files = calloc(MAX_BARCODES, sizeof(htsFile*));
          if (writer->output == NULL) { // to stdout
-             writer->bam_files[0] = hts_open("-", "wb");
-             hts_set_opt(writer->bam_files[0], HTS_OPT_THREAD_POOL, &writer->hts_pool);
-             if (sam_hdr_write(writer->bam_files[0], writer->bam_hdr)) {
+             route route = writer->routes[0];
+             route->bam_file = hts_open("-", "wb");
+             hts_set_opt(route->bam_file, HTS_OPT_THREAD_POOL, &writer->hts_pool);
+             if (write_bci) {
+                 _name_bci(route, strdup(bci_file));
+                 _open_bci(route, false);
+             }
+             if (!append && sam_hdr_write(route->bam_file, writer->bam_hdr)) {
                  fprintf(stderr, "Error writing header to BAM on stdout\n");
                  exit(1);
              }
+             route->bytes_written = _bam_header_size(writer->bam_hdr);
          }
      }
-     else { // fastq output
-        writer->handles = calloc(MAX_BARCODES, sizeof(gzFile));
+     else if (write_bgzf) {
+        writer->write_bgzf = write_bgzf;
+        writer->write_gzi = write_gzi;
+        if (writer->output == NULL) { // to stdout
+            route route = writer->routes[0];
+            if (write_gzi) route->gzi_path = strdup(gzi_file);
+            _open_bgzf(writer, route, "-", "w");
+        }
      }
 
      return writer;
 }
 
 
-void _write_stats(char* hist_dir, char* plex_dir, size_t barcode, read_stats* stats, char* type);
+void _write_stats(char* hist_dir, char* plex_dir, char* name, read_stats* stats, char* type);
+void _close_route(writer writer, route route, bool complete);
 
 
 void destroy_writer(writer writer) {
-    for(size_t i=0; i < MAX_BARCODES; ++i) {
-        if (writer->write_bam) {
-            if (writer->bam_files[i] != NULL) {
-                hts_close(writer->bam_files[i]);
-            }
-        }
-        else {
-            if (writer->handles[i] != NULL) {
-                gzflush(writer->handles[i], Z_FINISH);
-                gzclose(writer->handles[i]);
-            }
-        }
+    for (size_t i = 0; i < writer->n_routes; ++i) {
+        route route = writer->routes[i];
+        _close_route(writer, route, true);  // may be stdout
 
-        if(writer->l_stats[i] != NULL) {
-            _write_stats(writer->histograms, writer->output, i, writer->l_stats[i], "length");
-            destroy_length_stats(writer->l_stats[i]);
-        }
-
-        if(writer->q_stats[i] != NULL) {
-            _write_stats(writer->histograms, writer->output, i, writer->q_stats[i], "quality");
-            destroy_qual_stats(writer->q_stats[i]);
-        }
+        _write_stats(writer->histograms, writer->output, route->name, route->l_stats, "length");
+        destroy_length_stats(route->l_stats);
+        _write_stats(writer->histograms, writer->output, route->name, route->q_stats, "quality");
+        destroy_qual_stats(route->q_stats);
+        free(route->name);
+        free(route);
+    }
+    free(writer->routes);
+    kh_destroy(ROUTE_INDEX, writer->route_index);
+    free(writer->route_name.s);
+    close_tsv_writer(writer->perread_tsv);
+    if (writer->perread_bgzf != NULL && bgzf_close(writer->perread_bgzf) != 0) {
+        fprintf(stderr, "Error writing per-read summary.\n");
+        exit(EXIT_FAILURE);
     }
-    if (writer->write_bam) { // must be after file closing
+    if (writer->hts_pool.pool != NULL) { // must be after file closing
         hts_tpool_destroy(writer->hts_pool.pool);
     }
 
     if (writer->sample != NULL) free(writer->sample);
+    if (writer->sample_name != NULL) free(writer->sample_name);
+    close_column_writer(writer->perread_columns);
     if (writer->perread != NULL) fclose(writer->perread);
     if (writer->perfile != NULL) fclose(writer->perfile);
     if (writer->runids != NULL) fclose(writer->runids);
@@ -223,149 +499,189 @@ void destroy_writer(writer writer) {
     if (writer->output != NULL) free(writer->output);
     if (writer->histograms != NULL) free(writer->histograms);
     if (writer->write_bam) {
-        free(writer->bam_files);
+        bam_destroy1(writer->bam_record);
         bam_hdr_destroy(writer->bam_hdr);
     }
-    else {
-        free(writer->handles);
-    }
-    free(writer->nreads);
-    free(writer->l_stats);
-    free(writer->q_stats);
-    free(writer->reads_written);
-    free(writer->file_index);
     free(writer->failures);
+    pthread_mutex_destroy(&writer->lock);
     free(writer);
 }
 
 
-void _write_read(writer writer, kseq_t* seq, read_meta meta, void* handle) {
-    
-    int (*write)(void*, const char*, ...);
-    if (handle == stdout) { write = &fprintf; } else { write = &_gzsnprintf; }
+// Write out the buffered reads for an output file
+void _flush_output(writer writer, route route) {
+    kstring_t* buffer = &route->buffer;
+    if (buffer->l == 0) return;
+    bool failed;
+    if (writer->write_bgzf) {
+        failed = bgzf_write(route->bgzf_file, buffer->s, buffer->l) < 0;
+        route->bytes_written += buffer->l;
+    }
+    else if (writer->output == NULL) {
+        failed = fwrite(buffer->s, 1, buffer->l, stdout) != buffer->l;
+    }
+    else {
+        failed = gzwrite(route->handle, buffer->s, buffer->l) != (int)buffer->l;
+    }
+    if (failed) {
+        fprintf(stderr, "Error writing reads to output.\n");
+        exit(1);
+    }
+    buffer->l = 0;
+}
 
-    static const char* fq_comment_fmt = "@%s %s\n%s\n+\n%s\n";
-    static const char* sam_comment_fmt = "@%s\t%s\n%s\n+\n%s\n";
-    static const char* no_comment_fmt = "@%s\n%s\n+\n%s\n";
 
-    if (seq->comment.l > 0) {
-        if (writer->reheader) {
-            (*write)(handle, sam_comment_fmt, seq->name.s, meta->tags_str->s, seq->seq.s, seq->qual.s);
+// Write out everything written so far. Demultiplexed files are closed, to be
+// reopened for appending as with --max_open_files, so that they are valid as
+// they stand. Output to stdout and the summaries are flushed.
+void sync_writer(writer writer) {
+    while (writer->lru_head != NULL) {
+        _close_route(writer, writer->lru_head, false);
+    }
+    if (writer->output == NULL) {
+        route route = writer->routes[0];
+        BGZF* bgzf = NULL;
+        if (writer->write_bam) {
+            bgzf = hts_get_bgzfp(route->bam_file);
+        }
+        else {
+            _flush_output(writer, route);
+            if (writer->write_bgzf) bgzf = route->bgzf_file;
+        }
+        if (bgzf != NULL) {
+            if (bgzf_flush(bgzf) != 0 || hflush(bgzf->fp) != 0) {
+                fprintf(stderr, "Error writing reads to output.\n");
+                exit(1);
+            }
         }
         else {
-            (*write)(handle, fq_comment_fmt, seq->name.s, seq->comment.s, seq->seq.s, seq->qual.s);
+            fflush(stdout);
         }
     }
-    else {
-        (*write)(handle, no_comment_fmt, seq->name.s, seq->seq.s, seq->qual.s);
+    if (writer->perread_columns != NULL) flush_column_writer(writer->perread_columns);
+    if (writer->perread_tsv != NULL) flush_tsv_writer(writer->perread_tsv);
+    if (writer->perfile != NULL) fflush(writer->perfile);
+    if (writer->runids != NULL) fflush(writer->runids);
+    if (writer->basecallers != NULL) fflush(writer->basecallers);
+}
+
+
+// Bring the outputs up to date whilst waiting for further input
+void refresh_writer(writer writer) {
+    sync_writer(writer);
+    for (size_t i = 0; i < writer->n_routes; ++i) {
+        route route = writer->routes[i];
+        _write_stats(writer->histograms, writer->output, route->name, route->l_stats, "length");
+        _write_stats(writer->histograms, writer->output, route->name, route->q_stats, "quality");
     }
 }
 
 
-// htslib has aux_parse but its static :(
-int parse_and_set_aux_tags(bam1_t *b, const char *aux_str) {
-    if (!b || !aux_str) {
-        fprintf(stderr, "Invalid input to parse_and_set_aux_tags\n");
-        return -1;
+// Add a read to the output buffer for a file, `text` is the read as formatted
+// by format_read() if this has already been done. Reads larger than the
+// buffer size simply grow the buffer before it is written out.
+void _write_read(writer writer, kseq_t* seq, read_meta meta, route route, const char* text, size_t len) {
+    kstring_t* buffer = &route->buffer;
+    if (text != NULL) {
+        kputsn(text, len, buffer);
+    }
+    else {
+        format_read(writer, seq, meta, buffer);
+    }
+    if (buffer->l >= GZBUFSIZE) {
+        _flush_output(writer, route);
     }
+}
 
-    const char *ptr = aux_str;
-    while (*ptr) {
-        char tag[3] = {0};
-        char type;
-        int consumed = 0;
 
-        // Read the tag and type
-        if (sscanf(ptr, "%2s:%c%n", tag, &type, &consumed) != 2) {
-            fprintf(stderr, "Invalid aux format: %s\n", ptr);
-            return -1;
-        }
-        ptr += consumed+1;
+// Whether a BAM input record can be written as it is, rather than rebuilt
+// from the decoded read: it must be unaligned and in original orientation.
+static bool _is_plain_unaligned(const bam1_t* b) {
+    return b->core.tid < 0 && b->core.n_cigar == 0
+        && (b->core.flag & (BAM_FUNMAP | BAM_FREVERSE)) == BAM_FUNMAP;
+}
 
-        size_t len = 0;
-        int int_value;
-        float float_value;
-        if (type == 'i' || type == 'I' || type == 'c' || type == 'C' || type == 's' || type == 'S') {
-            char *endptr;
-            int_value = strtol(ptr, &endptr, 10);
-            if (endptr == ptr) {
-                fprintf(stderr, "Failed to parse integer for tag %s\n", tag);
-                return -1;
-            }
-            bam_aux_update_int(b, tag, int_value);
-            ptr = endptr;
-        }
-        else if (type == 'f') {
-            char *endptr;
-            float_value = strtof(ptr, &endptr);
-            if (endptr == ptr) {
-                fprintf(stderr, "Failed to parse float for tag %s\n", tag);
-                return -1;
-            }
-            bam_aux_update_float(b, tag, float_value);
-            ptr = endptr;
+
+// Write a record to the BAM output of a route, noting the first record of
+// each chunk of a .bci index with its uncompressed offset in the file
+static void _write_bam_record(writer writer, route route, bam1_t* b) {
+    if (route->bci_records != NULL && route->bam_records % writer->bci_chunk_size == 0) {
+        uint64_t offset = route->bytes_written;
+        const char* qname = bam_get_qname(b);
+        uint32_t l_qname = strlen(qname) + 1;
+        if (fwrite(&offset, sizeof(offset), 1, route->bci_records) != 1
+                || fwrite(&l_qname, sizeof(l_qname), 1, route->bci_records) != 1
+                || fwrite(qname, 1, l_qname, route->bci_records) != l_qname) {
+            fprintf(stderr, "Error writing '%s'.\n", route->bci_records_path);
+            exit(EXIT_FAILURE);
         }
-        else if (type == 'Z' || type == 'H') {
-            len = strcspn(ptr, "\t\n");
-            bam_aux_update_str(b, tag, len, ptr);
-            ptr += len;
+        route->bci_chunks++;
+    }
+    if (sam_write1(route->bam_file, writer->bam_hdr, b) < 0) {
+        fprintf(stderr, "Error writing read to BAM file.\n");
+        exit(1);
+    }
+    // the block size, fixed length fields and data, as bam_write1() writes
+    // them without the extra NULs padding the name
+    route->bytes_written += 4 + 32 + b->l_data - b->core.l_extranul;
+    route->bam_records++;
+}
+
+
+// `record` is the input BAM record of the read, or NULL for FASTQ input
+void _write_read_bam(writer writer, kseq_t* seq, read_meta meta, bam1_t* record, route route) {
+        // see fastqcomments.c for the definition of read_meta, there we
+        // encoded the header comment as SAM tags, with garbage being dumped
+        // into a CO:Z tag, directly into a BAM aux block
+        if (meta->aux_error) {
+            fprintf(stderr, "Error parsing auxiliary tags\n");
+            fprintf(stderr, "read: %.*s\n", (int)seq->name.l, seq->name.s);
+            fprintf(stderr, "tags: %s\n", ks_str(meta->tags_str));
+            fprintf(stderr, "rest: %s\n", ks_str(meta->rest));
+            exit(1);
         }
-        else {
-            fprintf(stderr, "Unsupported tag type: %c\n", type);
-            return -1;
-        }
-
-        while (*ptr == '\t' || *ptr == ' ') {
-            ptr++;
-        }
-    }
-    
-    return 0;
-}
-
-
-void _write_read_bam(writer writer, kseq_t* seq, read_meta meta, void* handle) {
-        bam1_t* b = bam_init1();
-        bam_set1(
-            b,
-            seq->name.l, seq->name.s,
-            4, -1, -1, 0,
-            0, NULL,
-            -1, -1, 0,
-            seq->seq.l, seq->seq.s, seq->qual.s,
-            0
-        );
-        // the implementation of bam_set1() seems not to take into account the 33 offset
-        // you'd typically have in a string encoding
-        uint8_t* qual = b->data + b->core.l_qname + (b->core.l_qseq + 1) / 2;
-        for (int i = 0; i < b->core.l_qseq; ++i) {
-            qual[i] -= 33;
-        }
-
-        // see fastqcomments.c for the definition of read_meta
-        // there we parcelled everything up nicely into a sam formatted string
-        // with garbage being dumped into CO:Z tag
-        // setting the known tags directly is futile as they would be overwritten
-        // by this function in any case
-        if (meta->tags_str->l > 0) {
-            if (parse_and_set_aux_tags(b, meta->tags_str->s) < 0) {
-                fprintf(stderr, "Error parsing auxiliary tags\n");
-                fprintf(stderr, "read: %s\n", seq->name.s);
-                fprintf(stderr, "tags: %s\n", meta->tags_str->s);
-                fprintf(stderr, "rest: %s\n", meta->rest->s);
+
+        bam1_t* b;
+        if (record != NULL && _is_plain_unaligned(record)) {
+            // keep the input encoding of the read, only the tags are replaced
+            b = record;
+            b->l_data = bam_get_aux(b) - b->data;
+            if (sam_realloc_bam_data(b, b->l_data + meta->aux->l) < 0) {
+                fprintf(stderr, "Error creating BAM record for read: %.*s\n", (int)seq->name.l, seq->name.s);
                 exit(1);
             }
+            memcpy(b->data + b->l_data, meta->aux->s, meta->aux->l);
+            b->l_data += meta->aux->l;
+            _write_bam_record(writer, route, b);
+            return;
         }
 
-        if (sam_write1(handle, writer->bam_hdr, b) < 0) {
-            fprintf(stderr, "Error writing read to BAM file.\n");
+        // the record is reused, bam_set1() only reallocates if it needs to grow
+        b = writer->bam_record;
+        if (bam_set1(
+                b,
+                seq->name.l, seq->name.s,
+                4, -1, -1, 0,
+                0, NULL,
+                -1, -1, 0,
+                seq->seq.l, seq->seq.s, NULL,
+                meta->aux->l) < 0) {
+            fprintf(stderr, "Error creating BAM record for read: %.*s\n", (int)seq->name.l, seq->name.s);
             exit(1);
         }
-        bam_destroy1(b);
+        // bam_set1() would not take into account the 33 offset you'd typically
+        // have in a string encoding, so we copy the qualities ourselves
+        uint8_t* qual = bam_get_qual(b);
+        for (size_t i = 0; i < seq->qual.l; ++i) {
+            qual[i] = seq->qual.s[i] - 33;
+        }
+        memcpy(b->data + b->l_data, meta->aux->s, meta->aux->l);
+        b->l_data += meta->aux->l;
+        _write_bam_record(writer, route, b);
 }
 
 
-void _write_stats(char* hist_dir, char* plex_dir, size_t barcode, read_stats* stats, char* type) {
+void _write_stats(char* hist_dir, char* plex_dir, char* name, read_stats* stats, char* type) {
     // write out length stats
     // we assume here the directories have been created already
     char* filepath;
@@ -377,62 +693,49 @@ void _write_stats(char* hist_dir, char* plex_dir, size_t barcode, read_stats* st
     }
     else {
         // demultiplexing
-        char* path;
-        if (barcode == 0) {
-            // unclassified/missing
-            path = calloc(strlen(plex_dir) + 15, sizeof(char));
-            sprintf(path, "%s/unclassified/", plex_dir);
-            filepath = calloc(strlen(path) + strlen(type) + strlen(suff) + 15, sizeof(char));
-            sprintf(filepath, "%sunclassified.%s.%s", path, type, suff);
-        }
-        else {
-            path = calloc(strlen(plex_dir) + 14, sizeof(char));
-            sprintf(path, "%s/barcode%04lu/", plex_dir, barcode);
-            filepath = calloc(strlen(path) + strlen(type) + strlen(suff) + 14, sizeof(char));
-            sprintf(filepath, "%sbarcode%04lu.%s.%s", path, barcode, type, suff);
-        }
-        free(path);
+        filepath = calloc(strlen(plex_dir) + 2 * strlen(name) + strlen(type) + strlen(suff) + 5, sizeof(char));
+        sprintf(filepath, "%s/%s/%s.%s.%s", plex_dir, name, name, type, suff);
     }
-    FILE* fp = fopen(filepath, "w");
+    // written alongside and renamed, so that readers never see a partial
+    // file when histograms are refreshed with --watch
+    char* tmppath = calloc(strlen(filepath) + 5, sizeof(char));
+    sprintf(tmppath, "%s.tmp", filepath);
+    FILE* fp = fopen(tmppath, "w");
     if (fp == NULL) {
-        fprintf(stderr, "Error: Could not open file %s for writing\n", filepath);
+        fprintf(stderr, "Error: Could not open file %s for writing\n", tmppath);
         exit(1);
     }
     print_stats(stats, false, true, fp);
-    fclose(fp);
+    if (fclose(fp) != 0 || rename(tmppath, filepath) != 0) {
+        fprintf(stderr, "Error: Could not write file %s\n", filepath);
+        exit(1);
+    }
+    free(tmppath);
     free(filepath);
 }
 
 
-void create_filepath(writer writer, size_t barcode, char** path, char** filepath) {
+void create_filepath(writer writer, route route, char** path, char** filepath) {
     // additional file index string if needed
     // we'll allocate just an empty string
-    int ex_size = (writer->reads_per_file == 0) ? 0 : 5;
+    int ex_size = (writer->reads_per_file == 0) ? 0 : 21;
     char* extra = calloc(ex_size + 1, sizeof(char));
     if (writer->reads_per_file != 0) {
-        sprintf(extra, "_%04zu", writer->file_index[barcode]);
+        sprintf(extra, "_%04zu", route->file_index);
     }
 
-    if (barcode == 0) { // unclassified/missing
-        *path = (char*)calloc(strlen(writer->output) + 15, sizeof(char));
-        sprintf(*path, "%s/unclassified/", writer->output);
-        *filepath = (char*)calloc(strlen(*path) + 22 + ex_size, sizeof(char));
-        sprintf(*filepath, "%sunclassified%s.%s", *path, extra, writer->write_bam ? "bam" : "fastq.gz");
-    }
-    else { // barcoded data
-        *path = (char*)calloc(strlen(writer->output) + 14, sizeof(char));
-        sprintf(*path, "%s/barcode%04lu/", writer->output, barcode);
-        *filepath = (char*)calloc(strlen(*path) + 21 + ex_size, sizeof(char));
-        sprintf(*filepath, "%sbarcode%04lu%s.%s", *path, barcode, extra, writer->write_bam ? "bam" : "fastq.gz");
-    }
+    *path = (char*)calloc(strlen(writer->output) + strlen(route->name) + 3, sizeof(char));
+    sprintf(*path, "%s/%s/", writer->output, route->name);
+    *filepath = (char*)calloc(strlen(*path) + strlen(route->name) + ex_size + 10, sizeof(char));
+    sprintf(*filepath, "%s%s%s.%s", *path, route->name, extra, writer->write_bam ? "bam" : "fastq.gz");
     free(extra);
 }
 
 
-void ensure_directory(writer writer, size_t barcode, char* path) {
+void ensure_directory(writer writer, route route, char* path) {
     // if single file, or first file and no reads yet, make the directory
     if (writer->reads_per_file == 0 
-            || (writer->file_index[barcode] == 0 && writer->reads_written[barcode] == 0)) {
+            || (route->file_index == 0 && route->reads_written == 0)) {
         int rtn = mkdir_hier(path);
         if (rtn == -1) {
             fprintf(stderr, "Failed to create barcode directory '%s\n'.", path);
@@ -442,96 +745,437 @@ void ensure_directory(writer writer, size_t barcode, char* path) {
 }
 
 
-void write_read(writer writer, kseq_t* seq, read_meta meta, float mean_q, char* fname) {
-    size_t barcode = meta->ibarcode;
-    if (barcode > MAX_BARCODES - 1) {
-        fprintf(stderr,
-            "ERROR: Read's barcode number (%lu) is greater than MAX_BARCODES (%i)\n",
-            barcode, MAX_BARCODES);
-        exit(1);
+void _lru_remove(writer writer, route route) {
+    if (route->prev != NULL) route->prev->next = route->next;
+    else if (writer->lru_head == route) writer->lru_head = route->next;
+    else return;  // not in the list
+    if (route->next != NULL) route->next->prev = route->prev;
+    else writer->lru_tail = route->prev;
+    route->prev = route->next = NULL;
+    writer->n_open--;
+}
+
+
+void _lru_push(writer writer, route route) {
+    route->next = writer->lru_head;
+    if (writer->lru_head != NULL) writer->lru_head->prev = route;
+    writer->lru_head = route;
+    if (writer->lru_tail == NULL) writer->lru_tail = route;
+    writer->n_open++;
+}
+
+
+// Open the output file of a route when demultiplexing. To limit the number of
+// open files the least recently used output may be closed, its file will be
+// reopened for appending when next written to. Concatenated gzip members, and
+// BGZF blocks, form a valid file.
+void _open_route(writer writer, route route) {
+    if (writer->max_open != 0 && writer->n_open >= writer->max_open) {
+        _close_route(writer, writer->lru_tail, false);
+    }
+    bool append = route->filepath != NULL;
+    if (!append) {
+        char* path = NULL;
+        create_filepath(writer, route, &path, &route->filepath);
+        ensure_directory(writer, route, path);
+        free(path);
+        if (writer->write_gzi) {
+            route->gzi_path = calloc(strlen(route->filepath) + 5, sizeof(char));
+            sprintf(route->gzi_path, "%s.gzi", route->filepath);
+        }
+        if (writer->write_bci) {
+            _name_bci(route, generate_index_filename(route->filepath, NULL));
+        }
+    }
+    if (append && route->gzi_path != NULL) {
+        struct stat st;
+        if (stat(route->filepath, &st) != 0) {
+            fprintf(stderr, "Error reading size of '%s'.\n", route->filepath);
+            exit(1);
+        }
+        route->gzi_cbase = st.st_size;
+        route->gzi_ubase = route->bytes_written;
+        // the entry for the end of the previous session points at its EOF
+        // block, replace it with one for the start of this session. A .bci
+        // index needs both, a reader is at the EOF block having read the
+        // last record of a session.
+        if (route->bci_path == NULL && route->gzi.l >= 16
+                && le_to_u64((uint8_t*)route->gzi.s + route->gzi.l - 8) >= route->bytes_written) {
+            route->gzi.l -= 16;
+        }
+        uint8_t entry[16];
+        u64_to_le(route->gzi_cbase, entry);
+        u64_to_le(route->gzi_ubase, entry + 8);
+        kputsn((char*)entry, 16, &route->gzi);
+    }
+
+    if (writer->write_bam) {
+        route->bam_file = hts_open(route->filepath, append ? "ab" : "wb");
+        if (route->bam_file == NULL) {
+            fprintf(stderr, "Error opening '%s' for writing.\n", route->filepath);
+            exit(1);
+        }
+        hts_set_opt(route->bam_file, HTS_OPT_THREAD_POOL, &writer->hts_pool);
+        if (route->bci_path != NULL) _open_bci(route, append);
+        if (!append) {
+            if (sam_hdr_write(route->bam_file, writer->bam_hdr)) {
+                fprintf(stderr, "Error writing header to BAM file\n");
+                exit(1);
+            }
+            route->bytes_written = _bam_header_size(writer->bam_hdr);
+        }
+    }
+    else if (writer->write_bgzf) {
+        _open_bgzf(writer, route, route->filepath, append ? "a" : "w");
+    }
+    else {
+        route->handle = gzopen(route->filepath, append ? "ab" : "wb");
+        if (route->handle == NULL) {
+            fprintf(stderr, "Error opening '%s' for writing.\n", route->filepath);
+            exit(1);
+        }
+        gzbuffer(route->handle, GZBUFSIZE);
+    }
+    _lru_push(writer, route);
+}
+
+
+// Close the output of a route. With `complete` the current file is finished,
+// otherwise the route is being closed to limit the number of open files and
+// its file may be reopened later.
+void _close_route(writer writer, route route, bool complete) {
+    if (writer->write_bam) {
+        if (route->bam_file != NULL) _close_bam(route);
+        if (complete && route->bci_path != NULL) _write_bci(writer, route);
+    }
+    else if (writer->write_bgzf) {
+        if (route->bgzf_file != NULL) {
+            _flush_output(writer, route);
+            _close_bgzf(route, complete);
+        }
+        if (complete && route->gzi.l > 0) _write_gzi(route);
+    }
+    else {
+        _flush_output(writer, route);  // may be stdout
+        if (route->handle != NULL) {
+            gzflush(route->handle, Z_FINISH);
+            gzclose(route->handle);
+            route->handle = NULL;
+        }
+    }
+    _lru_remove(writer, route);
+    // release the buffer, it will be regrown if the route is used again
+    free(route->buffer.s);
+    ks_initialize(&route->buffer);
+    if (complete) {
+        free(route->filepath);
+        route->filepath = NULL;
+        free(route->gzi_path);
+        route->gzi_path = NULL;
+        free(route->gzi.s);
+        ks_initialize(&route->gzi);
+        route->bytes_written = route->gzi_cbase = route->gzi_ubase = 0;
+        free(route->bci_path);
+        route->bci_path = NULL;
+        free(route->bci_records_path);
+        route->bci_records_path = NULL;
+        route->bam_records = route->bci_chunks = 0;
     }
-    writer->nreads[barcode]++;
+}
+
 
-    if(writer->perread != NULL) {
-        // sample has tab pre-added in init
-        char* s = writer->sample == NULL ? "" : writer->sample;
-        fprintf(writer->perread, "%s\t%s\t%s\t%s%zu\t%.2f\t%lu\t%lu\t%s\n",
-            seq->name.s, fname, meta->runid, s, seq->seq.l, \
-                mean_q, meta->channel, meta->read_number, meta->start_time);
+// Find, or create, the route for a read when demultiplexing. Routes are named
+// "barcodeNNNN" when demultiplexing by barcode, otherwise by the value of the
+// key with characters unsuitable for file names replaced. Reads without a value
+// go to "unclassified".
+route _get_route(writer writer, read_meta meta) {
+    kstring_t* name = &writer->route_name;
+    name->l = 0;
+    const char* value = NULL;
+    switch (writer->demux_key) {
+        case DEMUX_BARCODE:
+            if (meta->ibarcode != 0) ksprintf(name, "barcode%04zu", meta->ibarcode);
+            break;
+        case DEMUX_BARCODE_ALIAS: value = meta->barcode_alias; break;
+        case DEMUX_RUNID: value = meta->runid; break;
+        case DEMUX_READ_GROUP: value = meta->rg; break;
+        case DEMUX_FLOW_CELL_ID: value = meta->flow_cell_id; break;
+    }
+    if (value != NULL) {
+        for (const char* c = value; *c != '\0'; ++c) {
+            bool safe = isalnum((unsigned char)*c) || strchr("._-+@=,", *c) != NULL;
+            // also avoid hidden files and "." or ".." as a directory
+            if (c == value && *c == '.') safe = false;
+            kputc(safe ? *c : '_', name);
+        }
+    }
+    if (name->l == 0) kputs("unclassified", name);
+
+    khiter_t k = kh_get(ROUTE_INDEX, writer->route_index, name->s);
+    if (k != kh_end(writer->route_index)) {
+        return kh_val(writer->route_index, k);
+    }
+    return add_route(writer, name->s);
+}
+
+
+void _route_read(
+        writer writer, kseq_t* seq, read_meta meta, bam1_t* record, float mean_q, char* fname,
+        const char* text, size_t len) {
+    if (writer->perread_columns != NULL) {
+        column_writer columns = writer->perread_columns;
+        column_strn(columns, seq->name.s, seq->name.l);
+        column_str(columns, fname);
+        column_str(columns, meta->runid);
+        if (writer->sample != NULL) column_str(columns, writer->sample_name);
+        column_u32(columns, (uint32_t)seq->seq.l);
+        column_f32(columns, mean_q);
+        column_u32(columns, (uint32_t)meta->channel);
+        column_u32(columns, (uint32_t)meta->read_number);
+        column_str(columns, meta->start_time);
+        column_end_row(columns);
+    }
+    else if (writer->perread_tsv != NULL) {
+        tsv_writer tsv = writer->perread_tsv;
+        tsv_strn(tsv, seq->name.s, seq->name.l);
+        tsv_str(tsv, fname);
+        tsv_str(tsv, meta->runid);
+        if (writer->sample != NULL) tsv_str(tsv, writer->sample_name);
+        tsv_u64(tsv, seq->seq.l);
+        tsv_float(tsv, mean_q, 2);
+        tsv_u64(tsv, meta->channel);
+        tsv_u64(tsv, meta->read_number);
+        tsv_str(tsv, meta->start_time);
+        tsv_end_row(tsv);
     }
 
     if (writer->output == NULL) {
         // all reads to stdout
-        // Stats were initialize in init, no need to check if they exist
-        if (writer->write_bam) {
-            _write_read_bam(writer, seq, meta, writer->bam_files[0]);
+        route route = writer->routes[0];
+        if (writer->stats_only) {
+            // counted below only
+        }
+        else if (writer->write_bam) {
+            _write_read_bam(writer, seq, meta, record, route);
         }
         else {
-            _write_read(writer, seq, meta, stdout);
+            _write_read(writer, seq, meta, route, text, len);
         }
-        add_length_count(writer->l_stats[0], seq->seq.l);
-        add_qual_count(writer->q_stats[0], mean_q);
+        add_length_count(route->l_stats, seq->seq.l);
+        add_qual_count(route->q_stats, mean_q);
     }
     else {
         // demultiplexing reads
+        route route = _get_route(writer, meta);
+        if (writer->stats_only) {
+            add_length_count(route->l_stats, seq->seq.l);
+            add_qual_count(route->q_stats, mean_q);
+            return;
+        }
         // first handle multipart-output 
-        if (writer->reads_per_file != 0 && writer->reads_written[barcode] == writer->reads_per_file) {
-            if (writer->handles[barcode] == NULL) {
-                fprintf(stderr, "Unexpected output file status encountered.");
-                exit(1);
-            }
-            if (writer->write_bam) {
-                hts_close(writer->bam_files[barcode]);
-                writer->bam_files[barcode] = NULL;
-            }
-            else {
-                gzflush(writer->handles[barcode], Z_FINISH);
-                gzclose(writer->handles[barcode]);
-                writer->handles[barcode] = NULL;
-            }
-            writer->file_index[barcode]++;
-            writer->reads_written[barcode] = 0;
-        }
-
-        // write read to correct file
-        {
-            char* path = NULL;
-            char* filepath = NULL;
-            if (writer->write_bam) {
-                // open a file, if we need to
-                if (writer->bam_files[barcode] == NULL) {
-                    create_filepath(writer, barcode, &path, &filepath);
-                    ensure_directory(writer, barcode, path);
-                    writer->bam_files[barcode] = hts_open(filepath, "wb");
-                    hts_set_opt(writer->bam_files[barcode], HTS_OPT_THREAD_POOL, &writer->hts_pool);
-                    if (sam_hdr_write(writer->bam_files[barcode], writer->bam_hdr)) {
-                        fprintf(stderr, "Error writing header to BAM file\n");
-                        exit(1);
-                    }
-                }
-                _write_read_bam(writer, seq, meta, writer->bam_files[barcode]);
-            }
-            else {
-                // same again for fastq
-                if (writer->handles[barcode] == NULL) {
-                    create_filepath(writer, barcode, &path, &filepath);
-                    ensure_directory(writer, barcode, path);
-                    writer->handles[barcode] = gzopen(filepath, "wb");
-                    gzbuffer(writer->handles[barcode], GZBUFSIZE);
-                }
-                _write_read(writer, seq, meta, writer->handles[barcode]);
-            }
-            free(filepath);
-            free(path);
+        if (writer->reads_per_file != 0 && route->reads_written == writer->reads_per_file) {
+            _close_route(writer, route, true);
+            route->file_index++;
+            route->reads_written = 0;
+        }
+
+        // write read to correct file, opening it if we need to
+        if (route->handle == NULL && route->bam_file == NULL && route->bgzf_file == NULL) {
+            _open_route(writer, route);
+        }
+        else if (writer->lru_head != route) {
+            _lru_remove(writer, route);
+            _lru_push(writer, route);
+        }
+        if (writer->write_bam) {
+            _write_read_bam(writer, seq, meta, record, route);
+        }
+        else {
+            _write_read(writer, seq, meta, route, text, len);
         }
 
         // handle stats
-        if (writer->l_stats[barcode] == NULL) {
-            writer->l_stats[barcode] = create_length_stats();
-            writer->q_stats[barcode] = create_qual_stats(QUAL_HIST_WIDTH);
+        add_length_count(route->l_stats, seq->seq.l);
+        add_qual_count(route->q_stats, mean_q);
+        route->reads_written++;
+    }
+}
+
+
+void write_read(writer writer, kseq_t* seq, read_meta meta, float mean_q, char* fname) {
+    _route_read(writer, seq, meta, NULL, mean_q, fname, NULL, 0);
+}
+
+
+void format_read(writer writer, kseq_t* seq, read_meta meta, kstring_t* out) {
+    kputc('@', out);
+    kputsn(seq->name.s, seq->name.l, out);
+    if (seq->comment.l > 0) {
+        if (writer->reheader) {
+            kputc('\t', out);
+            if (meta->tags_str->l > 0) kputsn(meta->tags_str->s, meta->tags_str->l, out);
+        }
+        else {
+            kputc(' ', out);
+            kputsn(seq->comment.s, seq->comment.l, out);
+        }
+    }
+    kputc('\n', out);
+    kputsn(seq->seq.s, seq->seq.l, out);
+    kputsn("\n+\n", 3, out);
+    kputsn(seq->qual.s, seq->qual.l, out);
+    kputc('\n', out);
+}
+
+
+read_batch create_read_batch(size_t size) {
+    read_batch batch = xalloc(1, sizeof(_read_batch), "read batch");
+    batch->m = size;
+    batch->reads = xalloc(size, sizeof(kseq_t), "read batch reads");
+    batch->metas = xalloc(size, sizeof(read_meta), "read batch metas");
+    batch->mean_q = xalloc(size, sizeof(float), "read batch quals");
+    batch->text_end = xalloc(size, sizeof(size_t), "read batch text");
+    return batch;
+}
+
+
+void clear_read_batch(read_batch batch) {
+    // metas are kept with their slots and reparsed into when the slot is next used
+    batch->n = 0;
+    batch->bam_input = false;
+    batch->text.l = 0;
+    memset(batch->failures, 0, sizeof(batch->failures));
+}
+
+
+void destroy_read_batch(read_batch batch) {
+    if (batch == NULL) return;
+    clear_read_batch(batch);
+    // the slots own buffers whether or not they are in use, other than views
+    for (size_t i = 0; i < batch->m; ++i) {
+        if (batch->reads[i].name.m > 0) free(batch->reads[i].name.s);
+        if (batch->reads[i].comment.m > 0) free(batch->reads[i].comment.s);
+        if (batch->reads[i].seq.m > 0) free(batch->reads[i].seq.s);
+        if (batch->reads[i].qual.m > 0) free(batch->reads[i].qual.s);
+        if (batch->metas[i] != NULL) destroy_read_meta(batch->metas[i]);
+        if (batch->bams != NULL && batch->bams[i] != NULL) bam_destroy1(batch->bams[i]);
+    }
+    free(batch->bams);
+    free(batch->reads);
+    free(batch->metas);
+    free(batch->mean_q);
+    free(batch->text_end);
+    free(batch->text.s);
+    free(batch);
+}
+
+
+static inline void _swap_kstring(kstring_t* a, kstring_t* b) {
+    kstring_t tmp = *a; *a = *b; *b = tmp;
+}
+
+// views into mapped input are not owned (m is 0), and are left behind
+// in a slot when it is reused
+static inline void _drop_view(kstring_t* str) {
+    if (str->m == 0) {
+        str->s = NULL;
+        str->l = 0;
+    }
+}
+
+static inline void _set_view(kstring_t* str, const kstring_t* view) {
+    if (str->m > 0) free(str->s);
+    *str = *view;
+}
+
+
+static void _grow_read_batch(read_batch batch) {
+    size_t m = 2 * batch->m;
+    batch->reads = xrecalloc(batch->reads, batch->m, m, sizeof(kseq_t), "read batch reads");
+    batch->metas = xrecalloc(batch->metas, batch->m, m, sizeof(read_meta), "read batch metas");
+    batch->mean_q = xrecalloc(batch->mean_q, batch->m, m, sizeof(float), "read batch quals");
+    batch->text_end = xrecalloc(batch->text_end, batch->m, m, sizeof(size_t), "read batch text");
+    if (batch->bams != NULL) {
+        batch->bams = xrecalloc(batch->bams, batch->m, m, sizeof(bam1_t*), "read batch records");
+    }
+    batch->m = m;
+}
+
+
+void read_batch_push(read_batch batch, kseq_t* seq) {
+    if (batch->n == batch->m) _grow_read_batch(batch);
+    // swap the string buffers, kseq_read() will reuse those left in seq
+    kseq_t* slot = &batch->reads[batch->n];
+    _drop_view(&slot->name);
+    _drop_view(&slot->comment);
+    _drop_view(&slot->seq);
+    _drop_view(&slot->qual);
+    _swap_kstring(&slot->name, &seq->name);
+    _swap_kstring(&slot->comment, &seq->comment);
+    _swap_kstring(&slot->seq, &seq->seq);
+    _swap_kstring(&slot->qual, &seq->qual);
+    batch->mean_q[batch->n] = 0;
+    batch->n++;
+}
+
+
+void read_batch_push_view(read_batch batch, const fastq_view* view) {
+    if (batch->n == batch->m) _grow_read_batch(batch);
+    kseq_t* slot = &batch->reads[batch->n];
+    _set_view(&slot->name, &view->name);
+    _set_view(&slot->comment, &view->comment);
+    _set_view(&slot->seq, &view->seq);
+    _set_view(&slot->qual, &view->qual);
+    batch->mean_q[batch->n] = 0;
+    batch->n++;
+}
+
+
+void read_batch_push_bam(read_batch batch, bam1_t** record) {
+    if (batch->bams == NULL) {
+        batch->bams = xalloc(batch->m, sizeof(bam1_t*), "read batch records");
+    }
+    if (batch->n == batch->m) _grow_read_batch(batch);
+    bam1_t** slot = &batch->bams[batch->n];
+    if (*slot == NULL) *slot = bam_init1();
+    bam1_t* tmp = *slot; *slot = *record; *record = tmp;
+    batch->bam_input = true;
+    batch->mean_q[batch->n] = 0;
+    batch->n++;
+}
+
+
+void read_batch_swap(read_batch batch, size_t i, size_t j) {
+    kseq_t* a = &batch->reads[i];
+    kseq_t* b = &batch->reads[j];
+    _swap_kstring(&a->name, &b->name);
+    _swap_kstring(&a->comment, &b->comment);
+    _swap_kstring(&a->seq, &b->seq);
+    _swap_kstring(&a->qual, &b->qual);
+    read_meta meta = batch->metas[i]; batch->metas[i] = batch->metas[j]; batch->metas[j] = meta;
+    float q = batch->mean_q[i]; batch->mean_q[i] = batch->mean_q[j]; batch->mean_q[j] = q;
+    if (batch->bams != NULL) {
+        bam1_t* r = batch->bams[i]; batch->bams[i] = batch->bams[j]; batch->bams[j] = r;
+    }
+}
+
+
+void write_batch(writer writer, read_batch batch, char* fname) {
+    // text is present if the filter stage formatted the records
+    size_t start = 0;
+    for (size_t i = 0; i < batch->n; ++i) {
+        bam1_t* record = batch->bam_input ? batch->bams[i] : NULL;
+        if (batch->text.l > 0) {
+            size_t end = batch->text_end[i];
+            _route_read(
+                writer, &batch->reads[i], batch->metas[i], record, batch->mean_q[i], fname,
+                batch->text.s + start, end - start);
+            start = end;
+        }
+        else {
+            _route_read(
+                writer, &batch->reads[i], batch->metas[i], record, batch->mean_q[i], fname,
+                NULL, 0);
         }
-        add_length_count(writer->l_stats[barcode], seq->seq.l);
-        add_qual_count(writer->q_stats[barcode], mean_q);
-        writer->reads_written[barcode]++;
     }
 }
@@ -1,60 +1,180 @@
 #ifndef FASTCAT_WRITER_H
 #define FASTCAT_WRITER_H
 
+#include <pthread.h>
 #include <zlib.h>
 
 
 // this gives us kseq_t for below
 #ifndef KSEQ_DECLARED
 #include "htslib/kseq.h"
-KSEQ_DECLARE(gzFile)
+#include "../instream.h"
+KSEQ_DECLARE(instream)
 #endif
 
 #include <htslib/sam.h> // HTSlib for BAM output
+#include <htslib/bgzf.h>
+#include <htslib/khash.h>
 
+#include "../bamindex/index.h"
+#include "../columns.h"
 #include "../stats.h"
+#include "../tsv.h"
 #include "../fastqcomments.h"
+#include "../fastqmap.h"
 #include "parsing.h"
 
-// barcode 0 is reserved for "unclassified"
-#define MAX_BARCODES 1025
+// header fields on which reads can be demultiplexed
+typedef enum {
+    DEMUX_BARCODE, DEMUX_BARCODE_ALIAS, DEMUX_RUNID, DEMUX_READ_GROUP, DEMUX_FLOW_CELL_ID
+} demux_key;
+
+// Output state for a value of the demultiplexing key, or for the single
+// output when not demultiplexing. Routes are created when first needed.
+typedef struct _route {
+    char* name;  // directory and file name stem, NULL when not demultiplexing
+    char* filepath;  // current output file, once created
+    gzFile handle;
+    htsFile* bam_file;
+    BGZF* bgzf_file;
+    char* gzi_path;
+    kstring_t buffer;  // pending FASTQ output
+    size_t reads_written;  // to the current file
+    size_t file_index;
+    read_stats* l_stats;
+    read_stats* q_stats;
+    // files closed to limit open handles are reopened for appending, the
+    // .gzi index is then assembled from that of each session
+    uint64_t bytes_written;  // uncompressed, to the current file
+    uint64_t gzi_cbase;  // file offsets at which this session started
+    uint64_t gzi_ubase;
+    kstring_t gzi;  // index entries of previous sessions
+    // with a .bci index of BAM output, the indexed records are noted with
+    // their uncompressed offsets until the file is complete. Their virtual
+    // offsets are then found from the .gzi entries of the file's blocks.
+    char* bci_path;
+    char* bci_records_path;
+    FILE* bci_records;
+    size_t bam_records;  // written to the current file
+    size_t bci_chunks;
+    // open routes, most recently used first
+    struct _route* prev;
+    struct _route* next;
+} _route;
+
+typedef _route* route;
+
+KHASH_MAP_INIT_STR(ROUTE_INDEX, route)
 
 typedef struct {
     char* output;
     char* histograms;
-    gzFile* handles;
-    size_t* nreads;
-    size_t* reads_written;
-    size_t* file_index;
+    demux_key demux_key;
+    // routes in order of creation, and indexed by name
+    route* routes;
+    size_t n_routes;
+    size_t m_routes;
+    khash_t(ROUTE_INDEX)* route_index;
+    kstring_t route_name;  // scratch space for route lookup
+    // routes with an open output file, least recently used are closed first
+    size_t max_open;
+    size_t n_open;
+    route lru_head;
+    route lru_tail;
     uint64_t* failures;
-    read_stats** l_stats;
-    read_stats** q_stats;
     FILE* perread;
+    column_writer perread_columns;  // --read as columns, written to perread
+    tsv_writer perread_tsv;  // --read as TSV, written to perread or perread_bgzf
+    BGZF* perread_bgzf;
     FILE* perfile;
     FILE* runids;
     FILE* basecallers;
     char* sample;
+    char* sample_name;  // without the tab of `sample`
     size_t reheader;
     size_t reads_per_file;
     // optional BAM conversion
     int write_bam;
-    htsFile** bam_files;
     bam_hdr_t* bam_hdr;
+    bam1_t* bam_record;  // reused for each read, under lock
     htsThreadPool hts_pool;
+    int write_bci;
+    size_t bci_chunk_size;
+    // optional BGZF FASTQ output, with .gzi indexes
+    int write_bgzf;
+    int write_gzi;
+    // reads are counted in the histograms and summaries, but not written
+    bool stats_only;
+    // serialises access from multiple file workers
+    pthread_mutex_t lock;
 } _writer;
 
 typedef _writer* writer;
 
+// A batch of reads passing through the reader -> filter -> writer stages.
+// The kseq_t entries take ownership of the buffers of records read from
+// the input so that reads can be accumulated without copying.
+typedef struct {
+    size_t n;
+    size_t m;
+    kseq_t* reads;
+    read_meta* metas;
+    float* mean_q;
+    // optional pre-formatted FASTQ records, read i ends at text_end[i]
+    kstring_t text;
+    size_t* text_end;
+    // input records when reading BAM, decoded into reads by the filter stage
+    bool bam_input;
+    bam1_t** bams;
+    uint64_t failures[NUM_FAILURE_CODES];
+} _read_batch;
+
+typedef _read_batch* read_batch;
+
 char* strip_path(char* input);
 
 writer initialize_writer(
         char* output_dir, char* histograms, char* perread, char* perfile,
         char* runids, char* basecallers, char* sample,
         size_t reheader, size_t write_bam, size_t reads_per_file,
-        int threads);
+        int threads, int write_bgzf, int write_gzi, char* gzi_file,
+        int write_bci, char* bci_file, size_t bci_chunk_size,
+        char* demux_key, size_t max_open, bool append, bool stats_only, bool read_columns, bool read_bgzf);
 
 void destroy_writer(writer writer);
 
+// write out buffered output, closing demultiplexed files until next written to
+void sync_writer(writer writer);
+
+// flush outputs and rewrite histograms, e.g. between rounds of --watch
+void refresh_writer(writer writer);
+
+// create the output for a demultiplexing key value
+route add_route(writer writer, const char* name);
+
 void write_read(writer writer, kseq_t* seq, read_meta meta, float mean_q, char* fname);
 
+read_batch create_read_batch(size_t size);
+void destroy_read_batch(read_batch batch);
+void clear_read_batch(read_batch batch);
+
+// move a record into the batch, seq is left with the batch's spare buffers
+void read_batch_push(read_batch batch, kseq_t* seq);
+
+// add a record viewed in mapped input to the batch, the mapping must outlive
+// the use of the batch
+void read_batch_push_view(read_batch batch, const fastq_view* view);
+
+// move a BAM record into the batch, record is left with the batch's spare record
+void read_batch_push_bam(read_batch batch, bam1_t** record);
+
+// swap the records in two batch slots
+void read_batch_swap(read_batch batch, size_t i, size_t j);
+
+// append a read, as written by write_read(), to a buffer
+void format_read(writer writer, kseq_t* seq, read_meta meta, kstring_t* out);
+
+// write all reads in the batch, the caller must hold writer->lock
+void write_batch(writer writer, read_batch batch, char* fname);
+
 #endif
@@ -8,7 +8,9 @@
 const char *argp_program_bug_address = "support@nanoporetech.com";
 static char doc[] = 
 "fastlint -- apply sdust algorithm to input files.\
-\vThe program removes low-complexity reads from the input stream.\n";
+\vThe program removes low-complexity reads from the input stream. \
+Unaligned BAM (.bam) files are read as FASTQ, with the tags of each \
+record as the header comment.\n";
 static char args_doc[] = "<reads.fastq>";
 static struct argp_option options[] = {
     {0, 0, 0, 0,
@@ -19,6 +21,10 @@ static struct argp_option options[] = {
         "Window size (default: 64).", 0},
     {"max_proportion", 'p', "PROPORTION", 0,
         "Maximum allowable proportion of masked bases in a read to keep the read (default: 0.95).", 0},
+    {"threads", 0x100, "THREADS", 0,
+        "Number of threads for screening reads, and for output compression with --bgzf (default: 1). Reads are written in input order.", 0},
+    {"bgzf", 0x200, 0, 0,
+        "Compress output as BGZF, using --threads for compression.", 0},
     { 0 }
 };
 
@@ -38,6 +44,15 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
                 argp_error(state, "Proportion must be between 0.0 and 1.0.");
             }
             break;
+        case 0x100:
+            arguments->threads = atoi(arg);
+            if (arguments->threads < 1) {
+                argp_error(state, "threads must be a positive integer.");
+            }
+            break;
+        case 0x200:
+            arguments->write_bgzf = true;
+            break;
         case ARGP_KEY_NO_ARGS:
             argp_usage (state);
             break;
@@ -68,6 +83,8 @@ arguments_t parse_arguments(int argc, char** argv) {
     args.w = 64;
     args.max_proportion = 0.95;
     args.nfiles = 0;
+    args.threads = 1;
+    args.write_bgzf = false;
     argp_parse(&argp, argc, argv, 0, 0, &args);
     return args;
 }
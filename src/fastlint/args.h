@@ -10,6 +10,8 @@ typedef struct arguments {
     int w;
     int t;
     double max_proportion;
+    int threads;
+    bool write_bgzf;
     size_t nfiles;
 } arguments_t;
 
@@ -1,66 +1,364 @@
-
-#include <zlib.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "htslib/bgzf.h"
 #include "htslib/kseq.h"
-KSEQ_INIT(gzFile, gzread)
+#include "htslib/kstring.h"
+#include "htslib/thread_pool.h"
+#include "../instream.h"
+KSEQ_INIT(instream, instream_read)
 #define KSEQ_DECLARED
 
-#include "../sdust/sdust.h"
+#include "../common.h"
+#include "../dust.h"
+#include "../ubam.h"
 #include "args.h"
 
-int main(int argc, char *argv[]) {
-    gzFile fp;
-    kseq_t *ks;
+// number of reads passed between pipeline stages at a time
+#define READ_BATCH_SIZE 1024
+// batches in flight per pool thread
+#define BATCHES_PER_THREAD 2
+
+
+// Reads are screened in three stages: the reader (the main thread) parses
+// records into batches, workers from a thread pool run SDUST over each
+// batch and format the surviving records, and a writer thread takes the
+// results in input order and writes them out. Without a thread pool all
+// stages run in turn on the main thread.
+typedef struct {
+    kseq_t* reads;
+    size_t n;
+    size_t m;
+    kstring_t text;  // surviving records, formatted for output
+    kstring_t log;   // messages for skipped reads
+} _lint_batch;
+typedef _lint_batch* lint_batch;
+
+typedef struct {
+    arguments_t* args;
+    htsThreadPool hts_pool;
+    hts_tpool_process* process;  // NULL when running without a pool
+    pthread_t writer_stage;
+    BGZF* bgzf_file;  // NULL when writing plain text
+    bool failed;      // set by the writer stage
+    // batches available for reuse
+    lint_batch* spare;
+    size_t nspare;
+    size_t mspare;
+    pthread_mutex_t spare_lock;
+} linter;
+
+typedef struct {
+    linter* lint;
+    lint_batch batch;
+} batch_job;
+
+
+lint_batch create_lint_batch(size_t size) {
+    lint_batch batch = xalloc(1, sizeof(_lint_batch), "read batch");
+    batch->m = size;
+    batch->reads = xalloc(size, sizeof(kseq_t), "read batch reads");
+    return batch;
+}
+
+void destroy_lint_batch(lint_batch batch) {
+    if (batch == NULL) return;
+    for (size_t i = 0; i < batch->m; ++i) {
+        free(batch->reads[i].name.s);
+        free(batch->reads[i].comment.s);
+        free(batch->reads[i].seq.s);
+        free(batch->reads[i].qual.s);
+    }
+    free(batch->reads);
+    free(batch->text.s);
+    free(batch->log.s);
+    free(batch);
+}
+
+static inline void _swap_kstring(kstring_t* a, kstring_t* b) {
+    kstring_t tmp = *a; *a = *b; *b = tmp;
+}
+
+// move a record into the batch, seq is left with the batch's spare buffers
+void lint_batch_push(lint_batch batch, kseq_t* seq) {
+    kseq_t* slot = &batch->reads[batch->n++];
+    _swap_kstring(&slot->name, &seq->name);
+    _swap_kstring(&slot->comment, &seq->comment);
+    _swap_kstring(&slot->seq, &seq->seq);
+    _swap_kstring(&slot->qual, &seq->qual);
+}
+
+
+lint_batch take_batch(linter* lint) {
+    lint_batch batch = NULL;
+    pthread_mutex_lock(&lint->spare_lock);
+    if (lint->nspare > 0) batch = lint->spare[--lint->nspare];
+    pthread_mutex_unlock(&lint->spare_lock);
+    if (batch == NULL) batch = create_lint_batch(READ_BATCH_SIZE);
+    return batch;
+}
+
+void return_batch(linter* lint, lint_batch batch) {
+    batch->n = 0;
+    batch->text.l = 0;
+    batch->log.l = 0;
+    pthread_mutex_lock(&lint->spare_lock);
+    if (lint->nspare == lint->mspare) {
+        size_t m = lint->mspare == 0 ? 8 : 2 * lint->mspare;
+        lint->spare = xrecalloc(lint->spare, lint->mspare, m, sizeof(lint_batch), "spare batches");
+        lint->mspare = m;
+    }
+    lint->spare[lint->nspare++] = batch;
+    pthread_mutex_unlock(&lint->spare_lock);
+}
+
+
+// Worker stage: screen reads and format those that are kept
+void screen_batch(linter* lint, lint_batch batch) {
+    arguments_t* args = lint->args;
+    dust_engine engine = thread_dust_engine();
+    for (size_t i = 0; i < batch->n; ++i) {
+        kseq_t* ks = &batch->reads[i];
+        // passing reads need not be scanned to the end, but the exact
+        // fraction of failing reads is reported
+        int read_length = ks->seq.l;
+        int max_masked = (int)dust_max_masked(read_length, args->max_proportion);
+        size_t masked_bases = dust_masked_bases(
+            engine, (uint8_t*)ks->seq.s, ks->seq.l, args->t, args->w, max_masked, INT_MAX);
+        double masked_fraction = (double)masked_bases / read_length;
+        if (masked_fraction > args->max_proportion) {
+            ksprintf(&batch->log, "Read %s masked fraction %.2f exceeds threshold %.2f, skipping.\n",
+                ks->name.s, masked_fraction, args->max_proportion);
+            continue;
+        }
+        kstring_t* out = &batch->text;
+        kputc('@', out);
+        kputsn(ks->name.s, ks->name.l, out);
+        // for reasons unknown, we care about preserving the separator
+        // between the name and the comment, but we don't have that. If
+        // there are tabs in the comment, there's a good chance the
+        // separator was a tab, particular if data went through fastcat
+        // with the --reheader option.
+        if (ks->comment.l > 0) {
+            char sep = ' ';
+            if (strchr(ks->comment.s, '\t') != NULL) {
+                sep = '\t';
+            }
+            kputc(sep, out);
+            kputsn(ks->comment.s, ks->comment.l, out);
+        }
+        kputc('\n', out);
+        kputsn(ks->seq.s, ks->seq.l, out);
+        kputsn("\n+\n", 3, out);
+        kputsn(ks->qual.s, ks->qual.l, out);
+        kputc('\n', out);
+    }
+}
+
+void* batch_worker(void* arg) {
+    batch_job* job = arg;
+    lint_batch batch = job->batch;
+    if (batch != NULL) screen_batch(job->lint, batch);
+    free(job);
+    return batch;
+}
+
+
+// Writer stage: results must be given in input order
+void consume_batch(linter* lint, lint_batch batch) {
+    if (batch->log.l > 0) {
+        fwrite(batch->log.s, 1, batch->log.l, stderr);
+    }
+    if (batch->text.l > 0 && !lint->failed) {
+        if (lint->bgzf_file != NULL) {
+            lint->failed = bgzf_write(lint->bgzf_file, batch->text.s, batch->text.l) < 0;
+        } else {
+            lint->failed = fwrite(batch->text.s, 1, batch->text.l, stdout) != batch->text.l;
+        }
+    }
+    return_batch(lint, batch);
+}
+
+void* pipeline_writer(void* arg) {
+    linter* lint = arg;
+    hts_tpool_result* r;
+    while ((r = hts_tpool_next_result_wait(lint->process)) != NULL) {
+        lint_batch batch = hts_tpool_result_data(r);
+        hts_tpool_delete_result(r, 0);
+        if (batch == NULL) break;  // end of input
+        consume_batch(lint, batch);
+    }
+    return NULL;
+}
+
+// Pass a batch from the reader to the next stage, NULL signals end of input.
+// Blocks if the pool is already holding the maximum number of batches.
+void submit_batch(linter* lint, lint_batch batch) {
+    if (lint->process == NULL) {
+        if (batch == NULL) return;
+        screen_batch(lint, batch);
+        consume_batch(lint, batch);
+        return;
+    }
+    batch_job* job = xalloc(1, sizeof(batch_job), "batch job");
+    job->lint = lint;
+    job->batch = batch;
+    if (hts_tpool_dispatch(lint->hts_pool.pool, lint->process, batch_worker, job) != 0) {
+        fprintf(stderr, "Error dispatching reads to thread pool\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void initialize_linter(linter* lint, arguments_t* args) {
+    memset(lint, 0, sizeof(linter));
+    lint->args = args;
+    pthread_mutex_init(&lint->spare_lock, NULL);
+    if (args->threads > 1) {
+        lint->hts_pool.pool = hts_tpool_init(args->threads);
+        if (lint->hts_pool.pool == NULL) {
+            fprintf(stderr, "Error creating thread pool\n");
+            exit(EXIT_FAILURE);
+        }
+        int qsize = BATCHES_PER_THREAD * hts_tpool_size(lint->hts_pool.pool);
+        lint->process = hts_tpool_process_init(lint->hts_pool.pool, qsize, 0);
+        if (lint->process == NULL) {
+            fprintf(stderr, "Error creating thread pool queue\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (args->write_bgzf) {
+        lint->bgzf_file = bgzf_open("-", "w");
+        if (lint->bgzf_file == NULL) {
+            fprintf(stderr, "Error opening BGZF output\n");
+            exit(EXIT_FAILURE);
+        }
+        if (lint->hts_pool.pool != NULL && bgzf_thread_pool(lint->bgzf_file, lint->hts_pool.pool, 0) < 0) {
+            fprintf(stderr, "Error setting thread pool for BGZF output\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (lint->process != NULL) {
+        if (pthread_create(&lint->writer_stage, NULL, pipeline_writer, lint) != 0) {
+            fprintf(stderr, "Error creating writer thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Wait for outstanding batches to be written and release resources,
+// returns non-zero if output failed.
+int finish_linter(linter* lint) {
+    submit_batch(lint, NULL);
+    if (lint->process != NULL) {
+        pthread_join(lint->writer_stage, NULL);
+        hts_tpool_process_destroy(lint->process);
+    }
+    if (lint->bgzf_file != NULL && bgzf_close(lint->bgzf_file) < 0) {
+        lint->failed = true;
+    }
+    if (lint->hts_pool.pool != NULL) {  // must be after file closing
+        hts_tpool_destroy(lint->hts_pool.pool);
+    }
+    for (size_t i = 0; i < lint->nspare; ++i) {
+        destroy_lint_batch(lint->spare[i]);
+    }
+    free(lint->spare);
+    pthread_mutex_destroy(&lint->spare_lock);
+    if (lint->failed) {
+        fprintf(stderr, "Error writing output\n");
+    }
+    return lint->failed;
+}
+
 
+// Read FASTQ records from a file, or stdin for "-"
+void read_fastq(linter* lint, const char* fname) {
+    instream fp = instream_open(fname, &lint->hts_pool);
+    if (fp == NULL) {
+        fprintf(stderr, "Error opening file %s\n", fname);
+        return;
+    }
+    kseq_t* ks = kseq_init(fp);
+
+    lint_batch batch = NULL;
+    while (kseq_read(ks) >= 0) {
+        if (batch == NULL) batch = take_batch(lint);
+        // ks is given fresh buffers by this
+        lint_batch_push(batch, ks);
+        if (batch->n >= READ_BATCH_SIZE) {
+            submit_batch(lint, batch);
+            batch = NULL;
+        }
+    }
+    if (batch != NULL) submit_batch(lint, batch);
+    kseq_destroy(ks);
+    instream_close(fp);
+}
+
+// Read the primary records of an unaligned BAM as FASTQ, with their tags
+// as the comment. Records without qualities are skipped, as by fastcat.
+void read_bam(linter* lint, const char* fname) {
+    htsFile* fp = hts_open(fname, "r");
+    sam_hdr_t* hdr = NULL;
+    if (fp != NULL) {
+        if (lint->hts_pool.pool != NULL) {
+            hts_set_opt(fp, HTS_OPT_THREAD_POOL, &lint->hts_pool);
+        }
+        hdr = sam_hdr_read(fp);
+    }
+    if (hdr == NULL) {
+        fprintf(stderr, "Error reading BAM file %s\n", fname);
+        if (fp != NULL) hts_close(fp);
+        return;
+    }
+
+    bam1_t* record = bam_init1();
+    lint_batch batch = NULL;
+    size_t no_qual = 0;
+    while (sam_read1(fp, hdr, record) >= 0) {
+        if (!is_primary_record(record)) continue;
+        if (record->core.l_qseq == 0 || bam_get_qual(record)[0] == 0xff) {
+            no_qual++;
+            continue;
+        }
+        if (batch == NULL) batch = take_batch(lint);
+        kseq_t* slot = &batch->reads[batch->n++];
+        bam_to_fastq(record, &slot->name, &slot->seq, &slot->qual);
+        slot->comment.l = 0;
+        format_aux((char*)bam_get_aux(record), bam_get_l_aux(record), &slot->comment);
+        if (batch->n >= READ_BATCH_SIZE) {
+            submit_batch(lint, batch);
+            batch = NULL;
+        }
+    }
+    if (batch != NULL) submit_batch(lint, batch);
+    if (no_qual > 0) {
+        fprintf(stderr, "Skipped %zu records without qualities in BAM file %s\n", no_qual, fname);
+    }
+    bam_destroy1(record);
+    sam_hdr_destroy(hdr);
+    hts_close(fp);
+}
+
+
+int main(int argc, char *argv[]) {
     arguments_t args = parse_arguments(argc, argv);
+    linter lint;
+    initialize_linter(&lint, &args);
 
     for (size_t i=0; i<args.nfiles; ++i) { 
-        if ((strcmp(args.fastq[i], "-") == 0) && (strlen(args.fastq[i]) == 1)) {
-            fp = gzdopen(fileno(stdin), "r");
+        if (is_bam_filename(args.fastq[i])) {
+            read_bam(&lint, args.fastq[i]);
         }
         else {
-            fp = gzopen(args.fastq[i], "r");
-        }
-        ks = kseq_init(fp);
-
-        while (kseq_read(ks) >= 0) {
-            uint64_t *r;
-            int n;
-            r = sdust(0, (uint8_t*)ks->seq.s, -1, args.t, args.w, &n);
-            
-            // Calculate total masked length
-            int masked_bases = 0;
-            for (int i = 0; i < n; ++i) {
-                int start = (int)(r[i] >> 32);
-                int end = (int)r[i];
-                masked_bases += (end - start);
-            }
-            int read_length = ks->seq.l;
-            double masked_fraction = (double)masked_bases / read_length;
-            if (masked_fraction > args.max_proportion) {
-                fprintf(stderr, "Read %s masked fraction %.2f exceeds threshold %.2f, skipping.\n",
-                    ks->name.s, masked_fraction, args.max_proportion);
-            }
-            else {
-                // for reasons unknown, we care about preserving the separator
-                // between the name and the comment, but we don't have that. If
-                // there are tabs in the comment, there's a good chance the
-                // separator was a tab, particular if data went through fastcat
-                // with the --reheader option.
-                if (ks->comment.l > 0) {
-                    char sep = ' ';
-                    if (strchr(ks->comment.s, '\t') != NULL) {
-                        sep = '\t';
-                    }
-                    printf("@%s%c%s\n%s\n+\n%s\n", ks->name.s, sep, ks->comment.s, ks->seq.s, ks->qual.s);
-                } else {
-                    printf("@%s\n%s\n+\n%s\n", ks->name.s, ks->seq.s, ks->qual.s);
-                }
-            }
-            free(r);
+            read_fastq(&lint, args.fastq[i]);
         }
-        kseq_destroy(ks);
-        gzclose(fp);
     }
-	return 0;
+    int failed = finish_linter(&lint);
+    destroy_thread_dust_engine();
+	return failed ? EXIT_FAILURE : 0;
 }
@@ -2,21 +2,32 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "common.h"
 #include "fastqcomments.h"
-
-
-// like `ksprintf()`, but will put the optional delimiter `d` before the added string if
-// `s` is not empty (and skip the delimiter otherwise)
-#define ksprintf_with_opt_delim(s, d, fmt, ...) \
-    ksprintf(s, "%s" fmt, s->l == 0 ? "" : d, __VA_ARGS__)
+#include "ubam.h"
 
 
 read_meta create_read_meta(const kstring_t* comment) {
     read_meta meta = xalloc(1, sizeof(_read_meta), "meta");
-    meta->comment = xalloc(comment->l + 1, sizeof(char), "meta->comment");
-    strncpy(meta->comment, comment->s, comment->l);
+    meta->rest = xalloc(1, sizeof(kstring_t), "meta->rest");
+    ks_initialize(meta->rest);
+    meta->tags_str = xalloc(1, sizeof(kstring_t), "meta->tags_str");
+    ks_initialize(meta->tags_str);
+    meta->aux = xalloc(1, sizeof(kstring_t), "meta->aux");
+    ks_initialize(meta->aux);
+    ks_initialize(&meta->buffer);
+    reset_read_meta(meta, comment);
+    return meta;
+}
+
+void reset_read_meta(read_meta meta, const kstring_t* comment) {
+    // the buffer holds a copy of the comment, which parsing splits in place
+    meta->buffer.l = 0;
+    if (comment->l > 0) kputsn(comment->s, comment->l, &meta->buffer);
+    else kputsn("", 0, &meta->buffer);
+    meta->comment = meta->buffer.s;
     meta->rg = "";
     meta->rg_info = NULL;
     meta->runid = "";
@@ -28,136 +39,294 @@ read_meta create_read_meta(const kstring_t* comment) {
     meta->start_time = "";
     meta->read_number = 0;
     meta->channel = 0;
-    meta->rest = xalloc(1, sizeof(kstring_t), "meta->rest");
-    ks_initialize(meta->rest);
-    meta->tags_str = xalloc(1, sizeof(kstring_t), "meta->tags_str");
-    ks_initialize(meta->tags_str);
-
-    return meta;
+    ks_clear(meta->rest);
+    ks_clear(meta->tags_str);
+    ks_clear(meta->aux);
+    meta->aux_error = false;
 }
 
 void destroy_read_meta(read_meta meta) {
-    free(meta->comment);
-    destroy_rg_info(meta->rg_info);
+    free(meta->buffer.s);
     free(meta->rest->s);
     free(meta->rest);
     free(meta->tags_str->s);
     free(meta->tags_str);
+    free(meta->aux->s);
+    free(meta->aux);
     free(meta);
 }
 
-// The caller is responsible for calling destroy_read_meta on the returned object.
-read_meta parse_read_meta(kstring_t comment) {
-    read_meta meta = create_read_meta(&comment);
+// Add an encoded entry to a BAM aux block. An existing entry for the same tag
+// is replaced in place, as with htslib's bam_aux_update_*().
+static void aux_put(kstring_t* aux, const char* tag, char type, const uint8_t* value, size_t len) {
+    size_t pos = 0;
+    while (pos + 3 <= aux->l) {
+        size_t size = aux_value_size(aux->s + pos, aux->s + aux->l);
+        if (size == 0) break;
+        if (aux->s[pos] == tag[0] && aux->s[pos + 1] == tag[1]) {
+            size_t old_end = pos + 3 + size;
+            size_t new_end = pos + 3 + len;
+            ks_resize(aux, aux->l - old_end + new_end + 1);
+            memmove(aux->s + new_end, aux->s + old_end, aux->l - old_end);
+            aux->l = aux->l - old_end + new_end;
+            aux->s[pos + 2] = type;
+            memcpy(aux->s + pos + 3, value, len);
+            return;
+        }
+        pos += 3 + size;
+    }
+    char head[3] = {tag[0], tag[1], type};
+    kputsn(head, 3, aux);
+    kputsn((const char*)value, len, aux);
+}
 
-    // if an RG or RD tag appears in the seq->comment, assume there are SAM tags to parse
-    char* res = NULL;
-    bool sam_tags = false;
-    if (strlen(meta->comment) > 0) {
-        // check if comment starts with "RG:Z:" or "RD:Z:"
-        if (!strncmp(meta->comment, "RG:Z:", 5) || !strncmp(meta->comment, "RD:Z:", 5)) {
-            sam_tags = true;
+
+// Encode a SAM text tag into the BAM aux block, returns false if it cannot be
+// represented. Integers use the smallest type holding the value and 'H' is
+// stored as 'Z', matching what bam_aux_update_*() would produce.
+static bool aux_encode(kstring_t* aux, const char* tag, const char* type, const char* value) {
+    if (strlen(tag) != 2 || strlen(type) != 1) return false;
+    uint8_t buf[4];
+    char* end;
+    switch (type[0]) {
+        case 'Z': case 'H':
+            aux_put(aux, tag, 'Z', (const uint8_t*)value, strlen(value) + 1);
+            return true;
+        case 'f': {
+            float f = strtof(value, &end);
+            if (end == value || *end != '\0') return false;
+            memcpy(buf, &f, 4);  // BAM, like the hosts we build for, is little-endian
+            aux_put(aux, tag, 'f', buf, 4);
+            return true;
+        }
+        case 'c': case 'C': case 's': case 'S': case 'i': case 'I': {
+            long long v = strtoll(value, &end, 10);
+            if (end == value || *end != '\0' || v < INT32_MIN || v > UINT32_MAX) return false;
+            char t; size_t size;
+            if (v < INT16_MIN)       { t = 'i'; size = 4; }
+            else if (v < INT8_MIN)   { t = 's'; size = 2; }
+            else if (v < 0)          { t = 'c'; size = 1; }
+            else if (v < UINT8_MAX)  { t = 'C'; size = 1; }
+            else if (v < UINT16_MAX) { t = 'S'; size = 2; }
+            else                     { t = 'I'; size = 4; }
+            uint32_t u = (uint32_t)v;
+            for (size_t i = 0; i < size; ++i) buf[i] = (u >> (8 * i)) & 0xff;
+            aux_put(aux, tag, t, buf, size);
+            return true;
         }
-        // RG or RD could also appear later in the comment (we include '\t' in the check
-        // to be extra stringent)
-        res = strstr(meta->comment, "\tRG:Z:");
-        if (res != NULL) {
-            sam_tags = true;
+        default:
+            return false;
+    }
+}
+
+
+// Add a SAM tag to the tags string and, if requested, the BAM aux block
+static void add_tag(read_meta meta, bool encode_aux, const char* tag, const char* type, const char* value) {
+    if (meta->tags_str->l > 0) kputc('\t', meta->tags_str);
+    kputs(tag, meta->tags_str);
+    kputc(':', meta->tags_str);
+    kputs(type, meta->tags_str);
+    kputc(':', meta->tags_str);
+    kputs(value, meta->tags_str);
+    if (encode_aux && !aux_encode(meta->aux, tag, type, value)) {
+        meta->aux_error = true;
+    }
+}
+
+// Add a word, or key=value pair, to the text destined for the CO:Z tag
+static void add_rest(read_meta meta, const char* key, const char* value) {
+    if (meta->rest->l > 0) kputc(' ', meta->rest);
+    kputs(key, meta->rest);
+    if (value != NULL) {
+        kputc('=', meta->rest);
+        kputs(value, meta->rest);
+    }
+}
+
+
+// Take the next token from `*p` ending at `delim` (or the end of the string),
+// skipping leading delimiters. The delimiter is overwritten with '\0' and
+// `*p` left after it. This is strtok_r() for a single delimiter character.
+static char* next_token(char** p, char delim) {
+    char* s = *p;
+    while (*s == delim) ++s;
+    if (*s == '\0') {
+        *p = s;
+        return NULL;
+    }
+    char* end = strchr(s, delim);
+    if (end == NULL) {
+        *p = s + strlen(s);
+    }
+    else {
+        *end = '\0';
+        *p = end + 1;
+    }
+    return s;
+}
+
+
+typedef enum {
+    KEY_OTHER, KEY_RUNID, KEY_RG, KEY_BASECALLER, KEY_FLOW_CELL, KEY_BARCODE,
+    KEY_BARCODE_ALIAS, KEY_READ, KEY_CHANNEL, KEY_START_TIME
+} meta_key;
+
+// Identify the keys of interest, distinguished first by length
+static meta_key get_meta_key(const char* key) {
+    size_t len = strlen(key);
+    switch (len) {
+        case 2:
+            switch (key[0]) {
+                case 'R':
+                    if (key[1] == 'D') return KEY_RUNID;
+                    if (key[1] == 'G') return KEY_RG;
+                    if (key[1] == 'N') return KEY_READ;
+                    break;
+                case 'F': if (key[1] == 'C') return KEY_FLOW_CELL; break;
+                case 'B':
+                    if (key[1] == 'C') return KEY_BARCODE;
+                    if (key[1] == 'A') return KEY_BARCODE_ALIAS;
+                    break;
+                case 'r': if (key[1] == 'n') return KEY_READ; break;
+                case 'C': if (key[1] == 'H') return KEY_CHANNEL; break;
+                case 'c': if (key[1] == 'h') return KEY_CHANNEL; break;
+                case 'S': if (key[1] == 'T') return KEY_START_TIME; break;
+                case 's': if (key[1] == 't') return KEY_START_TIME; break;
+            }
+            break;
+        case 4: if (!memcmp(key, "read", 4)) return KEY_READ; break;
+        case 5: if (!memcmp(key, "runid", 5)) return KEY_RUNID; break;
+        case 7: if (!memcmp(key, "barcode", 7)) return KEY_BARCODE; break;
+        case 10: if (!memcmp(key, "start_time", 10)) return KEY_START_TIME; break;
+        case 12: if (!memcmp(key, "flow_cell_id", 12)) return KEY_FLOW_CELL; break;
+        case 13: if (!memcmp(key, "barcode_alias", 13)) return KEY_BARCODE_ALIAS; break;
+        // CW-4766 - inconsistent naming of basecall model version id by guppy/minknow/dorado
+        case 16: if (!memcmp(key, "model_version_id", 16)) return KEY_BASECALLER; break;
+        case 25: if (!memcmp(key, "basecall_model_version_id", 25)) return KEY_BASECALLER; break;
+    }
+    return KEY_OTHER;
+}
+
+
+// Fill in the run ID and basecaller from the read group, if not given directly
+static void complete_from_read_group(read_meta meta, bool encode_aux) {
+    bool need_run_id = meta->runid[0] == '\0';
+    bool need_basecaller = meta->basecaller[0] == '\0';
+    if(meta->rg[0] != '\0' && (need_run_id || need_basecaller)) {
+        const readgroup* rg_info = get_rg_info(meta->rg);
+        if (need_run_id && rg_info->runid != NULL) {
+            meta->runid = rg_info->runid;
+            add_tag(meta, encode_aux, "RD", "Z", rg_info->runid);
         }
-        res = strstr(meta->comment, "\tRD:Z:");
-        if (res != NULL) {
-            sam_tags = true;
+        if (need_basecaller && rg_info->basecaller != NULL) {
+            meta->basecaller = rg_info->basecaller;
         }
+        meta->rg_info = rg_info;
     }
+}
 
-    char *pch=NULL, *p1=NULL, *p2=NULL;
-    char *key=NULL, *keytype=NULL, *value=NULL;
 
-    char sam_token[2] = "\t";
-    char fq_token[2] = " ";
-    char* token = fq_token;
-    if (sam_tags) {
-        token = sam_token;
+// The caller is responsible for calling destroy_read_meta on the returned object.
+read_meta parse_read_meta(kstring_t comment, bool encode_aux) {
+    read_meta meta = create_read_meta(&comment);
+    parse_read_meta_into(meta, comment, encode_aux);
+    return meta;
+}
+
+void parse_read_meta_into(read_meta meta, kstring_t comment, bool encode_aux) {
+    reset_read_meta(meta, &comment);
+    char* str = meta->comment;
+
+    // if an RG or RD tag appears in the seq->comment, assume there are SAM tags to parse,
+    // they may start the comment or appear later (we include '\t' in the check to be
+    // extra stringent)
+    bool sam_tags = false;
+    for (const char* c = str; c != NULL && !sam_tags; c = strchr(c, '\t')) {
+        if (*c == '\t') ++c;
+        sam_tags = !strncmp(c, "RG:Z:", 5) || !strncmp(c, "RD:Z:", 5);
     }
-    pch = strtok_r(meta->comment, token, &p1);
-    while (pch != NULL) {
 
+    char token = sam_tags ? '\t' : ' ';
+    char *p1 = str, *p2 = NULL;
+    char *pch, *key, *keytype, *value;
+    while ((pch = next_token(&p1, token)) != NULL) {
+        p2 = pch;
         if (sam_tags) {
             // split to tag:type:value
-            key = strtok_r(pch, ":", &p2);
-            keytype = strtok_r(NULL, ":", &p2);
-            value = strtok_r(NULL, "", &p2);
+            key = next_token(&p2, ':');
+            keytype = next_token(&p2, ':');
+            value = *p2 == '\0' ? NULL : p2;
             // we allow empty tags (e.g. 'RG:Z:'); in this case, `keytype` will be
             // non-null, but `value` will be null; we set it to ""
             if (keytype != NULL && value == NULL) value = "";
         }
         else {
-            // split words on `=`
-            key = strtok_r(pch, "=", &p2);
-            bool has_delim = p2 != NULL;  // p2 will be NULL if no = was found
+            // split words on `=`, allowing empty tags (e.g. barcode=) to ensure
+            // that k=v records are appropriately formatted in CO:Z even if blank.
+            // Note a word without `=` is also given an empty value.
+            key = next_token(&p2, '=');
             keytype = NULL;
-            value = strtok_r(NULL, "", &p2);
-            // similarly, allow empty tags (e.g. barcode=) to ensure that k=v
-            // records are appropriately formatted in CO:Z even if blank
-            if (value == NULL && has_delim) value = "";
+            value = p2;
         }
+        if (key == NULL) key = "";
 
         // if there was no delimiter in the word, value will be NULL --> add word to `rest`
         if (value == NULL) {
-            ksprintf_with_opt_delim(meta->rest, " ", "%s", key);
-        } else {
-            if (!strcmp(key, "runid") || !strcmp(key, "RD")) {
+            add_rest(meta, key, NULL);
+            continue;
+        }
+        switch (get_meta_key(key)) {
+            case KEY_RUNID:
                 // we'll output RD depending on the value of RG, later
                 meta->runid = value;
-                ksprintf_with_opt_delim(meta->tags_str, "\t", "RD:Z:%s", meta->runid);
-            }
-            else if (!strcmp(key, "RG")) {
+                add_tag(meta, encode_aux, "RD", "Z", value);
+                break;
+            case KEY_RG:
                 meta->rg = value;
-                ksprintf_with_opt_delim(meta->tags_str, "\t", "RG:Z:%s", value);
-            }
-            // CW-4766 - inconsistent naming of basecall model version id by guppy/minknow/dorado
-            else if (!strcmp(key, "basecall_model_version_id") || !strcmp(key, "model_version_id")) {
+                add_tag(meta, encode_aux, "RG", "Z", value);
+                break;
+            case KEY_BASECALLER:
                 meta->basecaller = value;
                 // there's no discrete tag defined by guppy/minknow/doroado
                 // for this; so not added to `tags_str` (but to `rest` instead)
-                ksprintf_with_opt_delim(meta->rest, " ", "%s=%s", key, value);
-            }
-            else if (!strcmp(key, "flow_cell_id") || !strcmp(key, "FC")) {
+                add_rest(meta, key, value);
+                break;
+            case KEY_FLOW_CELL:
                 meta->flow_cell_id = value;
-                ksprintf_with_opt_delim(meta->tags_str, "\t", "FC:Z:%s", value);
-            }
-            else if (!strcmp(key, "barcode") || !strcmp(key, "BC")) {
+                add_tag(meta, encode_aux, "FC", "Z", value);
+                break;
+            case KEY_BARCODE:
                 meta->barcode = value;
-                meta->ibarcode = atoi(value+7);  // "unclassified" -> 0
-                ksprintf_with_opt_delim(meta->tags_str, "\t", "BC:Z:%s", value);
-            }
-            else if (!strcmp(key, "barcode_alias") || !strcmp(key, "BA")) {
+                // "barcodeNN" -> NN, "unclassified" -> 0
+                meta->ibarcode = strlen(value) > 7 ? atoi(value + 7) : 0;
+                add_tag(meta, encode_aux, "BC", "Z", value);
+                break;
+            case KEY_BARCODE_ALIAS:
                 meta->barcode_alias = value;
-                ksprintf_with_opt_delim(meta->tags_str, "\t", "BA:Z:%s", value);
-            }
-            else if (!strcmp(key, "read") || !strcmp(key, "RN") || !strcmp(key, "rn")) {
+                add_tag(meta, encode_aux, "BA", "Z", value);
+                break;
+            case KEY_READ:
                 meta->read_number = atoi(value);
-                ksprintf_with_opt_delim(meta->tags_str, "\t", "rn:i:%s", value);
-            }
-            else if (!strcmp(key, "CH") || !strcmp(key, "ch")) {
+                add_tag(meta, encode_aux, "rn", "i", value);
+                break;
+            case KEY_CHANNEL:
                 meta->channel = atoi(value);
-                ksprintf_with_opt_delim(meta->tags_str, "\t", "ch:i:%s", value);
-            }
-            else if (!strcmp(key, "start_time") || !strcmp(key, "ST") || !strcmp(key, "st")) {
+                add_tag(meta, encode_aux, "ch", "i", value);
+                break;
+            case KEY_START_TIME:
                 meta->start_time = value;
-                ksprintf_with_opt_delim(meta->tags_str, "\t", "st:Z:%s", value);
-            } else {
+                add_tag(meta, encode_aux, "st", "Z", value);
+                break;
+            default:
                 if (sam_tags) {
                     // pass through all other tags
-                    ksprintf_with_opt_delim(meta->tags_str, "\t", "%s:%s:%s", key, keytype, value);
+                    add_tag(meta, encode_aux, key, keytype, value);
                 }
                 else {
                     // long form key=value was not mapped to a SAM tag, send it to CO via meta->rest
-                    ksprintf_with_opt_delim(meta->rest, " ", "%s=%s", key, value);
+                    add_rest(meta, key, value);
                 }
-            }
         }
-        pch = strtok_r(NULL, token, &p1);
     }
 
     // if there is a `rest`
@@ -169,22 +338,55 @@ read_meta parse_read_meta(kstring_t comment) {
         }
     }
     if (meta->rest->l != 0 && meta->rest->s[0] != ' ') {
-        ksprintf_with_opt_delim(meta->tags_str, "\t", "CO:Z:%s", meta->rest->s);
+        add_tag(meta, encode_aux, "CO", "Z", meta->rest->s);
     }
 
-    bool need_run_id = strlen(meta->runid) == 0;
-    bool need_basecaller = strlen(meta->basecaller) == 0;
-    if(strlen(meta->rg) > 0 && (need_run_id || need_basecaller)) {
-        readgroup* rg_info = create_rg_info(meta->rg);
-        if (need_run_id && rg_info->runid != NULL) {
-            meta->runid = rg_info->runid;
-            ksprintf_with_opt_delim(meta->tags_str, "\t", "RD:Z:%s", rg_info->runid);
+    complete_from_read_group(meta, encode_aux);
+}
+
+
+void parse_read_meta_bam(read_meta meta, const char* aux, size_t len, bool encode_aux) {
+    kstring_t empty = {0, 0, NULL};
+    reset_read_meta(meta, &empty);
+    // string values are used in place from a copy of the block
+    meta->buffer.l = 0;
+    kputsn(aux, len, &meta->buffer);
+    meta->comment = "";
+    const char* s = meta->buffer.s;
+    const char* end = s + len;
+    size_t size;
+    char key[3] = {0};
+    while ((size = aux_value_size(s, end)) > 0) {
+        char type = s[2];
+        char* value = (char*)s + 3;
+        bool is_str = type == 'Z';
+        bool is_int = strchr("cCsSiI", type) != NULL;
+        key[0] = s[0]; key[1] = s[1];
+        switch (get_meta_key(key)) {
+            case KEY_RUNID: if (is_str) meta->runid = value; break;
+            case KEY_RG: if (is_str) meta->rg = value; break;
+            case KEY_FLOW_CELL: if (is_str) meta->flow_cell_id = value; break;
+            case KEY_BARCODE:
+                if (is_str) {
+                    meta->barcode = value;
+                    meta->ibarcode = strlen(value) > 7 ? atoi(value + 7) : 0;
+                }
+                break;
+            case KEY_BARCODE_ALIAS: if (is_str) meta->barcode_alias = value; break;
+            case KEY_READ: if (is_int) meta->read_number = aux_int_value(s); break;
+            case KEY_CHANNEL: if (is_int) meta->channel = aux_int_value(s); break;
+            case KEY_START_TIME: if (is_str) meta->start_time = value; break;
+            default: break;
         }
-        if (need_basecaller && rg_info->basecaller != NULL) {
-            meta->basecaller = rg_info->basecaller;
+        // tags are passed through unchanged
+        if (encode_aux) {
+            kputsn(s, 3 + size, meta->aux);
         }
-        meta->rg_info = rg_info;
+        else {
+            if (meta->tags_str->l > 0) kputc('\t', meta->tags_str);
+            format_aux_entry(s, meta->tags_str);
+        }
+        s += 3 + size;
     }
-
-    return meta;
+    complete_from_read_group(meta, encode_aux);
 }
@@ -1,13 +1,16 @@
 #ifndef FASTCAT_FASTQCOMMENTS_H
 #define FASTCAT_FASTQCOMMENTS_H
 
+#include <stdbool.h>
+
 #include "common.h"
 #include "htslib/kstring.h"
 
 typedef struct {
     char* comment;
     char* rg;
-    readgroup* rg_info;
+    // shared, owned by the read group cache
+    const readgroup* rg_info;
     char* runid;
     char* basecaller;
     char* flow_cell_id;
@@ -19,6 +22,11 @@ typedef struct {
     size_t channel;
     kstring_t* rest;
     kstring_t* tags_str;
+    // tags_str encoded as a BAM aux block, when requested
+    kstring_t* aux;
+    bool aux_error;
+    // private: storage for the comment, split in place by the parser
+    kstring_t buffer;
 } _read_meta;
 
 typedef _read_meta* read_meta;
@@ -27,10 +35,21 @@ typedef _read_meta* read_meta;
 // constructor
 read_meta create_read_meta(const kstring_t* comment);
 
+// reinitialise an existing object for a new comment, reusing its storage
+void reset_read_meta(read_meta meta, const kstring_t* comment);
+
 // destructor
 void destroy_read_meta(read_meta meta);
 
-// parser
-read_meta parse_read_meta(kstring_t comment);
+// parser, with `encode_aux` the tags are also encoded for BAM output
+read_meta parse_read_meta(kstring_t comment, bool encode_aux);
+
+// as above, but parse into an existing object to avoid per-record allocations
+void parse_read_meta_into(read_meta meta, kstring_t comment, bool encode_aux);
+
+// Parse the aux block of a BAM record into an existing object. With
+// `encode_aux` the block is copied to meta->aux, otherwise tags_str
+// holds the tags as SAM text.
+void parse_read_meta_bam(read_meta meta, const char* aux, size_t len, bool encode_aux);
 
 #endif
@@ -0,0 +1,94 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fastqmap.h"
+
+
+fastq_map fastq_map_open(const char* fname) {
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  // the mapping keeps the file open
+    if (data == MAP_FAILED) return NULL;
+    if (((char*)data)[0] != '@') {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    fastq_map fq = calloc(1, sizeof(_fastq_map));
+    if (fq == NULL) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    fq->data = data;
+    fq->size = st.st_size;
+    return fq;
+}
+
+
+void fastq_map_close(fastq_map fq) {
+    if (fq == NULL) return;
+    munmap((void*)fq->data, fq->size);
+    free(fq);
+}
+
+
+static inline void _view(kstring_t* str, const char* start, const char* end) {
+    str->s = (char*)start;
+    str->l = end - start;
+    str->m = 0;
+}
+
+// whitespace ending a read name, as isspace() but the line is already split
+static inline int _is_name_end(char c) {
+    return c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\r';
+}
+
+
+int fastq_map_next(fastq_map fq, fastq_view* rec) {
+    const char* p = fq->data + fq->pos;
+    const char* end = fq->data + fq->size;
+    if (p == end) return -1;
+    if (*p != '@') return -2;
+
+    // lines are found with memchr(), which libc vectorises
+    const char* header_end = memchr(p, '\n', end - p);
+    if (header_end == NULL) return -2;
+    const char* seq = header_end + 1;
+    const char* seq_end = memchr(seq, '\n', end - seq);
+    if (seq_end == NULL) return -2;
+    const char* plus = seq_end + 1;
+    if (plus == end || *plus != '+') return -2;
+    const char* plus_end = memchr(plus, '\n', end - plus);
+    if (plus_end == NULL) return -2;
+    const char* qual = plus_end + 1;
+    const char* qual_end = memchr(qual, '\n', end - qual);
+    if (qual_end == NULL) qual_end = end;  // no final newline
+
+    // kseq would read further lines, or strip carriage returns
+    size_t len = seq_end - seq;
+    if (len == 0 || (size_t)(qual_end - qual) != len) return -2;
+    if (*seq == '@' || *seq == '>' || *seq == '+') return -2;
+    if (seq_end[-1] == '\r' || qual_end[-1] == '\r' || header_end[-1] == '\r') return -2;
+
+    const char* name_end = p + 1;
+    while (name_end < header_end && !_is_name_end(*name_end)) ++name_end;
+    _view(&rec->name, p + 1, name_end);
+    if (name_end < header_end) _view(&rec->comment, name_end + 1, header_end);
+    else _view(&rec->comment, header_end, header_end);
+    _view(&rec->seq, seq, seq_end);
+    _view(&rec->qual, qual, qual_end);
+
+    fq->pos = qual_end == end ? fq->size : (size_t)(qual_end + 1 - fq->data);
+    return len;
+}
@@ -0,0 +1,54 @@
+#ifndef _FASTQMAP_H
+#define _FASTQMAP_H
+
+#include <stddef.h>
+
+#include "htslib/kstring.h"
+
+
+// A memory mapped, uncompressed FASTQ file, parsed in place
+typedef struct _fastq_map {
+    const char* data;
+    size_t size;
+    size_t pos;  // start of the next record
+} _fastq_map;
+typedef _fastq_map* fastq_map;
+
+// The fields of a record as views into the mapping: the strings are not
+// NUL terminated and have m set to 0, as they are not owned.
+typedef struct {
+    kstring_t name;
+    kstring_t comment;
+    kstring_t seq;
+    kstring_t qual;
+} fastq_view;
+
+/** Map an uncompressed FASTQ file.
+ *
+ * @param fname file name.
+ * @returns a fastq_map, or NULL if the file is not a non-empty regular
+ *     file starting with '@' (e.g. it is compressed, or a pipe), or
+ *     cannot be mapped.
+ *
+ */
+fastq_map fastq_map_open(const char* fname);
+
+// Unmap a file, views of its records are invalidated
+void fastq_map_close(fastq_map fq);
+
+/** Parse the next record.
+ *
+ * Only records in the common four line layout, with the sequence and quality
+ * on single lines of equal, non-zero length and without carriage returns, are
+ * parsed. Other records must be read from fq->pos with kseq, which handles
+ * them.
+ *
+ * @param fq mapped file.
+ * @param rec output record views.
+ * @returns length of the sequence, -1 at end of file, or -2 if the next
+ *     record is not in the simple layout.
+ *
+ */
+int fastq_map_next(fastq_map fq, fastq_view* rec);
+
+#endif
@@ -0,0 +1,188 @@
+#include <bzlib.h>
+#include <limits.h>
+#include <lzma.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "htslib/bgzf.h"
+#include "htslib/hfile.h"
+
+#include "instream.h"
+
+// compressed bytes read at a time for the bzip2 and xz decoders
+#define INSTREAM_BUFSIZE 65536
+
+typedef enum {CODEC_BGZF, CODEC_BZIP2, CODEC_XZ} instream_codec;
+
+struct _instream {
+    instream_codec codec;
+    BGZF* bgzf;    // gzip, BGZF and uncompressed input
+    hFILE* hfile;  // compressed input of the other decoders
+    bz_stream bz;
+    lzma_stream xz;
+    unsigned char* buf;
+    bool eof;         // all of hfile has been read into buf
+    bool stream_end;  // the decoder reached the end of a compressed stream
+};
+
+
+static instream_codec _detect_codec(hFILE* fp) {
+    static const unsigned char xz_magic[6] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+    unsigned char magic[6];
+    ssize_t n = hpeek(fp, magic, sizeof(magic));
+    if (n >= 6 && memcmp(magic, xz_magic, 6) == 0) return CODEC_XZ;
+    if (n >= 4 && memcmp(magic, "BZh", 3) == 0 && magic[3] >= '1' && magic[3] <= '9') return CODEC_BZIP2;
+    return CODEC_BGZF;
+}
+
+
+instream instream_open(const char* fname, htsThreadPool* pool) {
+    return instream_open_at(fname, 0, pool);
+}
+
+
+instream instream_open_at(const char* fname, off_t offset, htsThreadPool* pool) {
+    hFILE* hfile = hopen(fname, "r");
+    if (hfile == NULL) return NULL;
+    if (offset > 0 && hseek(hfile, offset, SEEK_SET) < 0) {
+        hclose(hfile);
+        return NULL;
+    }
+    instream in = calloc(1, sizeof(_instream));
+    if (in == NULL) {
+        fprintf(stderr, "Failed to allocate memory for input stream.\n");
+        exit(EXIT_FAILURE);
+    }
+    in->codec = _detect_codec(hfile);
+
+    bool ok = true;
+    if (in->codec == CODEC_BGZF) {
+        // BGZF also reads plain gzip and uncompressed data
+        in->bgzf = bgzf_hopen(hfile, "r");
+        if (in->bgzf == NULL) {
+            hclose(hfile);
+            free(in);
+            return NULL;
+        }
+        // plain gzip is a single stream, only BGZF blocks can be inflated in parallel
+        if (pool != NULL && pool->pool != NULL && bgzf_compression(in->bgzf) == 2) {
+            ok = bgzf_thread_pool(in->bgzf, pool->pool, pool->qsize) >= 0;
+        }
+    }
+    else {
+        in->hfile = hfile;
+        in->buf = malloc(INSTREAM_BUFSIZE);
+        if (in->buf == NULL) {
+            fprintf(stderr, "Failed to allocate memory for input stream.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (in->codec == CODEC_BZIP2) {
+            ok = BZ2_bzDecompressInit(&in->bz, 0, 0) == BZ_OK;
+        }
+        else {
+            // concatenated streams are read as one, as for gzip
+            in->xz = (lzma_stream)LZMA_STREAM_INIT;
+            ok = lzma_stream_decoder(&in->xz, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK;
+        }
+    }
+    if (!ok) {
+        instream_close(in);
+        return NULL;
+    }
+    return in;
+}
+
+
+// Refill the compressed input buffer once it has been consumed, returns -1 on error
+static int _fill(instream in, const unsigned char** next_in, size_t* avail_in) {
+    if (*avail_in > 0 || in->eof) return 0;
+    ssize_t n = hread(in->hfile, in->buf, INSTREAM_BUFSIZE);
+    if (n < 0) return -1;
+    in->eof = n == 0;
+    *next_in = in->buf;
+    *avail_in = n;
+    return 0;
+}
+
+
+static ssize_t _read_bzip2(instream in, char* out, size_t len) {
+    bz_stream* bz = &in->bz;
+    // bz_stream counts are 32 bit
+    if (len > UINT_MAX) len = UINT_MAX;
+    bz->next_out = out;
+    bz->avail_out = len;
+    while (bz->avail_out > 0) {
+        const unsigned char* next_in = (unsigned char*)bz->next_in;
+        size_t avail_in = bz->avail_in;
+        if (_fill(in, &next_in, &avail_in) < 0) return -1;
+        bz->next_in = (char*)next_in;
+        bz->avail_in = avail_in;
+        if (in->stream_end) {
+            if (bz->avail_in == 0) break;  // EOF
+            // another stream follows, as from parallel compressors
+            BZ2_bzDecompressEnd(bz);
+            if (BZ2_bzDecompressInit(bz, 0, 0) != BZ_OK) return -1;
+            bz->next_in = (char*)next_in;
+            bz->avail_in = avail_in;
+            in->stream_end = false;
+        }
+        unsigned int avail_out = bz->avail_out;
+        int ret = BZ2_bzDecompress(bz);
+        if (ret == BZ_STREAM_END) {
+            in->stream_end = true;
+        }
+        else if (ret != BZ_OK) {
+            return -1;
+        }
+        else if (in->eof && bz->avail_in == 0 && bz->avail_out == avail_out) {
+            return -1;  // truncated
+        }
+    }
+    return len - bz->avail_out;
+}
+
+
+static ssize_t _read_xz(instream in, char* out, size_t len) {
+    lzma_stream* xz = &in->xz;
+    xz->next_out = (uint8_t*)out;
+    xz->avail_out = len;
+    while (xz->avail_out > 0 && !in->stream_end) {
+        if (_fill(in, &xz->next_in, &xz->avail_in) < 0) return -1;
+        lzma_ret ret = lzma_code(xz, in->eof ? LZMA_FINISH : LZMA_RUN);
+        if (ret == LZMA_STREAM_END) {
+            in->stream_end = true;
+        }
+        else if (ret != LZMA_OK) {
+            return -1;
+        }
+    }
+    return len - xz->avail_out;
+}
+
+
+ssize_t instream_read(instream in, void* buf, size_t len) {
+    switch (in->codec) {
+        case CODEC_BZIP2: return _read_bzip2(in, buf, len);
+        case CODEC_XZ: return _read_xz(in, buf, len);
+        default: return bgzf_read(in->bgzf, buf, len);
+    }
+}
+
+
+int instream_close(instream in) {
+    if (in == NULL) return 0;
+    int ret = 0;
+    if (in->bgzf != NULL) {
+        ret = bgzf_close(in->bgzf);
+    }
+    else {
+        if (in->codec == CODEC_BZIP2) BZ2_bzDecompressEnd(&in->bz);
+        else lzma_end(&in->xz);
+        ret = hclose(in->hfile);
+    }
+    free(in->buf);
+    free(in);
+    return ret;
+}
@@ -0,0 +1,35 @@
+#ifndef _INSTREAM_H
+#define _INSTREAM_H
+
+#include <sys/types.h>
+
+#include "htslib/thread_pool.h"
+
+
+// A (possibly compressed) sequence input file, read through htslib's hFILE
+// layer. gzip, BGZF and uncompressed input is read through BGZF, so that
+// BGZF blocks can be inflated on a thread pool. bzip2 and xz compressed
+// input is decoded with libbz2 and liblzma.
+typedef struct _instream _instream;
+typedef _instream* instream;
+
+/** Open an input file, detecting its compression.
+ *
+ * @param fname file name, or "-" for stdin.
+ * @param pool thread pool for inflating BGZF input, or NULL.
+ * @returns an instream, or NULL if the file could not be opened.
+ *
+ */
+instream instream_open(const char* fname, htsThreadPool* pool);
+
+// Open an input file from a byte offset, at which compression is detected
+instream instream_open_at(const char* fname, off_t offset, htsThreadPool* pool);
+
+// Read up to len decompressed bytes, returns 0 at EOF and -1 on error.
+// This has the signature required for kseq.
+ssize_t instream_read(instream in, void* buf, size_t len);
+
+// Close an instream, returns non-zero if closing the file failed
+int instream_close(instream in);
+
+#endif
@@ -188,6 +188,68 @@ const uint64_t *sdust_core(const uint8_t *seq, int l_seq, int T, int W, int *n,
 	return buf->res.a;
 }
 
+static inline void count_masked_regions(perf_intv_v *P, int start, int *closed, int *s, int *f)
+{
+	int i;
+	perf_intv_t *p;
+	if (P->n == 0 || P->a[P->n - 1].start >= start) return;
+	p = &P->a[P->n - 1];
+	if (*f >= 0 && p->start <= *f) { // as save_masked_regions(), merge with the previous interval
+		if (p->finish > *f) *f = p->finish;
+	} else {
+		if (*f >= 0) *closed += *f - *s;
+		*s = p->start, *f = p->finish;
+	}
+	for (i = P->n - 1; i >= 0 && P->a[i].start < start; --i);
+	P->n = i + 1;
+}
+
+// sdust_core() without materialising intervals: returns the number of masked
+// bases. The scan stops early once the count is known to be at most _lo_ or
+// more than _hi_, in which case the returned value is a bound on the same
+// side of the threshold rather than the exact count.
+int sdust_count(const uint8_t *seq, int l_seq, int T, int W, int lo, int hi, sdust_buf_t *buf)
+{
+	int rv = 0, rw = 0, L = 0, cv[SD_WTOT], cw[SD_WTOT];
+	int i, start, l;
+	int closed = 0, s = -1, f = -1; // masked bases in finished intervals; the interval that may still grow
+	unsigned t;
+
+	buf->P.n = 0;
+	buf->w->front = buf->w->count = 0;
+	memset(cv, 0, SD_WTOT * sizeof(int));
+	memset(cw, 0, SD_WTOT * sizeof(int));
+	if (l_seq < 0) l_seq = strlen((const char*)seq);
+	for (i = l = t = 0; i <= l_seq; ++i) {
+		int b = i < l_seq? seq_nt4_table[seq[i]] : 4;
+		if (b < 4) {
+			++l, t = (t<<2 | b) & SD_WMSK;
+			if (l >= SD_WLEN) {
+				start = (l - W > 0? l - W : 0) + (i + 1 - l);
+				count_masked_regions(&buf->P, start, &closed, &s, &f);
+				shift_window(t, buf->w, T, W, &L, &rw, &rv, cw, cv);
+				if (rw * 10 > L * T)
+					find_perfect(buf->km, &buf->P, buf->w, T, start, L, rv, cv);
+			}
+		} else {
+			start = (l - W + 1 > 0? l - W + 1 : 0) + (i + 1 - l);
+			while (buf->P.n) count_masked_regions(&buf->P, start++, &closed, &s, &f);
+			l = t = 0;
+		}
+		if ((i & 63) == 63) {
+			int masked = closed + (f >= 0? f - s : 0);
+			if (masked > hi) return masked;
+			// later intervals start no earlier than the current window or a pending perfect
+			// interval; as the window is not cleared at Ns, they may end up to W past the end
+			int from = i + 1 - W > 0? i + 1 - W : 0;
+			if (buf->P.n && buf->P.a[buf->P.n - 1].start < from) from = buf->P.a[buf->P.n - 1].start;
+			if (f >= 0 && s < from) from = s;
+			if (closed + l_seq + W - from <= lo) return closed + l_seq + W - from;
+		}
+	}
+	return closed + (f >= 0? f - s : 0);
+}
+
 uint64_t *sdust(void *km, const uint8_t *seq, int l_seq, int T, int W, int *n)
 {
 	uint64_t *ret;
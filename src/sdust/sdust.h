@@ -45,6 +45,7 @@ uint64_t *sdust(void *km, const uint8_t *seq, int l_seq, int T, int W, int *n);
 sdust_buf_t *sdust_buf_init(void *km);
 void sdust_buf_destroy(sdust_buf_t *buf);
 const uint64_t *sdust_core(const uint8_t *seq, int l_seq, int T, int W, int *n, sdust_buf_t *buf);
+int sdust_count(const uint8_t *seq, int l_seq, int T, int W, int lo, int hi, sdust_buf_t *buf);
 
 #ifdef __cplusplus
 }
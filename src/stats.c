@@ -8,84 +8,49 @@
 #include "common.h"
 
 
-read_stats* create_length_stats(void) {
-    read_stats* stats = (read_stats*) xalloc(1, sizeof(read_stats), "length_stats");
+// bin index of a length, see LENGTH_HIST_BITS
+static inline size_t _length_bin(size_t x) {
+    if (x < ((size_t)1 << LENGTH_HIST_BITS)) return x;
+    // x is in [2^k, 2^(k+1)), keep its leading LENGTH_HIST_BITS bits
+    size_t k = 8 * sizeof(unsigned long long) - 1 - __builtin_clzll(x);
+    size_t shift = k - LENGTH_HIST_BITS + 1;
+    return (shift << (LENGTH_HIST_BITS - 1)) + (x >> shift);
+}
 
-    bin_groups* bins = (bin_groups*) xalloc(1, sizeof(bin_groups), "bin_groups");
-    stats->buckets = bins;
-    bins->n = 1;
-    bins->groups = (size_t*) xalloc(1, 3*bins->n*sizeof(size_t), "groups");
-    size_t* grps = bins->groups;
-    // - end exclusive upper edges
-    // - 0 is first lower edge
-    // - final >x bucket
-    //grps[0] =   50000; grps[1] =     1;
-    //grps[3] =  100000; grps[4] =    10;
-    //grps[6] = 1000000; grps[7] = 1000;
-    // just do one massive bucket up to 10M - 76Mbytes
-    grps[0] = 10000000; grps[1] = 1;
-
-
-    // count the total number of bins across all groups
-    stats->n = 0;
-    size_t lower = 0;
-    for (size_t i=0; i<bins->n; i++) {
-        size_t upper = bins->groups[3*i];
-        size_t step = bins->groups[3*i + 1];
-        size_t nbins = (upper - lower) / step;
-        bins->groups[3*i + 2] = nbins;
-        stats->n += nbins;
-        lower = upper;
-    }
-    stats->n++;
+// lower edge of a length bin, the upper edge is that of the next bin
+static inline size_t _length_bin_lower(size_t i) {
+    if (i < ((size_t)1 << LENGTH_HIST_BITS)) return i;
+    size_t shift = (i >> (LENGTH_HIST_BITS - 1)) - 1;
+    return (i - (shift << (LENGTH_HIST_BITS - 1))) << shift;
+}
 
-    // fill in all the edges
+static void _grow_length_stats(read_stats* stats, size_t n) {
+    // grow a power of two (a row of bins) at a time so as to not reallocate often
+    size_t m = stats->n;
+    while (m < n) m += (size_t)1 << (LENGTH_HIST_BITS - 1);
+    stats->counts = xrecalloc(stats->counts, stats->n, m, sizeof(size_t), "counts");
+    stats->n = m;
+}
+
+read_stats* create_length_stats(void) {
+    read_stats* stats = (read_stats*) xalloc(1, sizeof(read_stats), "length_stats");
     stats->width = 0;
-    stats->edges = xalloc(stats->n, sizeof(size_t), "edges");
+    stats->n = (size_t)1 << LENGTH_HIST_BITS;
     stats->counts = xalloc(stats->n, sizeof(size_t), "counts");
-    size_t i=0;
-    lower = 0;
-    size_t upper = 0;
-    for (size_t b=0; b<bins->n; b++) {
-        upper = bins->groups[3*b];
-        size_t step = bins->groups[3*b + 1];
-        for (size_t j=lower; j<upper; j+=step, i++) {
-            stats->edges[i] = j;
-        }
-        lower = upper;
-    }
-    stats->edges[i] = upper;
     return stats;
 }
 
 void destroy_length_stats(read_stats* stats) {
     if (stats != NULL) {
-        free(stats->buckets->groups);
-        free(stats->buckets);
-        free(stats->edges);
         free(stats->counts);
         free(stats);
     }
 }
 
 void add_length_count(read_stats* stats, size_t x) {
-    size_t lower = 0;
-    size_t cum_bin = 0;
-    bool done = false;
-    for (size_t i=0; i<stats->buckets->n; i++) {
-        size_t upper = stats->buckets->groups[3*i];
-        if (x < upper) {
-            size_t step = stats->buckets->groups[3*i + 1];
-            stats->counts[cum_bin + (x - lower) / step]++;
-            done = true;
-            break;
-        }
-        lower = upper;
-        cum_bin += stats->buckets->groups[3*i + 2];
-    }
-    if (!done) {
-        stats->counts[cum_bin]++;
-    }
+    size_t i = _length_bin(x);
+    if (i >= stats->n) _grow_length_stats(stats, i + 1);
+    stats->counts[i]++;
 }
 
 
@@ -110,18 +75,34 @@ void add_qual_count(read_stats* stats, float q) {
     stats->counts[(int) (q / stats->width)]++;
 }
 
+void merge_stats(read_stats* dst, const read_stats* src) {
+    if (dst->width != src->width) {
+        fprintf(stderr, "Cannot merge histograms with different bins.\n");
+        exit(1);
+    }
+    if (src->n > dst->n) _grow_length_stats(dst, src->n);
+    for (size_t i=0; i<src->n; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+}
+
 void print_stats(read_stats* stats, bool zeroes, bool tsv, FILE* fp) {
     if (fp == NULL) {
         fp = stderr;
     }
     if (stats->width == 0) {
-        for (size_t i=0; i<stats->n; i++) {
+        // trailing empty bins are only an artefact of allocation
+        size_t n = stats->n;
+        while (n > 0 && stats->counts[n - 1] == 0) n--;
+        for (size_t i=0; i<n; i++) {
             if (stats->counts[i] == 0 && !zeroes) continue;
+            size_t lower = _length_bin_lower(i);
+            size_t upper = _length_bin_lower(i + 1);
             if (tsv) {
-                fprintf(fp, "%zu\t%zu\t%zu\n", stats->edges[i], stats->edges[i+1], stats->counts[i]);
+                fprintf(fp, "%zu\t%zu\t%zu\n", lower, upper, stats->counts[i]);
             }
             else {
-                fprintf(fp, "[%zu, %zu)\t%zu\n", stats->edges[i], stats->edges[i+1], stats->counts[i]);
+                fprintf(fp, "[%zu, %zu)\t%zu\n", lower, upper, stats->counts[i]);
             }
         }
     }
@@ -7,21 +7,19 @@
 #define ACC_HIST_WIDTH 0.0001  // ACC is linear %age, Q60
 #define COV_HIST_WIDTH 0.01    // COV is linear %age
 
-typedef struct {
-    size_t n;
-    size_t* groups;  // 3 items: upper, step, number 
-} bin_groups;
-
+// Lengths are binned log-linearly: exactly below 2^LENGTH_HIST_BITS, and
+// above that each power of two is split into 2^(LENGTH_HIST_BITS-1) bins,
+// bounding the relative bin width to 2^-(LENGTH_HIST_BITS-1) (~0.02%).
+#define LENGTH_HIST_BITS 13
 
 typedef struct {
     size_t n;
-    float width;  // for fixed width
-    size_t* edges;
+    float width;  // for fixed width, 0 for log-linear length bins
     size_t* counts;
-    bin_groups* buckets;
 } read_stats;
 
 
+// length bins are allocated as required by the longest length counted
 read_stats* create_length_stats(void);
 void destroy_length_stats(read_stats* stats);
 void add_length_count(read_stats* stats, size_t);
@@ -31,6 +29,9 @@ read_stats* create_qual_stats(float width);
 void destroy_qual_stats(read_stats* stats);
 void add_qual_count(read_stats* stats, float q);
 
+// add the counts of `src` to `dst`, both must be of the same kind
+void merge_stats(read_stats* dst, const read_stats* src);
+
 void print_stats(read_stats* stats, bool zeroes, bool tsv, FILE* fp);
 
 size_t _leading_decimals(float num);
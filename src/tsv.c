@@ -0,0 +1,136 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "tsv.h"
+
+
+tsv_writer open_tsv_writer(FILE* fp, BGZF* bgzf) {
+    tsv_writer writer = xalloc(1, sizeof(_tsv_writer), "TSV writer");
+    writer->fp = fp;
+    writer->bgzf = bgzf;
+    writer->first = 1;
+    ks_resize(&writer->buffer, TSV_BUFFER_SIZE);
+    return writer;
+}
+
+
+static void _write_buffer(tsv_writer writer) {
+    if (writer->buffer.l == 0) return;
+    int ok = writer->bgzf != NULL
+        ? bgzf_write(writer->bgzf, writer->buffer.s, writer->buffer.l) == (ssize_t)writer->buffer.l
+        : fwrite(writer->buffer.s, 1, writer->buffer.l, writer->fp) == writer->buffer.l;
+    if (!ok) {
+        fprintf(stderr, "Error writing per-read summary.\n");
+        exit(EXIT_FAILURE);
+    }
+    writer->buffer.l = 0;
+}
+
+
+static inline void _separate(tsv_writer writer) {
+    if (writer->first) writer->first = 0;
+    else kputc_('\t', &writer->buffer);
+}
+
+void tsv_str(tsv_writer writer, const char* value) {
+    tsv_strn(writer, value, strlen(value));
+}
+
+void tsv_strn(tsv_writer writer, const char* value, size_t len) {
+    _separate(writer);
+    kputsn_(value, len, &writer->buffer);
+}
+
+void tsv_char(tsv_writer writer, char value) {
+    _separate(writer);
+    kputc_(value, &writer->buffer);
+}
+
+static inline void _put_u64(kstring_t* out, uint64_t value) {
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[sizeof(digits) - ++n] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    kputsn_(digits + sizeof(digits) - n, n, out);
+}
+
+void tsv_u64(tsv_writer writer, uint64_t value) {
+    _separate(writer);
+    _put_u64(&writer->buffer, value);
+}
+
+void tsv_i64(tsv_writer writer, int64_t value) {
+    _separate(writer);
+    if (value < 0) {
+        kputc_('-', &writer->buffer);
+        _put_u64(&writer->buffer, -(uint64_t)value);
+    }
+    else {
+        _put_u64(&writer->buffer, value);
+    }
+}
+
+
+void kput_fixed(kstring_t* out, float value, int decimals) {
+    static const uint64_t scale[] = {1, 10, 100, 1000, 10000};
+    // larger values would overflow the integer below
+    if (!isfinite(value) || fabsf(value) >= 1e12f || decimals < 0 || decimals > 4) {
+        ksprintf(out, "%.*f", decimals, value);
+        return;
+    }
+    // a float has a 24 bit significand, so its product with a power of ten
+    // up to 10^4 is exact as a double. Rounding to an integer in the default
+    // mode, to nearest with ties to even, is then as printf rounds the
+    // exact decimal value of its argument.
+    double scaled = rint((double)value * scale[decimals]);
+    if (signbit(value)) {
+        kputc('-', out);
+        scaled = -scaled;
+    }
+    uint64_t fixed = (uint64_t)scaled;
+    _put_u64(out, fixed / scale[decimals]);
+    if (decimals > 0) {
+        char frac[4];
+        uint64_t rem = fixed % scale[decimals];
+        for (int i = decimals - 1; i >= 0; --i) {
+            frac[i] = '0' + rem % 10;
+            rem /= 10;
+        }
+        kputc('.', out);
+        kputsn(frac, decimals, out);
+    }
+}
+
+void tsv_float(tsv_writer writer, float value, int decimals) {
+    _separate(writer);
+    kput_fixed(&writer->buffer, value, decimals);
+}
+
+
+void tsv_end_row(tsv_writer writer) {
+    kputc('\n', &writer->buffer);
+    writer->first = 1;
+    if (writer->buffer.l >= TSV_BUFFER_SIZE) _write_buffer(writer);
+}
+
+
+void flush_tsv_writer(tsv_writer writer) {
+    _write_buffer(writer);
+    int ret = writer->bgzf != NULL ? bgzf_flush(writer->bgzf) : fflush(writer->fp);
+    if (ret != 0) {
+        fprintf(stderr, "Error writing per-read summary.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void close_tsv_writer(tsv_writer writer) {
+    if (writer == NULL) return;
+    _write_buffer(writer);
+    free(writer->buffer.s);
+    free(writer);
+}
@@ -0,0 +1,64 @@
+#ifndef FASTCAT_TSV_H
+#define FASTCAT_TSV_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "htslib/bgzf.h"
+#include "htslib/kstring.h"
+
+// Rows of tab-separated text formatted without printf into a large buffer,
+// which is written to a file, or to BGZF output, as it fills. The output is
+// identical to that of the equivalent printf conversions.
+
+#define TSV_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+    FILE* fp;
+    BGZF* bgzf;
+    kstring_t buffer;
+    int first;  // whether the next value starts a row
+} _tsv_writer;
+
+typedef _tsv_writer* tsv_writer;
+
+/** Start writing rows to a file or to BGZF output, which remain owned by
+ *  the caller. One of `fp` and `bgzf` should be given.
+ *
+ *  @param fp output file, or NULL.
+ *  @param bgzf BGZF output, or NULL.
+ *  @returns a TSV writer.
+ *
+ */
+tsv_writer open_tsv_writer(FILE* fp, BGZF* bgzf);
+
+// Add the next value of the current row
+void tsv_str(tsv_writer writer, const char* value);
+void tsv_strn(tsv_writer writer, const char* value, size_t len);
+void tsv_char(tsv_writer writer, char value);
+// as %lu, %zu or %u
+void tsv_u64(tsv_writer writer, uint64_t value);
+// as %ld or %d
+void tsv_i64(tsv_writer writer, int64_t value);
+// as %.*f, `decimals` is at most 4
+void tsv_float(tsv_writer writer, float value, int decimals);
+
+// Complete the current row, writing out the buffer if it is full
+void tsv_end_row(tsv_writer writer);
+
+// Write out the buffer and flush the output
+void flush_tsv_writer(tsv_writer writer);
+
+// Write out the buffer, the output is not closed
+void close_tsv_writer(tsv_writer writer);
+
+/** Format a float as printf's %.*f would.
+ *
+ *  @param out output string, appended to.
+ *  @param value value to format.
+ *  @param decimals number of decimal places, at most 4.
+ *
+ */
+void kput_fixed(kstring_t* out, float value, int decimals);
+
+#endif
@@ -0,0 +1,165 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ubam.h"
+
+
+bool is_bam_filename(const char* fname) {
+    size_t len = strlen(fname);
+    return len >= 4 && strcmp(fname + len - 4, ".bam") == 0;
+}
+
+
+bool is_primary_record(const bam1_t* b) {
+    return (b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) == 0;
+}
+
+
+static size_t aux_type_size(char type) {
+    switch (type) {
+        case 'A': case 'c': case 'C': return 1;
+        case 's': case 'S': return 2;
+        case 'i': case 'I': case 'f': return 4;
+        case 'd': return 8;
+        default: return 0;
+    }
+}
+
+
+size_t aux_value_size(const char* s, const char* end) {
+    if (end - s < 4) return 0;
+    size_t size = 0;
+    switch (s[2]) {
+        case 'Z': case 'H': {
+            const char* nul = memchr(s + 3, '\0', end - s - 3);
+            return nul == NULL ? 0 : nul - s - 2;
+        }
+        case 'B': {
+            // subtype, 32bit count, values
+            size_t width = aux_type_size(s[3]);
+            if (width == 0 || end - s < 8) return 0;
+            uint32_t n;
+            memcpy(&n, s + 4, 4);  // BAM, like the hosts we build for, is little-endian
+            size = 5 + (size_t)n * width;
+            break;
+        }
+        default:
+            size = aux_type_size(s[2]);
+            if (size == 0) return 0;
+    }
+    return size <= (size_t)(end - s - 3) ? size : 0;
+}
+
+
+static int64_t aux_int_at(char type, const char* p) {
+    switch (type) {
+        case 'c': { int8_t v; memcpy(&v, p, 1); return v; }
+        case 'C': { uint8_t v; memcpy(&v, p, 1); return v; }
+        case 's': { int16_t v; memcpy(&v, p, 2); return v; }
+        case 'S': { uint16_t v; memcpy(&v, p, 2); return v; }
+        case 'i': { int32_t v; memcpy(&v, p, 4); return v; }
+        case 'I': { uint32_t v; memcpy(&v, p, 4); return v; }
+        default: return 0;
+    }
+}
+
+
+int64_t aux_int_value(const char* s) {
+    return aux_int_at(s[2], s + 3);
+}
+
+
+static void format_aux_number(char type, const char* p, kstring_t* out) {
+    switch (type) {
+        case 'f': { float v; memcpy(&v, p, 4); ksprintf(out, "%g", v); break; }
+        case 'd': { double v; memcpy(&v, p, 8); ksprintf(out, "%g", v); break; }
+        default: ksprintf(out, "%" PRId64, aux_int_at(type, p));
+    }
+}
+
+
+void format_aux_entry(const char* s, kstring_t* out) {
+    char type = s[2];
+    kputsn(s, 2, out);
+    kputc(':', out);
+    switch (type) {
+        case 'A':
+            kputsn("A:", 2, out);
+            kputc(s[3], out);
+            break;
+        case 'Z': case 'H':
+            kputc(type, out);
+            kputc(':', out);
+            kputs(s + 3, out);
+            break;
+        case 'B': {
+            char sub = s[3];
+            size_t width = aux_type_size(sub);
+            uint32_t n;
+            memcpy(&n, s + 4, 4);
+            kputsn("B:", 2, out);
+            kputc(sub, out);
+            for (uint32_t i = 0; i < n; ++i) {
+                kputc(',', out);
+                format_aux_number(sub, s + 8 + i * width, out);
+            }
+            break;
+        }
+        case 'f': case 'd':
+            kputc(type, out);
+            kputc(':', out);
+            format_aux_number(type, s + 3, out);
+            break;
+        default:
+            // all integer types are written as 'i' in SAM text
+            kputsn("i:", 2, out);
+            format_aux_number(type, s + 3, out);
+    }
+}
+
+
+void format_aux(const char* aux, size_t len, kstring_t* out) {
+    const char* s = aux;
+    const char* end = aux + len;
+    size_t size;
+    while ((size = aux_value_size(s, end)) > 0) {
+        if (s != aux) kputc('\t', out);
+        format_aux_entry(s, out);
+        s += 3 + size;
+    }
+}
+
+
+static const char nt16_complement[] = "=TGKCYSBAWRDMHVN";
+
+void bam_to_fastq(const bam1_t* b, kstring_t* name, kstring_t* seq, kstring_t* qual) {
+    name->l = 0;
+    kputs(bam_get_qname(b), name);
+
+    size_t len = b->core.l_qseq;
+    const uint8_t* s = bam_get_seq(b);
+    const uint8_t* q = bam_get_qual(b);
+    bool reverse = (b->core.flag & BAM_FREVERSE) != 0;
+    seq->l = 0;
+    ks_resize(seq, len + 1);
+    qual->l = 0;
+    bool has_qual = len > 0 && q[0] != 0xff;
+    if (has_qual) ks_resize(qual, len + 1);
+    // aligned records may be stored reverse complemented
+    for (size_t i = 0; i < len; ++i) {
+        size_t j = reverse ? len - 1 - i : i;
+        seq->s[i] = reverse ? nt16_complement[bam_seqi(s, j)] : seq_nt16_str[bam_seqi(s, j)];
+        if (has_qual) qual->s[i] = q[j] + 33;
+    }
+    seq->l = len;
+    seq->s[len] = '\0';
+    if (has_qual) {
+        qual->l = len;
+        qual->s[len] = '\0';
+    }
+    else {
+        ks_resize(qual, 1);
+        qual->s[0] = '\0';
+    }
+}
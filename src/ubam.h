@@ -0,0 +1,48 @@
+#ifndef _UBAM_H
+#define _UBAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "htslib/kstring.h"
+#include "htslib/sam.h"
+
+
+// check whether a filename has a .bam extension
+bool is_bam_filename(const char* fname);
+
+// Whether a record should be output as a read: secondary and
+// supplementary records repeat a primary record
+bool is_primary_record(const bam1_t* b);
+
+/** Size of the value of a BAM aux entry.
+ *
+ * @param s start of the entry (the tag).
+ * @param end end of the aux block.
+ * @returns size of the value following the tag and type, or 0 if the
+ *     entry is malformed or runs past the end of the block.
+ *
+ */
+size_t aux_value_size(const char* s, const char* end);
+
+// Integer value of a BAM aux entry of integer type
+int64_t aux_int_value(const char* s);
+
+// Append an aux entry, starting at its tag, as SAM text (TG:T:VALUE)
+void format_aux_entry(const char* s, kstring_t* out);
+
+// Append all entries of an aux block as tab separated SAM text
+void format_aux(const char* aux, size_t len, kstring_t* out);
+
+/** Decode the query of a BAM record as a FASTQ record.
+ *
+ * @param b BAM record.
+ * @param name output read name.
+ * @param seq output sequence, in original read orientation.
+ * @param qual output phred+33 qualities, empty if the record has none.
+ *
+ */
+void bam_to_fastq(const bam1_t* b, kstring_t* name, kstring_t* seq, kstring_t* qual);
+
+#endif
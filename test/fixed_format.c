@@ -0,0 +1,62 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/tsv.h"
+
+
+// compare kput_fixed() with printf for a value
+static size_t check(float value, kstring_t* out) {
+    size_t failures = 0;
+    char expected[64];
+    for (int decimals = 0; decimals <= 4; ++decimals) {
+        snprintf(expected, sizeof(expected), "%.*f", decimals, value);
+        out->l = 0;
+        kput_fixed(out, value, decimals);
+        if (out->l != strlen(expected) || memcmp(out->s, expected, out->l) != 0) {
+            if (failures++ < 10) {
+                fprintf(stderr, "%.9g to %d places: expected '%s', got '%.*s'\n",
+                    value, decimals, expected, (int)out->l, out->s);
+            }
+        }
+    }
+    return failures;
+}
+
+
+int main() {
+    kstring_t out = {0, 0, NULL};
+    size_t failures = 0;
+    float special[] = {
+        0.0f, -0.0f, 0.005f, 0.015f, 0.125f, 0.375f, 2.5f, 3.5f, -2.5f, -0.001f,
+        0.00005f, 0.99995f, 9.995f, 99.995f, 14.03f, 13.91f, 100.0f, 1e9f, 1e12f, 3e12f,
+        NAN, -NAN, INFINITY, -INFINITY};
+    for (size_t i = 0; i < sizeof(special) / sizeof(float); ++i) {
+        failures += check(special[i], &out);
+    }
+    // all quarters of a hundredth, which include exact ties, over the range
+    // of qualities and percentages
+    for (int i = -40000; i <= 40000; ++i) {
+        failures += check(i / 400.0f, &out);
+    }
+    // neighbouring floats of values near rounding boundaries
+    for (int i = 0; i <= 100000; ++i) {
+        float x = i / 1000.0f + 0.0005f;
+        failures += check(x, &out);
+        failures += check(nextafterf(x, 0), &out);
+        failures += check(nextafterf(x, 1000), &out);
+    }
+    srand(42);
+    for (int i = 0; i < 1000000; ++i) {
+        float x = (float)rand() / RAND_MAX * 200.0f - 50.0f;
+        failures += check(x, &out);
+    }
+    free(out.s);
+    if (failures > 0) {
+        fprintf(stderr, "%zu values formatted differently to printf\n", failures);
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "Fixed precision formatting matches printf\n");
+    return EXIT_SUCCESS;
+}
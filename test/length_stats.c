@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#include "../src/stats.h"
+
+
+// print a histogram and read back its bins
+size_t read_bins(read_stats* stats, bool zeroes, size_t* lower, size_t* upper, size_t* count, size_t max) {
+    FILE* fp = tmpfile();
+    print_stats(stats, zeroes, true, fp);
+    rewind(fp);
+    size_t n = 0;
+    while (n < max && fscanf(fp, "%zu\t%zu\t%zu\n", &lower[n], &upper[n], &count[n]) == 3) {
+        n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+
+int main() {
+    size_t lengths[] = {
+        0, 1, 500, 8191, 8192, 8193, 8194, 16383, 16384, 16385,
+        100000, 1000000, 4999999, 10000000, 123456789, 1099511627776,
+    };
+    size_t nlengths = sizeof(lengths)/sizeof(size_t);
+    size_t max_bins = 1 << 16;
+    size_t* lower = calloc(max_bins, sizeof(size_t));
+    size_t* upper = calloc(max_bins, sizeof(size_t));
+    size_t* count = calloc(max_bins, sizeof(size_t));
+
+    int fails = 0;
+    for (size_t i = 0; i < nlengths; i++) {
+        size_t x = lengths[i];
+        printf("Test case %zu: %zu\n", i, x);
+
+        read_stats* stats = create_length_stats();
+        add_length_count(stats, x);
+        size_t n = read_bins(stats, false, lower, upper, count, max_bins);
+
+        int fail = 0;
+        fail += n != 1;
+        fail += count[0] != 1;
+        fail += x < lower[0] || x >= upper[0];
+        // exact for short lengths, bounded relative width otherwise
+        if (x < (1 << LENGTH_HIST_BITS)) {
+            fail += upper[0] - lower[0] != 1;
+        } else {
+            fail += upper[0] - lower[0] > lower[0] >> (LENGTH_HIST_BITS - 1);
+        }
+        if (fail) {
+            fails++;
+            printf("  Failed\n");
+            printf("    Got: %zu bins, [%zu, %zu) %zu\n", n, lower[0], upper[0], count[0]);
+        }
+        destroy_length_stats(stats);
+        printf("\n");
+    }
+
+    // bins are contiguous, and merging adds counts
+    printf("Test merge\n");
+    read_stats* a = create_length_stats();
+    read_stats* b = create_length_stats();
+    for (size_t i = 0; i < nlengths - 1; i++) {
+        add_length_count(i % 2 ? a : b, lengths[i]);
+    }
+    merge_stats(a, b);
+    size_t n = read_bins(a, true, lower, upper, count, max_bins);
+    size_t total = 0;
+    int fail = lower[0] != 0;
+    for (size_t i = 0; i < n; i++) {
+        total += count[i];
+        if (i > 0) fail += lower[i] != upper[i - 1];
+    }
+    fail += total != nlengths - 1;
+    if (fail) {
+        fails++;
+        printf("  Failed\n");
+        printf("    Got: %zu bins, total %zu\n", n, total);
+    }
+    destroy_length_stats(a);
+    destroy_length_stats(b);
+    printf("\n");
+
+    free(lower);
+    free(upper);
+    free(count);
+
+    if (fails == 0) {
+        printf("All tests passed\n");
+    } else {
+        printf("%d tests failed\n", fails);
+    }
+    return fails != 0;
+}
@@ -0,0 +1,76 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#include "../src/common.h"
+
+
+// relative tolerance, the naive sums accumulate rounding error
+#define TOL 1e-5
+
+
+int check(const char* name, size_t len, float expected, float got) {
+    if (isnan(expected) && isnan(got)) return 0;
+    if (fabsf(expected - got) <= TOL * fabsf(expected)) return 0;
+    fprintf(stderr, "FAIL %s len=%zu: expected %f, got %f\n", name, len, expected, got);
+    return 1;
+}
+
+
+int main() {
+    srand(42);
+    size_t max_len = 10000;
+    char* qual = malloc(max_len + 1);
+    uint8_t* bqual = malloc(max_len + 1);
+    size_t lengths[] = {0, 1, 3, 4, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 1000, 9999, 10000};
+    size_t nlengths = sizeof(lengths)/sizeof(size_t);
+
+    int fails = 0;
+    for (size_t i = 0; i < nlengths; i++) {
+        size_t len = lengths[i];
+        // full range of scores, a narrow range and a constant read
+        for (int mode = 0; mode < 3; mode++) {
+            for (size_t j = 0; j < len; j++) {
+                int q = mode == 0 ? rand() % 94 : mode == 1 ? 5 + rand() % 20 : 40;
+                qual[j] = (char)(q + 33);
+                bqual[j] = (uint8_t)q;
+            }
+            // also check unaligned starts
+            for (size_t s = 0; s < 2 && s <= len; s++) {
+                fails += check("mean_qual", len - s,
+                    mean_qual_naive(qual + s, len - s), mean_qual(qual + s, len - s));
+                fails += check("mean_qual_from_bam", len - s,
+                    mean_qual_from_bam_naive(bqual + s, len - s), mean_qual_from_bam(bqual + s, len - s));
+            }
+        }
+    }
+    printf("Checked %zu lengths\n", nlengths);
+
+    // missing qualities
+    bqual[0] = 0xff;
+    if (!isnan(mean_qual_from_bam(bqual, 10))) {
+        fprintf(stderr, "FAIL missing BAM qualities should be NaN\n");
+        fails++;
+    }
+
+    // out of range scores are clamped rather than read out of bounds
+    memset(qual, ' ', 100);
+    fails += check("clamp low", 100, 0.0f, mean_qual(qual, 100));
+    memset(bqual, 99, 100);
+    float top = mean_qual_from_bam_naive(bqual, 100);
+    memset(qual, 0xff, 100);
+    fails += check("clamp high", 100, top, mean_qual(qual, 100));
+    memset(bqual, 200, 100);
+    fails += check("clamp high bam", 100, top, mean_qual_from_bam(bqual, 100));
+
+    free(qual);
+    free(bqual);
+    if (fails) {
+        fprintf(stderr, "%d failures\n", fails);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}
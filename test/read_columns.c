@@ -0,0 +1,150 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/columns.h"
+
+
+// Print a per-read columns file as TSV, for comparison with TSV output. Floats
+// are printed to the decimal places of the TSV: four for bamstats' coverage
+// and ref_coverage, otherwise two. Assumes a little-endian host.
+
+static uint8_t* data;
+static size_t size, pos;
+
+static const uint8_t* take(size_t n) {
+    if (size - pos < n) {
+        fprintf(stderr, "Truncated columns file.\n");
+        exit(EXIT_FAILURE);
+    }
+    pos += n;
+    return data + pos - n;
+}
+
+static uint32_t take_u32(void) {
+    const uint8_t* p = take(4);
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t take_u64(void) {
+    uint64_t lo = take_u32();
+    return lo | (uint64_t)take_u32() << 32;
+}
+
+static char* take_str(void) {
+    uint32_t len = take_u32();
+    char* str = calloc(len + 1, 1);
+    memcpy(str, take(len), len);
+    return str;
+}
+
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: read_columns <file>\n");
+        return EXIT_FAILURE;
+    }
+    FILE* fp = fopen(argv[1], "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot open '%s'.\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    size_t m = 1 << 20;
+    data = malloc(m);
+    size_t n;
+    while ((n = fread(data + size, 1, m - size, fp)) > 0) {
+        size += n;
+        if (size == m) data = realloc(data, m *= 2);
+    }
+    fclose(fp);
+
+    if (memcmp(take(8), "RDCOLS\0\1", 8) != 0) {
+        fprintf(stderr, "Not a columns file.\n");
+        return EXIT_FAILURE;
+    }
+    uint32_t n_columns = take_u32();
+    uint8_t* types = calloc(n_columns, 1);
+    char*** dicts = calloc(n_columns, sizeof(char**));
+    uint32_t* n_dict = calloc(n_columns, sizeof(uint32_t));
+    int* decimals = calloc(n_columns, sizeof(int));
+    for (uint32_t i = 0; i < n_columns; ++i) {
+        types[i] = *take(1);
+        char* name = take_str();
+        decimals[i] = strcmp(name, "coverage") == 0 || strcmp(name, "ref_coverage") == 0 ? 4 : 2;
+        printf("%s%s", name, i + 1 == n_columns ? "\n" : "\t");
+        free(name);
+    }
+
+    // start of each column's data in the chunk
+    const uint8_t** starts = calloc(n_columns, sizeof(uint8_t*));
+    uint32_t n_rows;
+    while ((n_rows = take_u32()) > 0) {
+        for (uint32_t i = 0; i < n_columns; ++i) {
+            uint64_t col_size = take_u64();
+            size_t end = pos + col_size;
+            if (types[i] == COLUMN_DICT) {
+                uint32_t n_new = take_u32();
+                dicts[i] = realloc(dicts[i], (n_dict[i] + n_new) * sizeof(char*));
+                for (uint32_t j = 0; j < n_new; ++j) {
+                    dicts[i][n_dict[i]++] = take_str();
+                }
+            }
+            starts[i] = take(end - pos);
+        }
+        for (uint32_t r = 0; r < n_rows; ++r) {
+            for (uint32_t i = 0; i < n_columns; ++i) {
+                const uint8_t* col = starts[i];
+                uint32_t x;
+                uint64_t y;
+                float f;
+                switch (types[i]) {
+                    case COLUMN_STR: {
+                        uint32_t begin = 0, end;
+                        if (r > 0) memcpy(&begin, col + 4 * (r - 1), 4);
+                        memcpy(&end, col + 4 * r, 4);
+                        printf("%.*s", (int)(end - begin), (const char*)col + 4 * n_rows + begin);
+                        break;
+                    }
+                    case COLUMN_DICT:
+                        memcpy(&x, col + 4 * r, 4);
+                        printf("%s", dicts[i][x]);
+                        break;
+                    case COLUMN_U32:
+                        memcpy(&x, col + 4 * r, 4);
+                        printf("%u", x);
+                        break;
+                    case COLUMN_I64:
+                        memcpy(&y, col + 8 * r, 8);
+                        printf("%lld", (long long)(int64_t)y);
+                        break;
+                    case COLUMN_U64:
+                        memcpy(&y, col + 8 * r, 8);
+                        printf("%llu", (unsigned long long)y);
+                        break;
+                    case COLUMN_F32:
+                        memcpy(&f, col + 4 * r, 4);
+                        printf("%.*f", decimals[i], f);
+                        break;
+                }
+                printf("%s", i + 1 == n_columns ? "\n" : "\t");
+            }
+        }
+    }
+    if (pos != size) {
+        fprintf(stderr, "Unexpected data after end of columns file.\n");
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < n_columns; ++i) {
+        for (uint32_t j = 0; j < n_dict[i]; ++j) free(dicts[i][j]);
+        free(dicts[i]);
+    }
+    free(dicts);
+    free(n_dict);
+    free(decimals);
+    free(starts);
+    free(types);
+    free(data);
+    return EXIT_SUCCESS;
+}
@@ -89,10 +89,57 @@ int main() {
             printf("         Got: %s %s %s %s\n", info->runid, info->basecaller, info->modcaller, info->barcode);
         }
 
-        free(info);
+        // cached lookups should agree, and return the same object for the same ID
+        const readgroup* cached = get_rg_info(read_group);
+        char* copy = strdup(read_group);
+        if (cached != get_rg_info(copy)
+                || compare(cached->runid, info->runid) != 0
+                || compare(cached->basecaller, info->basecaller) != 0
+                || compare(cached->modcaller, info->modcaller) != 0
+                || compare(cached->barcode, info->barcode) != 0) {
+            fails++;
+            printf("  Failed: cached read group differs\n");
+        }
+        free(copy);
+
+        destroy_rg_info(info);
+        free(read_group);
+        printf("\n");
+    }
+
+    // only a `-` followed by at most 8 hex digits is a samtools suffix
+    typedef struct {
+        char* suffix;
+        char* basecaller;
+    } SuffixCase;
+    SuffixCase suffix_cases[] = {
+        {"-", basecall_model},
+        {"-a", basecall_model},
+        {"-1A2B3C4D", basecall_model},
+        {"-1A2B3C4D5", "basecall_model_name@v1.2.3-1A2B3C4D5"},
+        {"-12G", "basecall_model_name@v1.2.3-12G"},
+        {"-1-2", "basecall_model_name@v1.2.3-1"},
+    };
+    for (size_t i = 0; i < sizeof(suffix_cases)/sizeof(SuffixCase); i++) {
+        char* read_group = calloc(400, sizeof(char));
+        read_group = strcpy(read_group, runid_acquisition);
+        read_group = strcat(read_group, "_");
+        read_group = strcat(read_group, basecall_model);
+        read_group = strcat(read_group, suffix_cases[i].suffix);
+        printf("Suffix case %zu: %s\n", i, read_group);
+
+        const readgroup* info = get_rg_info(read_group);
+        if (compare(info->runid, runid_acquisition) != 0
+                || compare(info->basecaller, suffix_cases[i].basecaller) != 0) {
+            fails++;
+            printf("  Failed\n");
+            printf("    Expected: %s %s\n", runid_acquisition, suffix_cases[i].basecaller);
+            printf("         Got: %s %s\n", info->runid, info->basecaller);
+        }
         free(read_group);
         printf("\n");
     }
+    destroy_rg_cache();
 
     if (fails == 0) {
         printf("All tests passed\n");